@@ -0,0 +1,14 @@
+#include <atomic>
+
+#include "allocation_counter.hpp"
+
+static std::atomic<long (*)()> installed_counter{nullptr};
+
+long heap_allocation_count() {
+    long (*counter)() = installed_counter.load(std::memory_order_relaxed);
+    return counter ? counter() : 0;
+}
+
+void set_heap_allocation_counter(long (*counter)()) {
+    installed_counter.store(counter, std::memory_order_relaxed);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+/*
+ * Number of heap allocations so far, in any thread. Used to check that
+ * steady state rendering does not allocate.
+ *
+ * The library does not replace operator new itself, since that would change
+ * allocation for every program linking it. A program that wants the count
+ * installs its own counter; without one the count stays 0.
+ */
+long heap_allocation_count();
+
+void set_heap_allocation_counter(long (*counter)());
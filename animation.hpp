@@ -0,0 +1,101 @@
+#pragma once
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "scene_io.hpp"
+
+/*
+ * Trajectory files animate the explicit balls of a scene, one frame after
+ * the other. '#' starts a comment:
+ *
+ *   frame
+ *   move BALL X Y Z
+ *   camera X Y Z
+ *
+ * frame starts the next frame, and the move lines after it put the ball
+ * with index BALL, counted from 0 in scene file order, at X Y Z. camera
+ * puts the camera at X Y Z. Balls and camera not moved in a frame stay
+ * where they were in the frame before; the first frame starts from the
+ * scene file and the default camera.
+ */
+
+struct BallMove {
+    int ball;
+    Vector3 pos;
+};
+
+struct Trajectory {
+    // frame i moves the balls moves[first[i]] .. moves[first[i+1]-1]
+    std::vector<int> first;
+    std::vector<BallMove> moves;
+    std::vector<Camera> cameras;
+
+    int frame_count() const {
+        return static_cast<int>(first.size()) - 1;
+    }
+};
+
+/*
+ * Reads the trajectory file at path for a scene with ball_count explicit
+ * balls. Prints the offending line and returns nothing if it is malformed.
+ */
+inline std::optional<Trajectory> load_trajectory(const std::string &path, int ball_count) {
+    std::ifstream input(path);
+    if (!input) {
+        fprintf(stderr, "Cannot open trajectory file %s\n", path.c_str());
+        return std::nullopt;
+    }
+    Trajectory trajectory;
+    std::string text;
+    int line_number = 0;
+    while (std::getline(input, text)) {
+        line_number++;
+        std::istringstream line(text.substr(0, text.find('#')));
+        std::string kind;
+        if (!(line >> kind)) {
+            continue;
+        }
+        bool ok = true;
+        if (kind == "frame") {
+            trajectory.first.push_back(static_cast<int>(trajectory.moves.size()));
+            trajectory.cameras.push_back(trajectory.cameras.empty() ? Camera() : trajectory.cameras.back());
+        } else if (kind == "move") {
+            BallMove move;
+            ok = !trajectory.first.empty() &&
+                static_cast<bool>(line >> move.ball >> move.pos.x >> move.pos.y >> move.pos.z) &&
+                move.ball >= 0 && move.ball < ball_count;
+            trajectory.moves.push_back(move);
+        } else if (kind == "camera") {
+            ok = !trajectory.cameras.empty() && parse_vector(line, trajectory.cameras.back().pos);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%d: cannot parse \"%s\"\n", path.c_str(), line_number, text.c_str());
+            return std::nullopt;
+        }
+    }
+    trajectory.first.push_back(static_cast<int>(trajectory.moves.size()));
+    return trajectory;
+}
+
+/*
+ * Moves the balls of scene to where they are in frame and refits the
+ * acceleration structures to them. Returns the balls that were moved.
+ */
+inline std::vector<int> apply_frame(const Trajectory &trajectory, int frame, Scene &scene) {
+    std::vector<int> moved;
+    for (int i = trajectory.first[frame]; i < trajectory.first[frame + 1]; i++) {
+        const BallMove &move = trajectory.moves[i];
+        scene.balls[move.ball].pos = move.pos;
+        moved.push_back(move.ball);
+    }
+    if (!moved.empty()) {
+        refit_acceleration(scene);
+    }
+    return moved;
+}
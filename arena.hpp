@@ -0,0 +1,100 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <memory_resource>
+
+/*
+ * Bump allocator for temporary buffers such as ray queues and hit records.
+ *
+ * Allocations are carved out of large chunks and deallocation is a no-op.
+ * reset() makes all chunks available again without returning them to the
+ * heap, so once the arena has grown to the size a frame needs, later frames
+ * do not touch the heap at all. mark() and rewind() release everything
+ * allocated since the mark, which bounds the arena to the largest unit of
+ * work (e.g. a tile) rather than a whole frame.
+ *
+ * An arena is not thread safe; every worker thread owns its own.
+ */
+class FrameArena : public std::pmr::memory_resource {
+public:
+    struct Marker {
+        size_t chunk;
+        size_t offset;
+    };
+
+    explicit FrameArena(size_t chunk_size = 1 << 20) : chunk_size(chunk_size) {
+        add_chunk(chunk_size);
+    }
+
+    ~FrameArena() {
+        for (auto &chunk : chunks) {
+            ::operator delete(chunk.data);
+        }
+    }
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    void reset() {
+        current = 0;
+        offset = 0;
+    }
+
+    Marker mark() const {
+        return {current, offset};
+    }
+
+    void rewind(Marker marker) {
+        current = marker.chunk;
+        offset = marker.offset;
+    }
+
+    /*
+     * Number of chunks requested from the heap over the lifetime of the arena.
+     */
+    size_t chunk_count() const {
+        return chunks.size();
+    }
+
+private:
+    struct Chunk {
+        char *data;
+        size_t size;
+    };
+
+    void add_chunk(size_t size) {
+        chunks.push_back({static_cast<char*>(::operator new(size)), size});
+    }
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        while (true) {
+            Chunk &chunk = chunks[current];
+            size_t start = (offset + alignment - 1) & ~(alignment - 1);
+            if (start + bytes <= chunk.size) {
+                offset = start + bytes;
+                return chunk.data + start;
+            }
+            // Move on to the next chunk, growing the arena if there is none
+            // large enough left.
+            current++;
+            offset = 0;
+            if (current == chunks.size()) {
+                add_chunk(std::max(chunk_size, bytes + alignment));
+            }
+        }
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    size_t chunk_size;
+    std::vector<Chunk> chunks;
+    size_t current = 0;
+    size_t offset = 0;
+};
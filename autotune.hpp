@@ -0,0 +1,262 @@
+#pragma once
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "framebuffer.hpp"
+#include "render.hpp"
+#include "scene.hpp"
+
+/*
+ * Picks the tile size, thread count and traversal mode for a scene by
+ * rendering probe regions of it with candidate settings and keeping the
+ * fastest. Every traversal mode gives the same pixels, so tuning only
+ * changes the speed.
+ *
+ * The probes are autotune_probes squares spread over the image, each
+ * rendered as the tiles that overlap it, and a candidate is timed as the
+ * best of autotune_repeats renders after a warm up, per rendered pixel.
+ * The search is one parameter at a time: the traversal mode at the given
+ * tile size and thread count, then the tile size with the best mode, then
+ * the thread count with both. Interleaved traversal (see interleave.hpp)
+ * is not a candidate: it was slower than the plain wavefront everywhere it
+ * was measured, and a tuned mode replaces it.
+ *
+ * Decisions are cached in a text file with one line per key:
+ *
+ *   KEY TILE_SIZE THREADS MODE
+ *
+ * where KEY hashes the CPU model, the hardware threads, the image size,
+ * the samples per pixel and scene statistics bucketed by powers of two, so
+ * similar scenes on the same machine share a decision.
+ */
+
+const int autotune_probes = 5;
+const int autotune_repeats = 2;
+
+enum class TraversalMode { recursive, bin_primary, wavefront, sort_rays, binned_wavefront };
+
+const char *const traversal_mode_names[] = {"recursive", "bin-primary", "wavefront", "sort-rays",
+    "binned-wavefront"};
+
+struct TunedSettings {
+    int tile_size;
+    int threads;
+    TraversalMode mode;
+};
+
+inline TraversalMode traversal_mode(const RenderSettings &settings) {
+    if (settings.bin_primary) {
+        return settings.wavefront ? TraversalMode::binned_wavefront : TraversalMode::bin_primary;
+    }
+    if (settings.wavefront) {
+        return settings.sort_rays ? TraversalMode::sort_rays : TraversalMode::wavefront;
+    }
+    return TraversalMode::recursive;
+}
+
+inline void apply_tuned_settings(const TunedSettings &tuned, RenderSettings &settings) {
+    settings.tile_size = tuned.tile_size;
+    settings.threads = tuned.threads;
+    settings.bin_primary = tuned.mode == TraversalMode::bin_primary ||
+        tuned.mode == TraversalMode::binned_wavefront;
+    settings.wavefront = tuned.mode == TraversalMode::wavefront || tuned.mode == TraversalMode::sort_rays ||
+        tuned.mode == TraversalMode::binned_wavefront;
+    settings.sort_rays = tuned.mode == TraversalMode::sort_rays;
+    settings.interleave = false;
+}
+
+/*
+ * The model name of the first CPU in /proc/cpuinfo, or "unknown".
+ */
+inline std::string cpu_model() {
+    std::ifstream input("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(input, line)) {
+        if (line.compare(0, 10, "model name") == 0) {
+            size_t colon = line.find(':');
+            if (colon != std::string::npos) {
+                return line.substr(line.find_first_not_of(' ', colon + 1));
+            }
+        }
+    }
+    return "unknown";
+}
+
+inline uint64_t autotune_key(const Scene &scene, const RenderSettings &settings) {
+    auto bucket = [](size_t n) {
+        int32_t log = 0;
+        while (n > 0) {
+            n >>= 1;
+            log++;
+        }
+        return log;
+    };
+    bool area_lights = false;
+    for (auto &light : scene.lights) {
+        area_lights = area_lights || light.shape != LightShape::point;
+    }
+    std::string model = cpu_model();
+    int32_t values[] = {
+        static_cast<int32_t>(std::thread::hardware_concurrency()), settings.width, settings.height,
+        settings.samples, settings.threads, bucket(scene.balls.size()),
+        bucket(scene_ball_count(scene)), bucket(scene.instances.size()),
+        !scene.ball_bvh.nodes.empty(), area_lights,
+    };
+    uint64_t hash = 14695981039346656037ull;
+    hash_bytes(hash, model.data(), model.size());
+    hash_bytes(hash, values, sizeof(values));
+    return hash;
+}
+
+/*
+ * The decision cached for key in the file at path, if there is one.
+ */
+inline std::optional<TunedSettings> load_tuned_settings(const std::string &path, uint64_t key) {
+    std::ifstream input(path);
+    std::string text;
+    while (std::getline(input, text)) {
+        std::istringstream line(text);
+        uint64_t line_key;
+        TunedSettings tuned;
+        std::string mode;
+        if (!(line >> std::hex >> line_key >> std::dec >> tuned.tile_size >> tuned.threads >> mode) ||
+                line_key != key || tuned.tile_size < 1 || tuned.threads < 1) {
+            continue;
+        }
+        for (int m = 0; m <= static_cast<int>(TraversalMode::binned_wavefront); m++) {
+            if (mode == traversal_mode_names[m]) {
+                tuned.mode = static_cast<TraversalMode>(m);
+                return tuned;
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+/*
+ * Adds the decision for key to the file at path, replacing an older one.
+ */
+inline bool store_tuned_settings(const std::string &path, uint64_t key, const TunedSettings &tuned) {
+    std::vector<std::string> lines;
+    {
+        std::ifstream input(path);
+        std::string text;
+        while (std::getline(input, text)) {
+            uint64_t line_key;
+            if (sscanf(text.c_str(), "%" SCNx64, &line_key) != 1 || line_key != key) {
+                lines.push_back(text);
+            }
+        }
+    }
+    char line[128];
+    snprintf(line, sizeof(line), "%016" PRIx64 " %d %d %s", key, tuned.tile_size, tuned.threads,
+            traversal_mode_names[static_cast<int>(tuned.mode)]);
+    lines.push_back(line);
+    std::ofstream output(path, std::ios::trunc);
+    for (auto &text : lines) {
+        output << text << "\n";
+    }
+    if (!output) {
+        fprintf(stderr, "Cannot write autotune cache %s\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/*
+ * The tiles of settings that overlap the probe regions: squares of an
+ * eighth of the image, at least 32 pixels, at the center and halfway
+ * between the center and each corner.
+ */
+inline std::vector<int> probe_tiles(const RenderSettings &settings, long &pixels) {
+    int size = std::max(32, std::min(settings.width, settings.height) / 8);
+    const double centers[autotune_probes][2] = {{0.5, 0.5}, {0.25, 0.25}, {0.75, 0.25}, {0.25, 0.75},
+        {0.75, 0.75}};
+    std::vector<int> tiles;
+    pixels = 0;
+    for (int tile = 0; tile < tiles_x(settings) * tiles_y(settings); tile++) {
+        Tile rect = tile_rect(settings, tile);
+        for (auto &center : centers) {
+            int x0 = static_cast<int>(center[0] * settings.width) - size / 2;
+            int y0 = static_cast<int>(center[1] * settings.height) - size / 2;
+            if (rect.x0 < x0 + size && rect.x1 > x0 && rect.y0 < y0 + size && rect.y1 > y0) {
+                tiles.push_back(tile);
+                pixels += static_cast<long>(rect.x1 - rect.x0) * (rect.y1 - rect.y0);
+                break;
+            }
+        }
+    }
+    return tiles;
+}
+
+/*
+ * Seconds per pixel of the probe regions of scene rendered with settings.
+ */
+inline double probe_seconds_per_pixel(Renderer &renderer, const Scene &scene, const RenderSettings &settings,
+        Framebuffer &framebuffer) {
+    long pixels;
+    std::vector<int> tiles = probe_tiles(settings, pixels);
+    double best = 0;
+    for (int run = 0; run <= autotune_repeats; run++) {
+        double seconds = renderer.render_frame(scene, settings, framebuffer, nullptr, &tiles).seconds;
+        // The first run warms up caches and arenas
+        if (run == 1 || (run > 1 && seconds < best)) {
+            best = seconds;
+        }
+    }
+    return best / pixels;
+}
+
+/*
+ * Tunes settings for scene by rendering probes with renderers pinned by
+ * pin, and returns the fastest settings found. Denoising does not depend
+ * on the traversal and is left out of the probes.
+ */
+inline TunedSettings autotune(const Scene &scene, const RenderSettings &settings, PinPolicy pin,
+        bool verbose) {
+    RenderSettings probe = settings;
+    probe.denoise = false;
+    Framebuffer framebuffer(settings.width, settings.height);
+    TunedSettings best = {settings.tile_size, settings.threads, traversal_mode(settings)};
+    double best_time = 0;
+    auto measure = [&](Renderer &renderer, const TunedSettings &candidate) {
+        apply_tuned_settings(candidate, probe);
+        double time = probe_seconds_per_pixel(renderer, scene, probe, framebuffer);
+        if (verbose) {
+            printf("autotune: tile %d, %d threads, %s: %.1f ns per pixel\n", candidate.tile_size,
+                    candidate.threads, traversal_mode_names[static_cast<int>(candidate.mode)], time * 1e9);
+        }
+        if (best_time == 0 || time < best_time) {
+            best_time = time;
+            best = candidate;
+        }
+    };
+
+    {
+        Renderer renderer(settings.threads, pin);
+        for (int m = 0; m <= static_cast<int>(TraversalMode::binned_wavefront); m++) {
+            measure(renderer, {settings.tile_size, settings.threads, static_cast<TraversalMode>(m)});
+        }
+        TraversalMode mode = best.mode;
+        for (int tile_size : {8, 16, 32, 64}) {
+            if (tile_size != settings.tile_size) {
+                measure(renderer, {tile_size, settings.threads, mode});
+            }
+        }
+    }
+    TunedSettings chosen = best;
+    for (int threads = settings.threads / 2; threads >= 1 && threads >= settings.threads / 4; threads /= 2) {
+        Renderer renderer(threads, pin);
+        measure(renderer, {chosen.tile_size, threads, chosen.mode});
+    }
+    return best;
+}
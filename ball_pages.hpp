@@ -0,0 +1,360 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bvh.hpp"
+#include "scene.hpp"
+
+/*
+ * Out of core balls. A ball page file holds balls sorted into spatially
+ * clustered pages together with a hierarchy over them, and is mapped read
+ * only: the kernel reads pages in as rays reach them and drops them again
+ * when memory runs short, so a scene larger than the RAM renders slower,
+ * from disk, instead of failing. Building the file needs the balls in
+ * memory once.
+ *
+ * The file starts with a BallPagesHeader, followed by the node_count
+ * BvhNodes of the hierarchy and then, from pages_offset, by the pages,
+ * page_bytes apart. Every page but the last holds balls_per_page balls, so
+ * ball i of the file is ball i % balls_per_page of page i / balls_per_page.
+ * Leaves cover balls [first, first+count) of the file, all in one page.
+ *
+ * The balls are ordered by splitting them recursively along the axis where
+ * their centers are most spread out, at the page boundary nearest the
+ * median, until a group fits in a page, and within a page by the median
+ * down to leaves of ball_page_leaf_size balls. Every page so covers a
+ * compact region, and a ray that enters it tests a few leaves there.
+ *
+ * The page area is advised random access, so the kernel does not read
+ * ahead pages no ray needs. With prefetch, a ray instead advises the
+ * kernel to read a page (MADV_WILLNEED) when it pushes a leaf of it on its
+ * traversal stack, and the read overlaps the traversal of the nearer part
+ * of the tree. Each page is advised at most once a frame.
+ */
+
+const char ball_pages_magic[8] = {'R', 'T', 'P', 'A', 'G', 'E', '0', '1'};
+const int ball_page_leaf_size = 8;
+const int default_ball_page_kb = 64;
+
+struct BallPagesHeader {
+    char magic[8];
+    int64_t ball_count;
+    int64_t node_count;
+    int64_t nodes_offset;
+    int64_t pages_offset;
+    int32_t page_bytes;
+    int32_t balls_per_page;
+    uint64_t hash;      // of the balls in file order
+};
+
+inline void ball_pages_build_node(std::vector<BvhNode> &nodes, std::vector<int> &order,
+        const std::vector<Ball> &balls, int balls_per_page, int node, int begin, int end) {
+    const Ball &first = balls[order[begin]];
+    Aabb node_bounds = sphere_bounds(first.pos, first.radius);
+    Aabb centers = {first.pos, first.pos};
+    for (int i = begin; i < end; i++) {
+        const Ball &ball = balls[order[i]];
+        node_bounds = aabb_union(node_bounds, sphere_bounds(ball.pos, ball.radius));
+        centers = aabb_union(centers, {ball.pos, ball.pos});
+    }
+    nodes[node].bounds = node_bounds;
+
+    if (end - begin <= ball_page_leaf_size) {
+        nodes[node].first = begin;
+        nodes[node].count = end - begin;
+        return;
+    }
+
+    // begin is always on a page boundary, so splitting above a page at a
+    // whole number of pages keeps every page in one subtree
+    int middle = (begin + end) / 2;
+    if (end - begin > balls_per_page) {
+        int pages = (end - begin + balls_per_page - 1) / balls_per_page;
+        middle = begin + pages / 2 * balls_per_page;
+    }
+    Vector3 extent = centers.hi - centers.lo;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+            [&](int a, int b) {
+                return vector_axis(balls[a].pos, axis) < vector_axis(balls[b].pos, axis);
+            });
+
+    int left = static_cast<int>(nodes.size());
+    nodes.push_back({});
+    nodes.push_back({});
+    nodes[node].first = left;
+    nodes[node].count = 0;
+    ball_pages_build_node(nodes, order, balls, balls_per_page, left, begin, middle);
+    ball_pages_build_node(nodes, order, balls, balls_per_page, left + 1, middle, end);
+}
+
+/*
+ * Writes balls to a ball page file at path with pages of page_bytes, which
+ * must be a multiple of the system page size.
+ */
+inline bool save_ball_pages(const std::string &path, const std::vector<Ball> &balls, int page_bytes) {
+    long system_page = sysconf(_SC_PAGESIZE);
+    if (page_bytes < system_page || page_bytes % system_page != 0) {
+        fprintf(stderr, "Ball pages must be a multiple of %ld bytes\n", system_page);
+        return false;
+    }
+    if (balls.empty()) {
+        fprintf(stderr, "No balls to write to %s\n", path.c_str());
+        return false;
+    }
+    BallPagesHeader header = {};
+    memcpy(header.magic, ball_pages_magic, sizeof(ball_pages_magic));
+    header.ball_count = balls.size();
+    header.page_bytes = page_bytes;
+    header.balls_per_page = page_bytes / sizeof(Ball);
+
+    std::vector<int> order(balls.size());
+    for (size_t i = 0; i < balls.size(); i++) {
+        order[i] = static_cast<int>(i);
+    }
+    std::vector<BvhNode> nodes;
+    nodes.reserve(2 * (balls.size() / ball_page_leaf_size + 1));
+    nodes.push_back({});
+    ball_pages_build_node(nodes, order, balls, header.balls_per_page, 0, 0, static_cast<int>(balls.size()));
+    header.node_count = nodes.size();
+    header.nodes_offset = sizeof(BallPagesHeader);
+    int64_t nodes_end = header.nodes_offset + header.node_count * sizeof(BvhNode);
+    header.pages_offset = (nodes_end + page_bytes - 1) / page_bytes * page_bytes;
+    header.hash = 14695981039346656037ull;
+    for (int i : order) {
+        hash_bytes(header.hash, &balls[i], sizeof(Ball));
+    }
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot write ball pages %s\n", path.c_str());
+        return false;
+    }
+    std::vector<unsigned char> page(page_bytes);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(nodes.data(), sizeof(BvhNode), nodes.size(), file) == nodes.size() &&
+        fwrite(page.data(), 1, header.pages_offset - nodes_end, file) ==
+            static_cast<size_t>(header.pages_offset - nodes_end);
+    for (size_t begin = 0; ok && begin < order.size(); begin += header.balls_per_page) {
+        size_t end = std::min(order.size(), begin + header.balls_per_page);
+        std::fill(page.begin(), page.end(), 0);
+        for (size_t i = begin; i < end; i++) {
+            memcpy(page.data() + (i - begin) * sizeof(Ball), &balls[order[i]], sizeof(Ball));
+        }
+        // The last page is cut after its last ball
+        size_t bytes = end == order.size() ? (end - begin) * sizeof(Ball) : page.size();
+        ok = fwrite(page.data(), 1, bytes, file) == bytes;
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Cannot write ball pages %s\n", path.c_str());
+    }
+    return ok;
+}
+
+/*
+ * True if the node_count nodes form a tree from node 0 whose leaves cover
+ * balls of the ball_count in the file and that is shallow enough for the
+ * traversal stack, so ball_pages_traverse needs no checks of its own. The
+ * children of every node must come after it, as ball_pages_build_node
+ * places them, and every node must have one parent.
+ */
+inline bool ball_pages_tree_valid(const BvhNode *nodes, int64_t node_count, int64_t ball_count) {
+    std::vector<char> seen(node_count, 0);
+    std::vector<std::pair<int, int>> stack = {{0, 1}};  // node and its level
+    seen[0] = 1;
+    while (!stack.empty()) {
+        auto [node, level] = stack.back();
+        stack.pop_back();
+        const BvhNode &n = nodes[node];
+        if (n.count > 0) {
+            if (n.first < 0 || n.first + static_cast<int64_t>(n.count) > ball_count) {
+                return false;
+            }
+            continue;
+        }
+        if (n.count < 0 || n.first <= node || n.first + static_cast<int64_t>(1) >= node_count ||
+                level + 1 >= bvh_stack_size || seen[n.first] || seen[n.first + 1]) {
+            return false;
+        }
+        seen[n.first] = seen[n.first + 1] = 1;
+        stack.push_back({n.first, level + 1});
+        stack.push_back({n.first + 1, level + 1});
+    }
+    return true;
+}
+
+/*
+ * Maps the ball page file at path, or returns nothing if it can not be
+ * mapped or is not a ball page file. The mapping lasts as long as the last
+ * scene sharing it.
+ */
+inline std::shared_ptr<const BallPages> load_ball_pages(const std::string &path, bool prefetch) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Cannot open ball pages %s\n", path.c_str());
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return nullptr;
+    }
+    size_t size = info.st_size;
+    void *mapped = size >= sizeof(BallPagesHeader) ?
+        mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "Cannot map ball pages %s\n", path.c_str());
+        return nullptr;
+    }
+    auto unmap = [mapped, size](BallPages *pages) {
+        munmap(mapped, size);
+        delete pages;
+    };
+    std::shared_ptr<BallPages> pages(new BallPages, unmap);
+
+    const unsigned char *data = static_cast<const unsigned char*>(mapped);
+    BallPagesHeader header;
+    memcpy(&header, data, sizeof(header));
+    long system_page = sysconf(_SC_PAGESIZE);
+    bool ok = memcmp(header.magic, ball_pages_magic, sizeof(ball_pages_magic)) == 0 &&
+        header.ball_count > 0 && header.ball_count <= INT32_MAX &&
+        header.node_count > 0 && header.node_count <= INT32_MAX &&
+        header.page_bytes >= system_page && header.page_bytes % system_page == 0 &&
+        header.balls_per_page == static_cast<int32_t>(header.page_bytes / sizeof(Ball)) &&
+        header.nodes_offset == sizeof(BallPagesHeader) &&
+        header.nodes_offset + header.node_count * static_cast<int64_t>(sizeof(BvhNode)) <= header.pages_offset &&
+        header.pages_offset % header.page_bytes == 0;
+    if (ok) {
+        int64_t pages_count = (header.ball_count + header.balls_per_page - 1) / header.balls_per_page;
+        int64_t last_balls = header.ball_count - (pages_count - 1) * header.balls_per_page;
+        ok = header.pages_offset + (pages_count - 1) * header.page_bytes +
+            last_balls * static_cast<int64_t>(sizeof(Ball)) <= static_cast<int64_t>(size) &&
+            ball_pages_tree_valid(reinterpret_cast<const BvhNode*>(data + header.nodes_offset),
+                    header.node_count, header.ball_count);
+    }
+    if (!ok) {
+        fprintf(stderr, "%s is not a ball page file\n", path.c_str());
+        return nullptr;
+    }
+    pages->nodes = reinterpret_cast<const BvhNode*>(data + header.nodes_offset);
+    pages->pages = data + header.pages_offset;
+    pages->ball_count = header.ball_count;
+    pages->page_bytes = header.page_bytes;
+    pages->balls_per_page = header.balls_per_page;
+    pages->hash = header.hash;
+    pages->prefetch = prefetch;
+    pages->advised.reset(new std::atomic<uint8_t>[pages->page_count()]);
+    for (long page = 0; page < pages->page_count(); page++) {
+        // Not any frame yet, but the one 255 frames on
+        pages->advised[page].store(255, std::memory_order_relaxed);
+    }
+    madvise(const_cast<unsigned char*>(pages->pages), size - header.pages_offset, MADV_RANDOM);
+    return pages;
+}
+
+/*
+ * Bytes of page of pages in the file; the last page is cut after its last
+ * ball.
+ */
+inline size_t ball_page_bytes(const BallPages &pages, long page) {
+    long balls = std::min<long>(pages.balls_per_page, pages.ball_count - page * pages.balls_per_page);
+    return page + 1 < pages.page_count() ? pages.page_bytes : balls * sizeof(Ball);
+}
+
+/*
+ * Advises the kernel to read page of pages ahead, unless that was done
+ * already this frame.
+ */
+inline void prefetch_ball_page(const BallPages &pages, long page) {
+    uint8_t frame = pages.frame.load(std::memory_order_relaxed);
+    std::atomic<uint8_t> &advised = pages.advised[page];
+    if (advised.load(std::memory_order_relaxed) != frame) {
+        advised.store(frame, std::memory_order_relaxed);
+        madvise(const_cast<unsigned char*>(pages.pages) + page * pages.page_bytes,
+                ball_page_bytes(pages, page), MADV_WILLNEED);
+    }
+}
+
+/*
+ * Like bvh_traverse for the hierarchy of pages: visits the file index of
+ * every ball in the leaves the ray enters closer than t_max, nearest child
+ * first, and prefetches the page of every leaf it pushes.
+ */
+template <class F>
+void ball_pages_traverse(const BallPages &pages, const BoxRay &ray, const double &t_max, F &&visit) {
+    int stack[bvh_stack_size];
+    double stack_entry[bvh_stack_size];
+    int size = 0;
+    auto push = [&](int node, double t_entry) {
+        const BvhNode &n = pages.nodes[node];
+        if (pages.prefetch && n.count > 0) {
+            prefetch_ball_page(pages, n.first / pages.balls_per_page);
+        }
+        stack[size] = node;
+        stack_entry[size++] = t_entry;
+    };
+    double t_entry;
+    if (!ray_enters_box(ray, pages.nodes[0].bounds, t_max, t_entry)) {
+        return;
+    }
+    push(0, t_entry);
+    while (size > 0) {
+        size--;
+        if (stack_entry[size] > t_max) {
+            continue;
+        }
+        const BvhNode &node = pages.nodes[stack[size]];
+        if (node.count > 0) {
+            for (long i = node.first; i < node.first + node.count; i++) {
+                visit(i);
+            }
+            continue;
+        }
+        double t_left, t_right;
+        bool left = ray_enters_box(ray, pages.nodes[node.first].bounds, t_max, t_left);
+        bool right = ray_enters_box(ray, pages.nodes[node.first + 1].bounds, t_max, t_right);
+        if (left && right) {
+            if (t_left <= t_right) {
+                push(node.first + 1, t_right);
+                push(node.first, t_left);
+            } else {
+                push(node.first, t_left);
+                push(node.first + 1, t_right);
+            }
+        } else if (left) {
+            push(node.first, t_left);
+        } else if (right) {
+            push(node.first + 1, t_right);
+        }
+    }
+}
+
+/*
+ * Bytes of the pages currently in memory.
+ */
+inline size_t ball_pages_resident_bytes(const BallPages &pages) {
+    long system_page = sysconf(_SC_PAGESIZE);
+    long last = pages.page_count() - 1;
+    size_t bytes = static_cast<size_t>(last) * pages.page_bytes + ball_page_bytes(pages, last);
+    std::vector<unsigned char> resident((bytes + system_page - 1) / system_page);
+    if (mincore(const_cast<unsigned char*>(pages.pages), bytes, resident.data()) != 0) {
+        return 0;
+    }
+    size_t count = 0;
+    for (unsigned char r : resident) {
+        count += r & 1;
+    }
+    return count * system_page;
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "camera.hpp"
+#include "scene.hpp"
+
+/*
+ * Per tile lists of the explicit balls that primary rays of the tile may hit,
+ * stored back to back: the balls of tile i are
+ * balls[offsets[i]] .. balls[offsets[i+1]-1], in increasing index order.
+ */
+struct ScreenBins {
+    std::vector<int> offsets;
+    std::vector<int> balls;
+    std::vector<int> rects;
+};
+
+/*
+ * Range [lo, hi] of x/w over a disc with center (cx, cw) and radius r in the
+ * (x, w) plane. The bounds are where the lines x = m w through the origin are
+ * tangent to the disc. Returns false if the disc reaches w <= 0, in which
+ * case x/w is unbounded.
+ */
+inline bool projected_range(double cx, double cw, double r, double &lo, double &hi) {
+    double denominator = cw*cw - r*r;
+    if (cw <= r || denominator <= 0) {
+        return false;
+    }
+    double root = r * std::sqrt(cx*cx + denominator);
+    lo = (cx*cw - root) / denominator;
+    hi = (cx*cw + root) / denominator;
+    return true;
+}
+
+/*
+ * Pixel rectangle [x0, x1] x [y0, y1] of a width by height image whose
+ * primary rays (see primary_ray) of camera can hit ball. In camera space,
+ * with a plane_size of 1, a primary ray through pixel (dx, dy) reaches the
+ * points (dx w, dy w, w - 1) for w > 1, so the ball covers the pixels with
+ * dx in the range of x/w and dy in the range of y/w over the ball, with
+ * w = 1 + z. Larger image planes scale dx and dy down, see plane_width. The
+ * rectangle is widened by a pixel to be safe against rounding. Returns false
+ * if the ball can not be seen by primary rays at all.
+ */
+inline bool ball_screen_rect(const Ball &ball, const Camera &camera, int width, int height,
+        int &x0, int &y0, int &x1, int &y1) {
+    Vector3 center = camera_space(camera, ball.pos);
+    double cw = 1 + center.z;
+    if (cw + ball.radius <= 1) {
+        return false; // entirely behind the image plane
+    }
+    double u_lo, u_hi, v_lo, v_hi;
+    if (!projected_range(center.x, cw, ball.radius, u_lo, u_hi) ||
+            !projected_range(center.y, cw, ball.radius, v_lo, v_hi)) {
+        // The ball surrounds the eye and may cover any pixel
+        x0 = 0;
+        y0 = 0;
+        x1 = width - 1;
+        y1 = height - 1;
+        return true;
+    }
+    u_lo /= plane_width(camera, width, height);
+    u_hi /= plane_width(camera, width, height);
+    v_lo /= camera.plane_size;
+    v_hi /= camera.plane_size;
+    double fx0 = std::floor((u_lo + 0.5) * width) - 1;
+    double fx1 = std::ceil((u_hi + 0.5) * width) + 1;
+    double fy0 = std::floor((0.5 - v_hi) * height) - 1;
+    double fy1 = std::ceil((0.5 - v_lo) * height) + 1;
+    if (fx1 < 0 || fy1 < 0 || fx0 >= width || fy0 >= height) {
+        return false;
+    }
+    x0 = static_cast<int>(std::max(fx0, 0.0));
+    y0 = static_cast<int>(std::max(fy0, 0.0));
+    x1 = static_cast<int>(std::min(fx1, width - 1.0));
+    y1 = static_cast<int>(std::min(fy1, height - 1.0));
+    return true;
+}
+
+/*
+ * Projects every explicit ball of the scene onto the tile grid and fills
+ * bins with the candidate balls of every tile. Instanced balls are not
+ * binned; primary rays still reach them through the top level hierarchy.
+ * The buffers of bins are reused, so rebinning every frame does not
+ * allocate once they have grown.
+ */
+inline void bin_balls(const Scene &scene, const Camera &camera, int width, int height, int tile_size, ScreenBins &bins) {
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+
+    // Tile rectangles of the visible balls as (ball, tx0, ty0, tx1, ty1)
+    bins.rects.clear();
+    for (int i = 0; i < static_cast<int>(scene.balls.size()); i++) {
+        int x0, y0, x1, y1;
+        if (ball_screen_rect(scene.balls[i], camera, width, height, x0, y0, x1, y1)) {
+            bins.rects.insert(bins.rects.end(),
+                    {i, x0 / tile_size, y0 / tile_size, x1 / tile_size, y1 / tile_size});
+        }
+    }
+
+    // Counting sort of the balls into their tiles
+    bins.offsets.assign(tiles_x * tiles_y + 1, 0);
+    for (size_t r = 0; r < bins.rects.size(); r += 5) {
+        for (int ty = bins.rects[r + 2]; ty <= bins.rects[r + 4]; ty++) {
+            for (int tx = bins.rects[r + 1]; tx <= bins.rects[r + 3]; tx++) {
+                bins.offsets[tx + ty * tiles_x + 1]++;
+            }
+        }
+    }
+    for (int tile = 0; tile < tiles_x * tiles_y; tile++) {
+        bins.offsets[tile + 1] += bins.offsets[tile];
+    }
+    bins.balls.resize(bins.offsets.back());
+    for (size_t r = 0; r < bins.rects.size(); r += 5) {
+        for (int ty = bins.rects[r + 2]; ty <= bins.rects[r + 4]; ty++) {
+            for (int tx = bins.rects[r + 1]; tx <= bins.rects[r + 3]; tx++) {
+                // offsets[tile] is used as the fill position and ends up at
+                // the start of the next tile
+                bins.balls[bins.offsets[tx + ty * tiles_x]++] = bins.rects[r];
+            }
+        }
+    }
+    for (int tile = tiles_x * tiles_y; tile > 0; tile--) {
+        bins.offsets[tile] = bins.offsets[tile - 1];
+    }
+    bins.offsets[0] = 0;
+}
@@ -0,0 +1,278 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "vector.hpp"
+
+struct Aabb {
+    Vector3 lo;
+    Vector3 hi;
+};
+
+inline double vector_axis(const Vector3 &v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+inline Aabb aabb_union(const Aabb &a, const Aabb &b) {
+    return {
+        {std::min(a.lo.x, b.lo.x), std::min(a.lo.y, b.lo.y), std::min(a.lo.z, b.lo.z)},
+        {std::max(a.hi.x, b.hi.x), std::max(a.hi.y, b.hi.y), std::max(a.hi.z, b.hi.z)},
+    };
+}
+
+/*
+ * Bounds of a sphere, padded slightly so that rounding in the box test can
+ * never cull a ray that intersects_ball would report as a hit.
+ */
+inline Aabb sphere_bounds(const Vector3 &center, double radius) {
+    double r = radius * (1 + 1e-9) + 1e-9;
+    return {
+        {center.x - r, center.y - r, center.z - r},
+        {center.x + r, center.y + r, center.z + r},
+    };
+}
+
+/*
+ * A node is a leaf if count > 0 and then covers items[first, first+count).
+ * Otherwise its children are nodes[first] and nodes[first+1].
+ */
+struct BvhNode {
+    Aabb bounds;
+    int first;
+    int count;
+};
+
+/*
+ * Entries of the fixed size traversal stacks. A depth first traversal holds
+ * at most one entry per level below the root plus one, so trees of up to
+ * bvh_stack_size - 1 levels fit. build_bvh splits at the median, which
+ * gives at most 32 levels for an int count of items, and ball page trees
+ * are checked when loaded.
+ */
+const int bvh_stack_size = 64;
+
+struct Bvh {
+    std::vector<BvhNode> nodes;
+    std::vector<int> items;
+};
+
+inline void bvh_build_node(Bvh &bvh, const std::vector<Aabb> &bounds, int leaf_size,
+        int node, int begin, int end) {
+    Aabb node_bounds = bounds[bvh.items[begin]];
+    Vector3 first_center = (node_bounds.lo + node_bounds.hi) * 0.5;
+    Aabb centroids = {first_center, first_center};
+    for (int i = begin; i < end; i++) {
+        const Aabb &b = bounds[bvh.items[i]];
+        Vector3 c = (b.lo + b.hi) * 0.5;
+        node_bounds = aabb_union(node_bounds, b);
+        centroids = aabb_union(centroids, {c, c});
+    }
+    bvh.nodes[node].bounds = node_bounds;
+
+    if (end - begin <= leaf_size) {
+        bvh.nodes[node].first = begin;
+        bvh.nodes[node].count = end - begin;
+        return;
+    }
+
+    // Median split along the axis where the centroids are most spread out
+    Vector3 extent = centroids.hi - centroids.lo;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    int middle = (begin + end) / 2;
+    std::nth_element(bvh.items.begin() + begin, bvh.items.begin() + middle, bvh.items.begin() + end,
+            [&](int a, int b) {
+                return vector_axis(bounds[a].lo, axis) + vector_axis(bounds[a].hi, axis) <
+                    vector_axis(bounds[b].lo, axis) + vector_axis(bounds[b].hi, axis);
+            });
+
+    int left = static_cast<int>(bvh.nodes.size());
+    bvh.nodes.push_back({});
+    bvh.nodes.push_back({});
+    bvh.nodes[node].first = left;
+    bvh.nodes[node].count = 0;
+    bvh_build_node(bvh, bounds, leaf_size, left, begin, middle);
+    bvh_build_node(bvh, bounds, leaf_size, left + 1, middle, end);
+}
+
+/*
+ * Builds a bounding volume hierarchy over items 0..bounds.size()-1 with at
+ * most leaf_size items per leaf.
+ */
+inline Bvh build_bvh(const std::vector<Aabb> &bounds, int leaf_size = 4) {
+    Bvh bvh;
+    if (bounds.empty()) {
+        return bvh;
+    }
+    bvh.items.resize(bounds.size());
+    for (size_t i = 0; i < bounds.size(); i++) {
+        bvh.items[i] = static_cast<int>(i);
+    }
+    bvh.nodes.reserve(2 * bounds.size());
+    bvh.nodes.push_back({});
+    bvh_build_node(bvh, bounds, leaf_size, 0, 0, static_cast<int>(bounds.size()));
+    return bvh;
+}
+
+/*
+ * Recomputes the node bounds of bvh for items that moved to bounds, keeping
+ * the tree as it is. Children are always stored after their parent, so one
+ * pass from the back updates every node after its children. The tree gets
+ * looser the further items move from where it was built, but traversal
+ * stays correct.
+ */
+inline void refit_bvh(Bvh &bvh, const std::vector<Aabb> &bounds) {
+    for (int node = static_cast<int>(bvh.nodes.size()) - 1; node >= 0; node--) {
+        BvhNode &n = bvh.nodes[node];
+        if (n.count > 0) {
+            n.bounds = bounds[bvh.items[n.first]];
+            for (int i = n.first + 1; i < n.first + n.count; i++) {
+                n.bounds = aabb_union(n.bounds, bounds[bvh.items[i]]);
+            }
+        } else {
+            n.bounds = aabb_union(bvh.nodes[n.first].bounds, bvh.nodes[n.first + 1].bounds);
+        }
+    }
+}
+
+inline size_t bvh_memory_bytes(const Bvh &bvh) {
+    return bvh.nodes.size() * sizeof(BvhNode) + bvh.items.size() * sizeof(int);
+}
+
+/*
+ * Ray prepared for slab tests. dir must be normalized so that box distances
+ * are comparable with the parameter returned by intersects_ball.
+ */
+struct BoxRay {
+    Vector3 from;
+    Vector3 dir;
+    Vector3 inv_dir;
+};
+
+inline BoxRay make_box_ray(const Vector3 &from, const Vector3 &dir) {
+    Vector3 d = vector_normalized(dir);
+    return {from, d, {1 / d.x, 1 / d.y, 1 / d.z}};
+}
+
+/*
+ * Slab test. Returns true if the ray enters box at a distance no larger than
+ * t_max and stores that distance in t_entry.
+ */
+inline bool ray_enters_box(const BoxRay &ray, const Aabb &box, double t_max, double &t_entry) {
+    double t0 = 0;
+    double t1 = t_max;
+    for (int axis = 0; axis < 3; axis++) {
+        double from = vector_axis(ray.from, axis);
+        double lo = vector_axis(box.lo, axis);
+        double hi = vector_axis(box.hi, axis);
+        if (vector_axis(ray.dir, axis) == 0) {
+            if (from < lo || from > hi) {
+                return false;
+            }
+            continue;
+        }
+        double inv = vector_axis(ray.inv_dir, axis);
+        double near = (lo - from) * inv;
+        double far = (hi - from) * inv;
+        if (near > far) {
+            std::swap(near, far);
+        }
+        t0 = std::max(t0, near);
+        t1 = std::min(t1, far);
+        if (t0 > t1) {
+            return false;
+        }
+    }
+    t_entry = t0;
+    return true;
+}
+
+/*
+ * Visits the items of all leaves the ray enters closer than t_max, nearest
+ * child first, in the subtree under root. visit(item) may lower t_max to
+ * prune the rest of the traversal, typically to the distance of the closest
+ * hit so far.
+ */
+template <class F>
+void bvh_traverse(const Bvh &bvh, const BoxRay &ray, const double &t_max, F &&visit, int root = 0) {
+    if (bvh.nodes.empty()) {
+        return;
+    }
+    int stack[bvh_stack_size];
+    double stack_entry[bvh_stack_size];
+    int size = 0;
+    double t_entry;
+    if (!ray_enters_box(ray, bvh.nodes[root].bounds, t_max, t_entry)) {
+        return;
+    }
+    stack[size] = root;
+    stack_entry[size++] = t_entry;
+    while (size > 0) {
+        size--;
+        // A closer hit may have been found since the node was pushed
+        if (stack_entry[size] > t_max) {
+            continue;
+        }
+        const BvhNode &node = bvh.nodes[stack[size]];
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                visit(bvh.items[i]);
+            }
+            continue;
+        }
+        double t_left, t_right;
+        bool left = ray_enters_box(ray, bvh.nodes[node.first].bounds, t_max, t_left);
+        bool right = ray_enters_box(ray, bvh.nodes[node.first + 1].bounds, t_max, t_right);
+        if (left && right) {
+            // Push the farther child first so the nearer one is visited first
+            if (t_left <= t_right) {
+                stack[size] = node.first + 1;
+                stack_entry[size++] = t_right;
+                stack[size] = node.first;
+                stack_entry[size++] = t_left;
+            } else {
+                stack[size] = node.first;
+                stack_entry[size++] = t_left;
+                stack[size] = node.first + 1;
+                stack_entry[size++] = t_right;
+            }
+        } else if (left) {
+            stack[size] = node.first;
+            stack_entry[size++] = t_left;
+        } else if (right) {
+            stack[size] = node.first + 1;
+            stack_entry[size++] = t_right;
+        }
+    }
+}
+
+/*
+ * Visits the items of all leaves whose bounds overlaps(bounds) accepts, in
+ * no particular order, for queries by a shape other than a ray. The query
+ * ends early when visit(item) returns false.
+ */
+template <class Overlaps, class F>
+void bvh_query(const Bvh &bvh, Overlaps &&overlaps, F &&visit) {
+    if (bvh.nodes.empty()) {
+        return;
+    }
+    int stack[bvh_stack_size];
+    int size = 0;
+    stack[size++] = 0;
+    while (size > 0) {
+        const BvhNode &node = bvh.nodes[stack[--size]];
+        if (!overlaps(node.bounds)) {
+            continue;
+        }
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                if (!visit(bvh.items[i])) {
+                    return;
+                }
+            }
+            continue;
+        }
+        stack[size++] = node.first + 1;
+        stack[size++] = node.first;
+    }
+}
@@ -0,0 +1,147 @@
+#pragma once
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "scene.hpp"
+
+/*
+ * The camera looks along forward from its position. Its image plane is the
+ * rectangle around the position spanned by right and up, plane_size high
+ * and as wide as the aspect ratio of the image makes it, and every primary
+ * ray starts on that plane on the line from the eye one unit behind the
+ * position. The field of view is therefore the vertical one, and pixels
+ * stay square whatever the shape of the image.
+ */
+
+const double pi = 3.14159265358979323846;
+
+/*
+ * Width of the image plane of camera for a width by height image. Square
+ * images have the square plane of side plane_size.
+ */
+inline double plane_width(const Camera &camera, int width, int height) {
+    return camera.plane_size * (static_cast<double>(width) / height);
+}
+
+inline bool same_camera(const Camera &a, const Camera &b) {
+    auto same = [](const Vector3 &u, const Vector3 &v) {
+        return u.x == v.x && u.y == v.y && u.z == v.z;
+    };
+    return same(a.pos, b.pos) && same(a.right, b.right) && same(a.up, b.up) &&
+        same(a.forward, b.forward) && a.plane_size == b.plane_size;
+}
+
+/*
+ * Camera at pos looking at target with a field of view of fov_degrees,
+ * with the world y axis up in the image, or the world -z axis when looking
+ * straight up or down.
+ */
+inline Camera look_at(const Vector3 &pos, const Vector3 &target, double fov_degrees) {
+    Camera camera;
+    camera.pos = pos;
+    camera.forward = vector_normalized(target - pos);
+    Vector3 right = vector_cross(camera.forward, {0, 1, 0});
+    if (vector_length(right) < 1e-9) {
+        right = vector_cross(camera.forward, {0, 0, -1});
+    }
+    camera.right = vector_normalized(right);
+    camera.up = vector_cross(camera.right, camera.forward);
+    camera.plane_size = 2 * std::tan(fov_degrees * pi / 360);
+    return camera;
+}
+
+/*
+ * Primary ray through the point (x, y) of a width by height image, where
+ * pixel (x, y) for integer x and y covers [x, x+1) x [y, y+1) and a single
+ * sample per pixel is taken at its corner.
+ */
+inline Ray primary_ray(const Camera &camera, double x, double y, int width, int height) {
+    double dx = (x/width - 0.5) * plane_width(camera, width, height);
+    double dy = ((height-y)/height - 0.5) * camera.plane_size;
+    Vector3 across = camera.right * dx + camera.up * dy;
+    return {camera.pos + across, across + camera.forward};
+}
+
+/*
+ * point in the coordinates of the camera: along right, along up and the
+ * distance in front of the image plane.
+ */
+inline Vector3 camera_space(const Camera &camera, const Vector3 &point) {
+    Vector3 relative = point - camera.pos;
+    return {vector_dot(relative, camera.right), vector_dot(relative, camera.up),
+        vector_dot(relative, camera.forward)};
+}
+
+/*
+ * Image coordinates (x, y) at which point is seen in a width by height
+ * image, the inverse of primary_ray, or false if the point is not in front
+ * of the image plane. x and y are not clamped to the image.
+ */
+inline bool project_point(const Camera &camera, const Vector3 &point, int width, int height,
+        double &x, double &y) {
+    Vector3 local = camera_space(camera, point);
+    if (local.z <= 0) {
+        return false;
+    }
+    double w = 1 + local.z;
+    x = (local.x / (w * plane_width(camera, width, height)) + 0.5) * width;
+    y = (0.5 - local.y / (w * camera.plane_size)) * height;
+    return true;
+}
+
+/*
+ * One view of a batch: a camera and the size of its image.
+ */
+struct View {
+    Camera camera;
+    int width;
+    int height;
+};
+
+/*
+ * Reads a views file with one view per line, '#' starting a comment:
+ *
+ *   view X Y Z TX TY TZ FOV WIDTH HEIGHT
+ *
+ * for a camera at X Y Z looking at TX TY TZ with a field of view of FOV
+ * degrees, rendering a WIDTH by HEIGHT image. Prints the offending line and
+ * returns nothing if the file is malformed.
+ */
+inline std::optional<std::vector<View>> load_views(const std::string &path) {
+    std::ifstream input(path);
+    if (!input) {
+        fprintf(stderr, "Cannot open views file %s\n", path.c_str());
+        return std::nullopt;
+    }
+    std::vector<View> views;
+    std::string text;
+    int line_number = 0;
+    while (std::getline(input, text)) {
+        line_number++;
+        std::istringstream line(text.substr(0, text.find('#')));
+        std::string kind;
+        if (!(line >> kind)) {
+            continue;
+        }
+        Vector3 pos, target;
+        double fov;
+        View view;
+        bool ok = kind == "view" &&
+            static_cast<bool>(line >> pos.x >> pos.y >> pos.z >> target.x >> target.y >> target.z
+                    >> fov >> view.width >> view.height) &&
+            fov > 0 && fov < 180 && view.width > 0 && view.height > 0 &&
+            vector_length(target - pos) > 0;
+        if (!ok) {
+            fprintf(stderr, "%s:%d: cannot parse \"%s\"\n", path.c_str(), line_number, text.c_str());
+            return std::nullopt;
+        }
+        view.camera = look_at(pos, target, fov);
+        views.push_back(view);
+    }
+    return views;
+}
@@ -0,0 +1,229 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "framebuffer.hpp"
+#include "render.hpp"
+
+/*
+ * Checkpoint of a frame in progress, kept in a memory mapped file so that a
+ * render killed half way can be resumed without losing the finished tiles.
+ *
+ * The file holds a header, one done flag per tile and the 8 bit RGB pixels
+ * of the frame. Render threads copy every finished tile into the mapping
+ * and mark it finished in memory, which costs them a memcpy into the page
+ * cache and nothing else. Every interval a background thread takes a
+ * snapshot of the finished tiles, flushes the pixels to disk with msync,
+ * and only then writes and flushes the done flags of the snapshot. A flag
+ * on disk therefore always comes with its pixels, whether the process or
+ * the whole machine goes away, and at most one interval of work is lost.
+ */
+
+const char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '2'};
+
+struct CheckpointHeader {
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    int32_t tile_size;
+    int32_t tile_count;
+    uint64_t scene_hash;
+    uint64_t settings_hash;
+};
+
+/*
+ * Hash of the settings other than the size that change the pixels of a
+ * frame: the camera, the samples per pixel, the math tier and denoising.
+ */
+inline uint64_t checkpoint_settings_hash(const RenderSettings &settings) {
+    uint64_t hash = 14695981039346656037ull;
+    int32_t values[] = {settings.samples, static_cast<int32_t>(settings.math), settings.denoise};
+    hash_bytes(hash, &settings.camera, sizeof(settings.camera));
+    hash_bytes(hash, values, sizeof(values));
+    return hash;
+}
+
+class Checkpoint : public TileObserver {
+public:
+    Checkpoint() = default;
+    Checkpoint(const Checkpoint&) = delete;
+    Checkpoint& operator=(const Checkpoint&) = delete;
+
+    ~Checkpoint() {
+        close();
+    }
+
+    /*
+     * Opens the checkpoint file at path for a frame of the scene with the
+     * given scene_hash. With resume an existing checkpoint of the same frame,
+     * rendered with the same size, camera, samples, math tier and denoising,
+     * is continued, otherwise the file is started over. Returns false if the
+     * file can not be used.
+     */
+    bool open(const std::string &path, const RenderSettings &settings, uint64_t scene_hash,
+            bool resume, double flush_seconds) {
+        tile_count = tiles_x(settings) * tiles_y(settings);
+        width = settings.width;
+        size = sizeof(CheckpointHeader) + (tile_count + 7) / 8 * 8 +
+            static_cast<size_t>(settings.width) * settings.height * 3;
+        CheckpointHeader expected = {{}, settings.width, settings.height, settings.tile_size,
+            tile_count, scene_hash, checkpoint_settings_hash(settings)};
+        memcpy(expected.magic, checkpoint_magic, sizeof(checkpoint_magic));
+
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            fprintf(stderr, "Cannot open checkpoint %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        bool continuing = resume && static_cast<size_t>(info.st_size) == size;
+        if (!continuing && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) {
+            fprintf(stderr, "Cannot resize checkpoint %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            fprintf(stderr, "Cannot map checkpoint %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        data = static_cast<unsigned char*>(mapped);
+        done = data + sizeof(CheckpointHeader);
+        pixels = done + (tile_count + 7) / 8 * 8;
+        if (continuing && memcmp(data, &expected, sizeof(expected)) != 0) {
+            fprintf(stderr, "Checkpoint %s is of a different frame, starting over\n", path.c_str());
+            continuing = false;
+        }
+        if (!continuing) {
+            memset(data, 0, size);
+            memcpy(data, &expected, sizeof(expected));
+        }
+        finished = std::make_unique<std::atomic<unsigned char>[]>(tile_count);
+        for (int tile = 0; tile < tile_count; tile++) {
+            finished[tile] = done[tile];
+        }
+        snapshot.resize(tile_count);
+
+        flush_interval = std::chrono::duration<double>(flush_seconds);
+        stopping = false;
+        writer = std::thread([this] { flush_loop(); });
+        return true;
+    }
+
+    /*
+     * Copies the finished tiles into framebuffer and returns the ones that
+     * still have to be rendered.
+     */
+    std::vector<int> restore(const RenderSettings &settings, Framebuffer &framebuffer) const {
+        std::vector<int> remaining;
+        for (int tile = 0; tile < tile_count; tile++) {
+            if (!done[tile]) {
+                remaining.push_back(tile);
+                continue;
+            }
+            Tile rect = tile_rect(settings, tile);
+            for (int y = rect.y0; y < rect.y1; y++) {
+                for (int x = rect.x0; x < rect.x1; x++) {
+                    int i = x + y * width;
+                    framebuffer.red[i] = pixels[3*i];
+                    framebuffer.green[i] = pixels[3*i + 1];
+                    framebuffer.blue[i] = pixels[3*i + 2];
+                }
+            }
+        }
+        return remaining;
+    }
+
+    void tile_done(int tile, const Tile &rect, const Framebuffer &framebuffer) override {
+        for (int y = rect.y0; y < rect.y1; y++) {
+            for (int x = rect.x0; x < rect.x1; x++) {
+                int i = x + y * width;
+                pixels[3*i] = static_cast<unsigned char>(framebuffer.red[i]);
+                pixels[3*i + 1] = static_cast<unsigned char>(framebuffer.green[i]);
+                pixels[3*i + 2] = static_cast<unsigned char>(framebuffer.blue[i]);
+            }
+        }
+        finished[tile].store(1, std::memory_order_release);
+        tiles_since_flush++;
+    }
+
+    /*
+     * Stops the writer thread after a last flush and unmaps the file.
+     */
+    void close() {
+        if (writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            writer.join();
+        }
+        if (data) {
+            munmap(data, size);
+            data = nullptr;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    long flushes = 0;
+
+private:
+    void flush() {
+        for (int tile = 0; tile < tile_count; tile++) {
+            snapshot[tile] = finished[tile].load(std::memory_order_acquire);
+        }
+        msync(data, size, MS_SYNC);
+        memcpy(done, snapshot.data(), tile_count);
+        msync(data, pixels - data, MS_SYNC);
+        flushes++;
+    }
+
+    void flush_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            bool stop = wake.wait_for(lock, flush_interval, [this] { return stopping; });
+            if (tiles_since_flush.exchange(0) > 0 || stop) {
+                lock.unlock();
+                flush();
+                lock.lock();
+            }
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+    int fd = -1;
+    size_t size = 0;
+    int tile_count = 0;
+    int width = 0;
+    unsigned char *data = nullptr;
+    unsigned char *done = nullptr;
+    unsigned char *pixels = nullptr;
+    std::unique_ptr<std::atomic<unsigned char>[]> finished;
+    std::vector<unsigned char> snapshot;
+
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::chrono::duration<double> flush_interval;
+    std::atomic<long> tiles_since_flush{0};
+};
@@ -6,7 +6,7 @@ struct Color {
     double b;
 };
 
-Color color_clamped(const Color &a) {
+inline Color color_clamped(const Color &a) {
     Color c;
     c.r = a.r <= 1.0f ? a.r : 1.0f;
     c.g = a.g <= 1.0f ? a.g : 1.0f;
@@ -18,23 +18,23 @@ Color color_clamped(const Color &a) {
     return c;
 }
 
-Color operator+(const Color &a, const Color &b) {
+inline Color operator+(const Color &a, const Color &b) {
     return {a.r + b.r, a.g + b.g, a.b + b.b};
 }
 
-Color operator-(const Color &a, const Color &b) {
+inline Color operator-(const Color &a, const Color &b) {
     return {a.r - b.r, a.g - b.g, a.b - b.b};
 }
 
-Color operator/(const Color &a, const double b) {
+inline Color operator/(const Color &a, const double b) {
     return {a.r/b, a.g/b, a.b/b};
 }
 
-Color operator*(const Color &a, const double b) {
+inline Color operator*(const Color &a, const double b) {
     return {a.r*b, a.g*b, a.b*b};
 }
 
-Color color_linear_interpolate(const Color& a, const Color& b, const double c) {
+inline Color color_linear_interpolate(const Color& a, const Color& b, const double c) {
     return {
         a.r*c + b.r*(1.0f - c),
         a.g*c + b.g*(1.0f - c),
@@ -0,0 +1,54 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "allocation_counter.hpp"
+
+// Replaces the global allocation functions of the raytracer program to count
+// heap allocations for --stats. All other forms of operator new and delete
+// forward to these. This is part of the program rather than raytracer_core so
+// that linking the library leaves the allocator alone.
+
+static std::atomic<long> allocation_count{0};
+
+static long counted_allocations() {
+    return allocation_count.load(std::memory_order_relaxed);
+}
+
+static const bool counter_installed =
+        (set_heap_allocation_counter(counted_allocations), true);
+
+void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    std::size_t align = static_cast<std::size_t>(alignment);
+    // aligned_alloc wants a multiple of the alignment, and at least one byte
+    std::size_t rounded = ((size ? size : 1) + align - 1) / align * align;
+    if (void *p = std::aligned_alloc(align, rounded)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
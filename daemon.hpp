@@ -0,0 +1,276 @@
+#pragma once
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "distributed.hpp"
+#include "image_io.hpp"
+#include "render.hpp"
+#include "scene_io.hpp"
+
+/*
+ * Render daemon: a long running process that renders jobs sent to it over a
+ * Unix domain socket, so small jobs do not pay for starting threads and
+ * loading and preparing the scene every time.
+ *
+ * A job names a scene file and carries the render settings. The daemon
+ * keeps the thread pool and the per thread arenas of one Renderer across
+ * jobs, and keeps loaded scenes with their acceleration structures until
+ * the file changes. The answer is the image as a binary PPM, or an error
+ * message. A client may send any number of jobs over one connection. Jobs
+ * use the message framing of distributed.hpp.
+ *
+ * Every connection is served on a thread of its own, so an idle or slowly
+ * reading client holds up nobody else. Jobs take turns at the renderer,
+ * which renders one job at a time with all of its threads; the image is
+ * sent after the renderer is handed to the next job. The connection
+ * threads use the daemon, so serve does not return before the last of them
+ * has finished.
+ */
+
+enum DaemonMessageType : uint32_t {
+    message_job = 16,  // packed settings, scene path
+    message_image,     // binary PPM
+    message_error,     // error text
+};
+
+/*
+ * Largest payloads of the daemon's messages: a job names a path, and an
+ * image is a binary PPM of at most the largest packed size.
+ */
+inline size_t daemon_max_payload(uint32_t type) {
+    switch (type) {
+    case message_job:
+        return packed_settings_size + PATH_MAX;
+    case message_image:
+        return 64 + 3 * static_cast<size_t>(max_packed_image_side) * max_packed_image_side;
+    case message_error:
+        return 4096;
+    }
+    return 0;
+}
+
+/*
+ * Scenes are kept for this many jobs; the least recently used one is
+ * dropped when another scene is loaded.
+ */
+const size_t max_cached_scenes = 16;
+
+struct CachedScene {
+    Scene scene;
+    timespec modified;
+    off_t size;
+    long last_used;
+};
+
+class RenderDaemon {
+public:
+    explicit RenderDaemon(int threads) : renderer(threads) {}
+
+    /*
+     * Serves jobs on the Unix socket at path until the process is killed.
+     * A socket left at path by an earlier daemon is replaced, but any other
+     * file there is left alone. Returns false if the socket can not be
+     * created.
+     */
+    bool serve(const std::string &path) {
+        struct stat existing;
+        if (lstat(path.c_str(), &existing) == 0 && !S_ISSOCK(existing.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket\n", path.c_str());
+            return false;
+        }
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (listener < 0 || path.size() >= sizeof(address.sun_path)) {
+            fprintf(stderr, "Cannot create socket %s\n", path.c_str());
+            return false;
+        }
+        strcpy(address.sun_path, path.c_str());
+        unlink(path.c_str());
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+                listen(listener, 16) != 0) {
+            fprintf(stderr, "Cannot listen on %s: %s\n", path.c_str(), strerror(errno));
+            close(listener);
+            return false;
+        }
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "accept failed: %s\n", strerror(errno));
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                connections++;
+            }
+            std::thread([this, fd] {
+                uint32_t type;
+                std::string payload;
+                while (receive_message(fd, type, payload, daemon_max_payload)) {
+                    if (!handle_job(fd, type, payload)) {
+                        break;
+                    }
+                }
+                close(fd);
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                if (--connections == 0) {
+                    connections_done.notify_all();
+                }
+            }).detach();
+        }
+        close(listener);
+        unlink(path.c_str());
+        std::unique_lock<std::mutex> lock(connections_mutex);
+        connections_done.wait(lock, [this] { return connections == 0; });
+        return false;
+    }
+
+private:
+    /*
+     * Renders one job and sends back the answer. Returns false if the
+     * connection should be closed.
+     */
+    bool handle_job(int fd, uint32_t type, const std::string &payload) {
+        RenderSettings settings;
+        bool ball_bvh;
+        if (type != message_job || payload.size() <= packed_settings_size) {
+            return false;
+        }
+        if (!unpack_settings(payload, settings, ball_bvh)) {
+            return send_error(fd, "invalid settings");
+        }
+        std::string path = payload.substr(packed_settings_size);
+        std::string image;
+        {
+            std::lock_guard<std::mutex> lock(render_mutex);
+            const Scene *scene = find_scene(path, ball_bvh);
+            if (!scene) {
+                return send_error(fd, "cannot load scene " + path);
+            }
+            if (framebuffer.width != settings.width || framebuffer.height != settings.height) {
+                framebuffer = Framebuffer(settings.width, settings.height);
+            }
+            renderer.render_frame(*scene, settings, framebuffer);
+            image = encode_p6(framebuffer);
+        }
+        return send_message(fd, message_image, image.data(), image.size());
+    }
+
+    bool send_error(int fd, const std::string &message) {
+        return send_message(fd, message_error, message.data(), message.size());
+    }
+
+    /*
+     * The scene in the file at path with its acceleration structures built,
+     * loaded again only if the file changed since it was last used.
+     */
+    const Scene* find_scene(const std::string &path, bool ball_bvh) {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) {
+            return nullptr;
+        }
+        std::string key = (ball_bvh ? "bvh:" : "linear:") + path;
+        jobs++;
+        auto it = scenes.find(key);
+        if (it != scenes.end() && it->second.size == info.st_size &&
+                it->second.modified.tv_sec == info.st_mtim.tv_sec &&
+                it->second.modified.tv_nsec == info.st_mtim.tv_nsec) {
+            it->second.last_used = jobs;
+            return &it->second.scene;
+        }
+        auto loaded = load_scene(path);
+        if (!loaded) {
+            return nullptr;
+        }
+        build_acceleration(*loaded, ball_bvh);
+        if (it == scenes.end() && scenes.size() >= max_cached_scenes) {
+            auto oldest = scenes.begin();
+            for (auto s = scenes.begin(); s != scenes.end(); ++s) {
+                if (s->second.last_used < oldest->second.last_used) {
+                    oldest = s;
+                }
+            }
+            scenes.erase(oldest);
+        }
+        CachedScene &cached = scenes[key];
+        cached = {std::move(*loaded), info.st_mtim, info.st_size, jobs};
+        return &cached.scene;
+    }
+
+    // Guards the renderer, the framebuffer and the scenes
+    std::mutex render_mutex;
+    Renderer renderer;
+    Framebuffer framebuffer{0, 0};
+    std::map<std::string, CachedScene> scenes;
+    long jobs = 0;
+
+    // Connection threads still running
+    std::mutex connections_mutex;
+    std::condition_variable connections_done;
+    int connections = 0;
+};
+
+/*
+ * Sends one job to the daemon listening on socket_path and writes the image
+ * it answers with to output. Returns false on failure.
+ */
+inline bool render_with_daemon(const std::string &socket_path, const std::string &scene_path,
+        const RenderSettings &settings, bool ball_bvh, const std::string &output, bool print_stats) {
+    auto start = std::chrono::steady_clock::now();
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (fd < 0 || socket_path.size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Cannot create socket\n");
+        return false;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", socket_path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    // The daemon resolves relative paths from its own directory
+    char *absolute = realpath(scene_path.c_str(), nullptr);
+    std::string job = pack_settings(settings, ball_bvh);
+    job += absolute ? absolute : scene_path;
+    free(absolute);
+
+    uint32_t type;
+    std::string answer;
+    bool ok = send_message(fd, message_job, job.data(), job.size()) &&
+        receive_message(fd, type, answer, daemon_max_payload);
+    close(fd);
+    if (!ok) {
+        fprintf(stderr, "Lost the connection to %s\n", socket_path.c_str());
+        return false;
+    }
+    if (type != message_image) {
+        fprintf(stderr, "Daemon: %s\n", answer.c_str());
+        return false;
+    }
+    ok = write_file(output, answer);
+    if (print_stats) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("daemon job: %.2f ms\n", elapsed.count() * 1000);
+    }
+    return ok;
+}
@@ -0,0 +1,301 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "thread_pool.hpp"
+#include "vector.hpp"
+
+/*
+ * Edge aware denoiser for renders with few samples per pixel: an a-trous
+ * wavelet filter (Dammertz et al., "Edge-Avoiding A-Trous Wavelet Transform
+ * for fast Global Illumination Filtering") guided by what the primary rays
+ * of every pixel hit, with the color weights scaled by the variance of the
+ * pixels as in SVGF (Schied et al., "Spatiotemporal Variance-Guided
+ * Filtering").
+ *
+ * Each of denoise_iterations passes blurs the color with a 5x5 B3 spline
+ * kernel whose taps are step = 1, 2, 4, ... pixels apart, so five passes
+ * cover 125x125 pixels with 25 taps each. Every tap is weighted down by how
+ * much the neighbour differs from the center in albedo, normal and depth,
+ * so the blur does not cross the edges of balls or of their colors, and by
+ * how much it differs in luminance relative to the noise of the center.
+ * Only the local color of the surfaces is filtered, and what they reflect
+ * is added back unfiltered, so mirror images stay sharp. Pixels whose
+ * samples all agree have no noise and keep their color; only the noise
+ * within surfaces, such as from sampled lights, is filtered. Each pass filters the variance
+ * along with the color, so later passes blur less, and skips the rows of a
+ * tile that have no noise left.
+ *
+ * Channels are kept in separate float arrays and every pass runs tap by tap
+ * over contiguous spans of a row, so the inner loop has no branches or
+ * gathers and the compiler vectorizes it. Passes are parallel over tiles.
+ */
+
+const int denoise_iterations = 5;
+// Luminance differences are weighed against this many standard deviations
+const float denoise_sigma_luminance = 1.0f;
+const float denoise_sigma_albedo = 0.1f;
+const float denoise_sigma_normal = 0.3f;
+// Relative depth differences, per pixel of tap distance
+const float denoise_sigma_depth = 0.02f;
+
+inline float luminance(float r, float g, float b) {
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+/*
+ * Per pixel inputs of the denoiser, written while rendering: the noisy
+ * local color, the variance of its luminance, an estimate of the squared
+ * noise, and the rest of the color, which is not filtered. As guides the
+ * albedo, normal and distance along the view direction of what the pixel's
+ * primary rays hit, averaged over its samples. Pixels that see the
+ * background have the background color as albedo, a zero normal and a depth
+ * of max_hit_distance.
+ */
+struct DenoiseGuides {
+    int width = 0;
+    int height = 0;
+    std::vector<float> color[3];
+    std::vector<float> variance;
+    std::vector<float> rest[3];
+    std::vector<float> albedo[3];
+    std::vector<float> normal[3];
+    std::vector<float> depth;
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        size_t pixels = static_cast<size_t>(w) * h;
+        for (int c = 0; c < 3; c++) {
+            color[c].resize(pixels);
+            rest[c].resize(pixels);
+            albedo[c].resize(pixels);
+            normal[c].resize(pixels);
+        }
+        variance.resize(pixels);
+        depth.resize(pixels);
+    }
+
+    void store(int x, int y, const Color &c, const Color &r, double v, const Color &a, const Vector3 &n,
+            double d) {
+        size_t i = x + static_cast<size_t>(y) * width;
+        color[0][i] = static_cast<float>(c.r);
+        color[1][i] = static_cast<float>(c.g);
+        color[2][i] = static_cast<float>(c.b);
+        rest[0][i] = static_cast<float>(r.r);
+        rest[1][i] = static_cast<float>(r.g);
+        rest[2][i] = static_cast<float>(r.b);
+        variance[i] = static_cast<float>(v);
+        albedo[0][i] = static_cast<float>(a.r);
+        albedo[1][i] = static_cast<float>(a.g);
+        albedo[2][i] = static_cast<float>(a.b);
+        normal[0][i] = static_cast<float>(n.x);
+        normal[1][i] = static_cast<float>(n.y);
+        normal[2][i] = static_cast<float>(n.z);
+        depth[i] = static_cast<float>(d);
+    }
+};
+
+/*
+ * Approximates exp(-x) for x >= 0 as (1 + x/16)^-16, which vectorizes where
+ * std::exp does not. It is within 0.02 of exp(-x) everywhere and falls off
+ * a little slower for large x, which only matters for taps that are
+ * weighted down to almost nothing either way.
+ */
+inline float exp_neg_approx(float x) {
+    float t = 1 + x * (1.0f / 16);
+    t *= t;
+    t *= t;
+    t *= t;
+    t *= t;
+    return 1 / t;
+}
+
+class Denoiser {
+public:
+    /*
+     * Filters the color in guides, adds the rest of the color and writes the
+     * sum to framebuffer as 8 bit values, in parallel over tile_size tiles on pool. Makes no heap
+     * allocations once it has seen a frame of the size.
+     */
+    void denoise(ThreadPool &pool, const DenoiseGuides &guides, int tile_size, Framebuffer &framebuffer) {
+        int width = guides.width;
+        int height = guides.height;
+        size_t pixels = static_cast<size_t>(width) * height;
+        for (int c = 0; c < 4; c++) {
+            buffers[0][c].resize(pixels);
+            buffers[1][c].resize(pixels);
+        }
+        scratch.resize(pool.size());
+        for (auto &rows : scratch) {
+            rows.resize(scratch_rows * static_cast<size_t>(tile_size));
+        }
+        int tiles_across = (width + tile_size - 1) / tile_size;
+        int tile_count = tiles_across * ((height + tile_size - 1) / tile_size);
+
+        const float *in[4] = {guides.color[0].data(), guides.color[1].data(), guides.color[2].data(),
+            guides.variance.data()};
+        for (int pass = 0; pass < denoise_iterations; pass++) {
+            float *out[4];
+            for (int c = 0; c < 4; c++) {
+                out[c] = buffers[pass % 2][c].data();
+            }
+            int step = 1 << pass;
+            pool.parallel_for(tile_count, [&](int tile, int worker) {
+                int x0 = tile % tiles_across * tile_size;
+                int y0 = tile / tiles_across * tile_size;
+                filter_tile(guides, in, out, x0, y0, std::min(x0 + tile_size, width),
+                        std::min(y0 + tile_size, height), step, scratch[worker].data());
+            });
+            std::copy(out, out + 4, in);
+        }
+
+        const int max_color = 255;
+        pool.parallel_for(height, [&](int y, int) {
+            for (int x = 0; x < width; x++) {
+                size_t i = x + static_cast<size_t>(y) * width;
+                framebuffer.red[i] = static_cast<int>(
+                        std::clamp(in[0][i] + guides.rest[0][i], 0.0f, 1.0f) * max_color);
+                framebuffer.green[i] = static_cast<int>(
+                        std::clamp(in[1][i] + guides.rest[1][i], 0.0f, 1.0f) * max_color);
+                framebuffer.blue[i] = static_cast<int>(
+                        std::clamp(in[2][i] + guides.rest[2][i], 0.0f, 1.0f) * max_color);
+            }
+        });
+    }
+
+private:
+    // Rows of a tile's width of scratch per worker: the five sums and the
+    // luminance and luminance weight of the centers
+    static const int scratch_rows = 7;
+
+    /*
+     * One pass of the filter with taps step pixels apart over the pixels
+     * [x0, x1) x [y0, y1), from the color and variance channels in to out.
+     */
+    static void filter_tile(const DenoiseGuides &guides, const float *const *in, float *const *out,
+            int x0, int y0, int x1, int y1, int step, float *scratch) {
+        static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+        int width = guides.width;
+        int span = x1 - x0;
+        float *sums[5];
+        for (int s = 0; s < 5; s++) {
+            sums[s] = scratch + s * span;
+        }
+        float *center_luminance = scratch + 5 * span;
+        float *luminance_weight = scratch + 6 * span;
+
+        for (int y = y0; y < y1; y++) {
+            size_t row = static_cast<size_t>(y) * width;
+            if (std::all_of(in[3] + row + x0, in[3] + row + x1, [](float v) { return v == 0; })) {
+                for (int c = 0; c < 4; c++) {
+                    std::copy(in[c] + row + x0, in[c] + row + x1, out[c] + row + x0);
+                }
+                continue;
+            }
+            std::fill(scratch, scratch + 5 * span, 0.0f);
+            for (int i = 0; i < span; i++) {
+                size_t p = row + x0 + i;
+                center_luminance[i] = luminance(in[0][p], in[1][p], in[2][p]);
+                // Noise free pixels get a weight that shuts out every
+                // neighbour that differs at all
+                luminance_weight[i] = 1 / (denoise_sigma_luminance * std::sqrt(in[3][p]) + 1e-6f);
+            }
+
+            for (int ky = 0; ky < 5; ky++) {
+                int sy = y + (ky - 2) * step;
+                if (sy < 0 || sy >= guides.height) {
+                    continue;
+                }
+                for (int kx = 0; kx < 5; kx++) {
+                    int dx = (kx - 2) * step;
+                    // Taps outside the image are left out
+                    int from = std::max(x0, -dx);
+                    int to = std::min(x1, width - dx);
+                    if (from >= to) {
+                        continue;
+                    }
+                    // Spans of the centers and of their neighbours, which
+                    // start inside the image as from + dx >= 0
+                    size_t p = row + from;
+                    size_t q = static_cast<size_t>(sy) * width + from + dx;
+                    int offset = from - x0;
+                    add_tap(guides, in, p, q, to - from, kernel[kx] * kernel[ky], step,
+                            center_luminance + offset, luminance_weight + offset,
+                            sums[0] + offset, sums[1] + offset, sums[2] + offset, sums[3] + offset,
+                            sums[4] + offset);
+                }
+            }
+
+            // The center tap always has a weight, so the sum is never 0
+            for (int i = 0; i < span; i++) {
+                size_t p = row + x0 + i;
+                float w = sums[3][i];
+                out[0][p] = sums[0][i] / w;
+                out[1][p] = sums[1][i] / w;
+                out[2][p] = sums[2][i] / w;
+                out[3][p] = sums[4][i] / (w * w);
+            }
+        }
+    }
+
+    /*
+     * Adds the tap of count neighbours starting at pixel q to the centers
+     * starting at pixel p with kernel weight h: the weighted colors to sum_r,
+     * sum_g and sum_b, the weights to sum_w and the squared weights times
+     * the variance to sum_v.
+     */
+    static void add_tap(const DenoiseGuides &guides, const float *const *in, size_t p, size_t q, int count,
+            float h, int step, const float *__restrict center_luminance,
+            const float *__restrict luminance_weight, float *__restrict sum_r, float *__restrict sum_g,
+            float *__restrict sum_b, float *__restrict sum_w, float *__restrict sum_v) {
+        const float albedo_weight = 1 / (denoise_sigma_albedo * denoise_sigma_albedo);
+        const float normal_weight = 1 / (denoise_sigma_normal * denoise_sigma_normal);
+        const float depth_weight = 1 / (denoise_sigma_depth * step);
+        const float *__restrict q_r = in[0] + q;
+        const float *__restrict q_g = in[1] + q;
+        const float *__restrict q_b = in[2] + q;
+        const float *__restrict q_v = in[3] + q;
+        const float *__restrict pa_r = guides.albedo[0].data() + p;
+        const float *__restrict pa_g = guides.albedo[1].data() + p;
+        const float *__restrict pa_b = guides.albedo[2].data() + p;
+        const float *__restrict qa_r = guides.albedo[0].data() + q;
+        const float *__restrict qa_g = guides.albedo[1].data() + q;
+        const float *__restrict qa_b = guides.albedo[2].data() + q;
+        const float *__restrict pn_x = guides.normal[0].data() + p;
+        const float *__restrict pn_y = guides.normal[1].data() + p;
+        const float *__restrict pn_z = guides.normal[2].data() + p;
+        const float *__restrict qn_x = guides.normal[0].data() + q;
+        const float *__restrict qn_y = guides.normal[1].data() + q;
+        const float *__restrict qn_z = guides.normal[2].data() + q;
+        const float *__restrict p_d = guides.depth.data() + p;
+        const float *__restrict q_d = guides.depth.data() + q;
+
+        for (int i = 0; i < count; i++) {
+            float l = std::fabs(luminance(q_r[i], q_g[i], q_b[i]) - center_luminance[i]);
+            float ar = qa_r[i] - pa_r[i];
+            float ag = qa_g[i] - pa_g[i];
+            float ab = qa_b[i] - pa_b[i];
+            float nx = qn_x[i] - pn_x[i];
+            float ny = qn_y[i] - pn_y[i];
+            float nz = qn_z[i] - pn_z[i];
+            float dd = std::fabs(q_d[i] - p_d[i]) / (p_d[i] + q_d[i] + 1e-3f);
+            float distance = l * luminance_weight[i] +
+                (ar*ar + ag*ag + ab*ab) * albedo_weight +
+                (nx*nx + ny*ny + nz*nz) * normal_weight +
+                dd * depth_weight;
+            float w = h * exp_neg_approx(distance);
+            sum_r[i] += w * q_r[i];
+            sum_g[i] += w * q_g[i];
+            sum_b[i] += w * q_b[i];
+            sum_w[i] += w;
+            sum_v[i] += w * w * q_v[i];
+        }
+    }
+
+    std::vector<float> buffers[2][4];
+    std::vector<std::vector<float>> scratch;
+};
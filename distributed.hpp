@@ -0,0 +1,618 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "render.hpp"
+#include "scene_io.hpp"
+
+/*
+ * Rendering a frame on several processes over TCP.
+ *
+ * The coordinator listens on a port and every worker connects to it and
+ * says how many threads it renders with. The coordinator answers with the
+ * render settings and the scene in the text format of scene_io.hpp, and
+ * then hands out batches of tile indices, keeping two batches of as many
+ * tiles as the worker has threads in flight per worker so workers never
+ * wait for work. Workers send every tile back as 8 bit RGB as soon as it is
+ * done. A worker that disconnects, e.g. because it died, has its
+ * unfinished tiles put back at the front of the queue for the others.
+ *
+ * Every message is a 32 bit type and a 32 bit payload length followed by
+ * the payload. Numbers are sent in host byte order, so all processes must
+ * run on machines of the same byte order. Every type has a largest payload
+ * (see distributed_max_payload), and a message announcing more, or of a
+ * type the receiver does not know, closes the connection.
+ */
+
+enum MessageType : uint32_t {
+    message_hello = 1,  // int32 threads
+    message_scene,      // packed settings, scene text
+    message_tiles,      // int32 tile indices
+    message_pixels,     // int32 tile index, RGB bytes of the tile rectangle
+    message_done,
+};
+
+inline bool send_all(int fd, const void *data, size_t size) {
+    const char *bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+inline bool send_message(int fd, uint32_t type, const void *payload, size_t size) {
+    uint32_t header[2] = {type, static_cast<uint32_t>(size)};
+    return send_all(fd, header, sizeof(header)) && send_all(fd, payload, size);
+}
+
+inline bool receive_all(int fd, void *data, size_t size) {
+    char *bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t received = recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+/*
+ * Largest payload a protocol accepts for a message of type, 0 for types it
+ * does not know.
+ */
+using PayloadLimit = size_t (*)(uint32_t type);
+
+/*
+ * Blocks until a whole message has arrived. Returns false if the connection
+ * was closed or the message is longer than max_payload allows for its
+ * type, in which case the caller closes the connection.
+ */
+inline bool receive_message(int fd, uint32_t &type, std::string &payload, PayloadLimit max_payload) {
+    uint32_t header[2];
+    if (!receive_all(fd, header, sizeof(header))) {
+        return false;
+    }
+    if (header[1] > max_payload(header[0])) {
+        fprintf(stderr, "Message of type %u too long: %u bytes\n", header[0], header[1]);
+        return false;
+    }
+    type = header[0];
+    payload.resize(header[1]);
+    return receive_all(fd, payload.data(), payload.size());
+}
+
+enum class Taken {
+    message,     // a message was removed from the buffer
+    incomplete,  // the buffer does not hold a whole message yet
+    too_long,    // the next message is longer than allowed for its type
+};
+
+/*
+ * Removes the first complete message from the bytes received so far.
+ */
+inline Taken take_message(std::string &buffer, uint32_t &type, std::string &payload,
+        PayloadLimit max_payload) {
+    uint32_t header[2];
+    if (buffer.size() < sizeof(header)) {
+        return Taken::incomplete;
+    }
+    memcpy(header, buffer.data(), sizeof(header));
+    if (header[1] > max_payload(header[0])) {
+        fprintf(stderr, "Message of type %u too long: %u bytes\n", header[0], header[1]);
+        return Taken::too_long;
+    }
+    if (buffer.size() < sizeof(header) + header[1]) {
+        return Taken::incomplete;
+    }
+    type = header[0];
+    payload.assign(buffer, sizeof(header), header[1]);
+    buffer.erase(0, sizeof(header) + header[1]);
+    return Taken::message;
+}
+
+/*
+ * Connects to address, given as HOST:PORT. Returns the socket or -1.
+ */
+inline int connect_tcp(const std::string &address) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        fprintf(stderr, "Expected HOST:PORT, got %s\n", address.c_str());
+        return -1;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses;
+    int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+    if (error != 0) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", address.c_str(), gai_strerror(error));
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo *a = addresses; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", address.c_str(), strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/*
+ * Listens on port on all interfaces. Returns the socket or -1.
+ */
+inline int listen_tcp(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(fd, 64) != 0) {
+        fprintf(stderr, "Cannot listen on port %d: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Render settings as sent to workers, with whether to build the ball BVH:
+ * ten int32 values followed by the camera.
+ */
+const size_t packed_settings_size = 10 * sizeof(int32_t) + sizeof(Camera);
+
+inline std::string pack_settings(const RenderSettings &settings, bool ball_bvh) {
+    int32_t values[10] = {settings.width, settings.height, settings.tile_size,
+        settings.wavefront, settings.sort_rays, settings.bin_primary, ball_bvh, settings.samples,
+        static_cast<int32_t>(settings.math), settings.interleave};
+    std::string packed(packed_settings_size, '\0');
+    memcpy(packed.data(), values, sizeof(values));
+    memcpy(packed.data() + sizeof(values), &settings.camera, sizeof(Camera));
+    return packed;
+}
+
+/*
+ * Limits on settings received from other processes, so that a bad message
+ * can not have a worker or the daemon allocate without bound.
+ */
+const int max_packed_image_side = 16384;
+const int max_packed_samples = 1024;
+
+/*
+ * Limits on what workers and the coordinator send each other: the threads
+ * of a worker, which bound its batches of tiles, and the text of a scene.
+ */
+const int max_worker_threads = 1024;
+const size_t max_scene_text = size_t(1) << 30;
+
+inline size_t distributed_max_payload(uint32_t type) {
+    size_t largest_tile = 3 * static_cast<size_t>(max_packed_image_side) * max_packed_image_side;
+    switch (type) {
+    case message_hello:
+        return sizeof(int32_t);
+    case message_scene:
+        return packed_settings_size + max_scene_text;
+    case message_tiles:
+        return max_worker_threads * sizeof(int32_t);
+    case message_pixels:
+        return sizeof(int32_t) + largest_tile;
+    case message_done:
+        return 0;
+    }
+    return 0;
+}
+
+inline bool valid_packed_camera(const Camera &camera) {
+    auto finite = [](const Vector3 &v) {
+        return std::isfinite(v.x) && std::isfinite(v.y) && std::isfinite(v.z);
+    };
+    auto unit = [&](const Vector3 &v) {
+        return finite(v) && std::abs(vector_length(v) - 1) < 1e-6;
+    };
+    return finite(camera.pos) && unit(camera.right) && unit(camera.up) && unit(camera.forward) &&
+        std::isfinite(camera.plane_size) && camera.plane_size > 0;
+}
+
+/*
+ * Reads settings packed by pack_settings from the start of payload. Returns
+ * false if payload is too short or any value is out of range.
+ */
+inline bool unpack_settings(const std::string &payload, RenderSettings &settings, bool &ball_bvh) {
+    if (payload.size() < packed_settings_size) {
+        return false;
+    }
+    int32_t values[10];
+    memcpy(values, payload.data(), sizeof(values));
+    auto in_range = [](int32_t value, int32_t lo, int32_t hi) {
+        return value >= lo && value <= hi;
+    };
+    for (int flag : {3, 4, 5, 6, 9}) {
+        if (!in_range(values[flag], 0, 1)) {
+            return false;
+        }
+    }
+    if (!in_range(values[0], 1, max_packed_image_side) || !in_range(values[1], 1, max_packed_image_side) ||
+            !in_range(values[2], 1, max_packed_image_side) || !in_range(values[7], 1, max_packed_samples) ||
+            !in_range(values[8], 0, static_cast<int32_t>(MathTier::fast))) {
+        return false;
+    }
+    Camera camera;
+    memcpy(&camera, payload.data() + sizeof(values), sizeof(Camera));
+    if (!valid_packed_camera(camera)) {
+        return false;
+    }
+    settings.width = values[0];
+    settings.height = values[1];
+    settings.tile_size = values[2];
+    settings.wavefront = values[3];
+    settings.sort_rays = values[4];
+    settings.bin_primary = values[5];
+    ball_bvh = values[6];
+    settings.samples = values[7];
+    settings.math = static_cast<MathTier>(values[8]);
+    settings.interleave = values[9];
+    settings.camera = camera;
+    return true;
+}
+
+/*
+ * Sends every tile a worker renders to the coordinator as soon as it is
+ * done, from the render thread that finished it, so a slow tile does not
+ * hold back the rest of its batch.
+ */
+class TileSender : public TileObserver {
+public:
+    explicit TileSender(int fd) : fd(fd) {}
+
+    void tile_done(int tile, const Tile &rect, const Framebuffer &framebuffer) override {
+        int32_t index = tile;
+        std::string pixels(reinterpret_cast<const char*>(&index), sizeof(index));
+        pixels.reserve(sizeof(index) + static_cast<size_t>(rect.x1 - rect.x0) * (rect.y1 - rect.y0) * 3);
+        for (int y = rect.y0; y < rect.y1; y++) {
+            for (int x = rect.x0; x < rect.x1; x++) {
+                int i = x + y * framebuffer.width;
+                pixels += static_cast<char>(framebuffer.red[i]);
+                pixels += static_cast<char>(framebuffer.green[i]);
+                pixels += static_cast<char>(framebuffer.blue[i]);
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (connected && !send_message(fd, message_pixels, pixels.data(), pixels.size())) {
+            connected = false;
+        }
+    }
+
+    bool lost_connection() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return !connected;
+    }
+
+private:
+    int fd;
+    std::mutex mutex;
+    bool connected = true;
+};
+
+/*
+ * Connects to the coordinator at address and renders the tiles it hands
+ * out with threads threads until it says it is done. Returns the exit code
+ * of the worker process.
+ */
+inline int run_worker(const std::string &address, int threads) {
+    int fd = connect_tcp(address);
+    if (fd < 0) {
+        return 1;
+    }
+    int32_t hello = threads;
+    uint32_t type;
+    std::string payload;
+    RenderSettings settings;
+    bool ball_bvh;
+    if (!send_message(fd, message_hello, &hello, sizeof(hello)) ||
+            !receive_message(fd, type, payload, distributed_max_payload) || type != message_scene ||
+            !unpack_settings(payload, settings, ball_bvh)) {
+        fprintf(stderr, "Worker: no scene from %s\n", address.c_str());
+        close(fd);
+        return 1;
+    }
+    settings.threads = threads;
+    std::istringstream text(payload.substr(packed_settings_size));
+    auto scene = read_scene(text, address);
+    if (!scene) {
+        close(fd);
+        return 1;
+    }
+    build_acceleration(*scene, ball_bvh);
+
+    Renderer renderer(threads);
+    Framebuffer framebuffer(settings.width, settings.height);
+    TileSender sender(fd);
+    renderer.observe_tiles(&sender);
+    std::vector<int> tiles;
+    while (receive_message(fd, type, payload, distributed_max_payload)) {
+        if (type == message_done) {
+            close(fd);
+            return 0;
+        }
+        if (type != message_tiles) {
+            continue;
+        }
+        tiles.resize(payload.size() / sizeof(int32_t));
+        memcpy(tiles.data(), payload.data(), tiles.size() * sizeof(int32_t));
+        int tile_count = tiles_x(settings) * tiles_y(settings);
+        bool valid = payload.size() % sizeof(int32_t) == 0 &&
+            std::all_of(tiles.begin(), tiles.end(), [&](int tile) { return tile >= 0 && tile < tile_count; });
+        if (!valid) {
+            fprintf(stderr, "Worker: invalid tiles from %s\n", address.c_str());
+            close(fd);
+            return 1;
+        }
+        renderer.render_frame(*scene, settings, framebuffer, nullptr, &tiles);
+        if (sender.lost_connection()) {
+            break;
+        }
+    }
+    fprintf(stderr, "Worker: lost the connection to %s\n", address.c_str());
+    close(fd);
+    return 1;
+}
+
+struct WorkerConnection {
+    int fd = -1;
+    int threads = 0;
+    std::string received;
+    std::vector<int> in_flight;
+
+    explicit WorkerConnection(int fd) : fd(fd) {}
+};
+
+/*
+ * Renders the scene into framebuffer on the workers that connect to port.
+ * If spawn is positive that many local worker processes with
+ * settings.threads threads each are started first. Waits for the first
+ * worker for as long as it takes; if all workers that came have gone again
+ * before the frame is done, the tiles left are rendered here with
+ * settings.threads threads. Returns false if the port can not be used.
+ */
+inline bool render_distributed(const Scene &scene, const RenderSettings &settings, bool ball_bvh,
+        int port, int spawn, Framebuffer &framebuffer, bool print_stats) {
+    int listener = listen_tcp(port);
+    if (listener < 0) {
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<pid_t> children;
+    for (int i = 0; i < spawn; i++) {
+        pid_t child = fork();
+        if (child == 0) {
+            close(listener);
+            _exit(run_worker("127.0.0.1:" + std::to_string(port), settings.threads));
+        }
+        if (child > 0) {
+            children.push_back(child);
+        }
+    }
+
+    std::ostringstream text;
+    write_scene(text, scene);
+    std::string scene_message = pack_settings(settings, ball_bvh) + text.str();
+
+    int tile_count = tiles_x(settings) * tiles_y(settings);
+    std::deque<int> pending;
+    for (int tile = 0; tile < tile_count; tile++) {
+        pending.push_back(tile);
+    }
+    std::vector<char> done(tile_count, 0);
+    int remaining = tile_count;
+    std::vector<WorkerConnection> workers;
+    int workers_seen = 0;
+
+    auto drop = [&](size_t w) {
+        WorkerConnection &worker = workers[w];
+        int requeued = 0;
+        for (auto it = worker.in_flight.rbegin(); it != worker.in_flight.rend(); ++it) {
+            if (!done[*it]) {
+                pending.push_front(*it);
+                requeued++;
+            }
+        }
+        fprintf(stderr, "Worker disconnected, reassigning %d tiles\n", requeued);
+        close(worker.fd);
+        workers.erase(workers.begin() + w);
+    };
+
+    // Sends the worker batches of tiles until two batches are in flight
+    auto dispatch = [&](WorkerConnection &worker) {
+        std::vector<int32_t> batch;
+        while (worker.threads > 0 && !pending.empty() &&
+                static_cast<int>(worker.in_flight.size()) <= worker.threads) {
+            batch.clear();
+            while (!pending.empty() && static_cast<int>(batch.size()) < worker.threads) {
+                batch.push_back(pending.front());
+                pending.pop_front();
+            }
+            worker.in_flight.insert(worker.in_flight.end(), batch.begin(), batch.end());
+            if (!send_message(worker.fd, message_tiles, batch.data(), batch.size() * sizeof(int32_t))) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    // Handles the message, returns false if the worker broke the protocol
+    auto handle = [&](WorkerConnection &worker, uint32_t type, const std::string &payload) {
+        if (type == message_hello && payload.size() == sizeof(int32_t)) {
+            int32_t threads;
+            memcpy(&threads, payload.data(), sizeof(threads));
+            worker.threads = std::clamp(static_cast<int>(threads), 1, max_worker_threads);
+            return send_message(worker.fd, message_scene, scene_message.data(), scene_message.size());
+        }
+        if (type != message_pixels || payload.size() < sizeof(int32_t)) {
+            return false;
+        }
+        int32_t tile;
+        memcpy(&tile, payload.data(), sizeof(tile));
+        if (tile < 0 || tile >= tile_count) {
+            return false;
+        }
+        Tile rect = tile_rect(settings, tile);
+        size_t expected = sizeof(int32_t) + 3 * static_cast<size_t>(rect.x1 - rect.x0) * (rect.y1 - rect.y0);
+        if (payload.size() != expected) {
+            return false;
+        }
+        auto it = std::find(worker.in_flight.begin(), worker.in_flight.end(), tile);
+        if (it != worker.in_flight.end()) {
+            worker.in_flight.erase(it);
+        }
+        if (!done[tile]) {
+            const unsigned char *pixel = reinterpret_cast<const unsigned char*>(payload.data()) + sizeof(int32_t);
+            for (int y = rect.y0; y < rect.y1; y++) {
+                for (int x = rect.x0; x < rect.x1; x++) {
+                    int i = x + y * framebuffer.width;
+                    framebuffer.red[i] = pixel[0];
+                    framebuffer.green[i] = pixel[1];
+                    framebuffer.blue[i] = pixel[2];
+                    pixel += 3;
+                }
+            }
+            done[tile] = 1;
+            remaining--;
+        }
+        return true;
+    };
+
+    std::vector<pollfd> polled;
+    char chunk[65536];
+    while (remaining > 0) {
+        polled.clear();
+        polled.push_back({listener, POLLIN, 0});
+        for (auto &worker : workers) {
+            polled.push_back({worker.fd, POLLIN, 0});
+        }
+        if (poll(polled.data(), polled.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+        // Workers are handled from the back so dropping one keeps the
+        // indices of the ones not handled yet
+        for (size_t w = workers.size(); w-- > 0;) {
+            if (!polled[w + 1].revents) {
+                continue;
+            }
+            WorkerConnection &worker = workers[w];
+            ssize_t received = recv(worker.fd, chunk, sizeof(chunk), 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            bool ok = received > 0;
+            if (ok) {
+                worker.received.append(chunk, received);
+                uint32_t type;
+                std::string payload;
+                Taken taken = Taken::incomplete;
+                while (ok && (taken = take_message(worker.received, type, payload,
+                                distributed_max_payload)) == Taken::message) {
+                    ok = handle(worker, type, payload);
+                }
+                ok = ok && taken != Taken::too_long;
+                ok = ok && dispatch(worker);
+            }
+            if (!ok) {
+                drop(w);
+            }
+        }
+        if (polled[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                workers.emplace_back(fd);
+                workers_seen++;
+            }
+        }
+        // Tiles given back by dropped workers go to the ones left
+        for (size_t w = workers.size(); w-- > 0;) {
+            if (!dispatch(workers[w])) {
+                drop(w);
+            }
+        }
+        if (workers.empty() && workers_seen > 0 && remaining > 0) {
+            // Every tile not done is pending once no worker holds any
+            fprintf(stderr, "No workers left, rendering %zu tiles here\n", pending.size());
+            std::vector<int> tiles(pending.begin(), pending.end());
+            pending.clear();
+            Renderer renderer(settings.threads);
+            renderer.render_frame(scene, settings, framebuffer, nullptr, &tiles);
+            for (int tile : tiles) {
+                done[tile] = 1;
+            }
+            remaining -= static_cast<int>(tiles.size());
+        }
+    }
+
+    for (auto &worker : workers) {
+        send_message(worker.fd, message_done, nullptr, 0);
+        close(worker.fd);
+    }
+    close(listener);
+    for (pid_t child : children) {
+        waitpid(child, nullptr, 0);
+    }
+    if (print_stats) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("distributed: %d tiles on %d workers in %.1f ms\n", tile_count, workers_seen,
+                elapsed.count() * 1000);
+    }
+    return remaining == 0;
+}
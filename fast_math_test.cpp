@@ -0,0 +1,75 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include "raytracer.hpp"
+
+/*
+ * Renders a fixed scene in the precise and in the fast math tier, with the
+ * recursive and the wavefront traversal, and fails if any channel of the
+ * two differs by more than fast_math_max_difference.
+ */
+
+/*
+ * A grid of balls in front of the default camera with a spread of colors,
+ * highlights and reflections, lit by a point light and, with area, by a
+ * sphere light whose shadows have penumbras.
+ */
+Scene test_scene(bool area) {
+    Scene scene;
+    Light light = {{1, 1, 0}, 0.8};
+    if (area) {
+        light.shape = LightShape::sphere;
+        light.radius = 0.3;
+    }
+    scene.lights.push_back(light);
+    for (int z = 0; z < 3; z++) {
+        for (int y = 0; y < 7; y++) {
+            for (int x = 0; x < 7; x++) {
+                int i = x + 7 * (y + 7 * z);
+                Ball ball;
+                ball.pos = {(x - 3) * 0.16 + z * 0.05, (y - 3) * 0.16 - z * 0.03, -1.2 - z * 0.4};
+                ball.radius = 0.06 + 0.01 * (i % 4);
+                ball.color = {0.2 + 0.1 * (i % 8), 0.3 + 0.1 * (i % 7), 0.9 - 0.1 * (i % 6)};
+                ball.specular_parameter = 10 + 97.0 * (i % 11);
+                ball.reflective_parameter = i % 5 == 0 ? 1 : 0.5 + 0.05 * (i % 9);
+                scene.balls.push_back(ball);
+            }
+        }
+    }
+    build_acceleration(scene);
+    return scene;
+}
+
+int max_difference(const Framebuffer &a, const Framebuffer &b) {
+    int largest = 0;
+    for (size_t i = 0; i < a.red.size(); i++) {
+        largest = std::max({largest, std::abs(a.red[i] - b.red[i]), std::abs(a.green[i] - b.green[i]),
+            std::abs(a.blue[i] - b.blue[i])});
+    }
+    return largest;
+}
+
+int main() {
+    bool ok = true;
+    for (bool area : {false, true}) {
+        Scene scene = test_scene(area);
+        for (bool wavefront : {false, true}) {
+            RenderSettings settings;
+            settings.width = 240;
+            settings.height = 180;
+            settings.threads = 2;
+            settings.wavefront = wavefront;
+            Framebuffer precise(settings.width, settings.height);
+            render(scene, settings, precise);
+            settings.math = MathTier::fast;
+            Framebuffer fast(settings.width, settings.height);
+            render(scene, settings, fast);
+            int difference = max_difference(precise, fast);
+            printf("%s light, %s: max difference %d\n", area ? "area" : "point",
+                    wavefront ? "wavefront" : "recursive", difference);
+            ok = ok && difference <= fast_math_max_difference;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <vector>
+
+/*
+ * Final 8 bit pixel values, one array per channel, laid out like ppma_write
+ * expects them.
+ */
+struct Framebuffer {
+    int width;
+    int height;
+    std::vector<int> red;
+    std::vector<int> green;
+    std::vector<int> blue;
+
+    Framebuffer(int width, int height) :
+        width(width), height(height),
+        red(width*height), green(width*height), blue(width*height) {}
+};
+
+struct Tile {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
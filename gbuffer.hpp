@@ -0,0 +1,165 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "camera.hpp"
+#include "trace.hpp"
+
+/*
+ * One bounce of the path traced from a pixel: the ray parameter of the hit,
+ * the hit point, the surface normal there and the id of the ball hit. ball
+ * is -1 if the ray hit nothing and saw the background.
+ */
+struct GBufferSample {
+    double t;
+    Vector3 point;
+    Vector3 normal;
+    int ball;
+};
+
+const int gbuffer_path_length = max_recursion_depth + 1;
+
+/*
+ * Per pixel arbitrary output variables: every bounce of the path of every
+ * pixel, stored pixel by pixel with gbuffer_path_length samples each. A path
+ * ends at its first miss or after gbuffer_path_length hits; samples after
+ * the end are unused.
+ *
+ * The path geometry only depends on the geometry of the scene, so the image
+ * can be reshaded from it for any lights and materials without tracing a
+ * single ray. geometry_hash is the scene_geometry_hash the paths were traced
+ * with, and camera the camera that traced the primary rays.
+ */
+struct GBuffer {
+    int width = 0;
+    int height = 0;
+    uint64_t geometry_hash = 0;
+    Camera camera;
+    std::vector<GBufferSample> samples;
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        samples.resize(static_cast<size_t>(w) * h * gbuffer_path_length);
+    }
+
+    GBufferSample* path(int x, int y) {
+        return &samples[(static_cast<size_t>(x) + static_cast<size_t>(y) * width) * gbuffer_path_length];
+    }
+
+    const GBufferSample* path(int x, int y) const {
+        return &samples[(static_cast<size_t>(x) + static_cast<size_t>(y) * width) * gbuffer_path_length];
+    }
+};
+
+/*
+ * Traces the path starting with ray, whose closest hit is first_hit, and
+ * records every bounce in path.
+ */
+inline void trace_gbuffer_path(const Ray& ray, const std::optional<Hit> &first_hit,
+        const Scene &scene, GBufferSample *path) {
+    Ray current = ray;
+    std::optional<Hit> hit = first_hit;
+    for (int depth = 0; depth < gbuffer_path_length; depth++) {
+        if (!hit) {
+            path[depth] = {max_hit_distance, {0, 0, 0}, {0, 0, 0}, -1};
+            return;
+        }
+        SurfacePoint surface = surface_point(current, hit->ball, hit->t);
+        path[depth] = {hit->t, surface.point, surface.normal, hit->id};
+        if (depth == max_recursion_depth) {
+            return;
+        }
+        current = reflected_ray(surface);
+        hit = closest_hit(current, scene);
+    }
+}
+
+/*
+ * Shades a recorded path with the current lights and materials of the
+ * scene. ray is the primary ray the path started with. Gives exactly what
+ * cast_ray gives as long as the scene geometry has not changed.
+ */
+inline Color shade_gbuffer_path(const Ray& ray, const GBufferSample *path, const Scene &scene) {
+    Color local[gbuffer_path_length];
+    double reflective[gbuffer_path_length];
+    Color c = background_color;
+    int last = 0;
+    for (int depth = 0; depth < gbuffer_path_length; depth++) {
+        const GBufferSample &sample = path[depth];
+        if (sample.ball < 0) {
+            c = background_color;
+            last = depth;
+            break;
+        }
+        Ball ball = scene_ball(scene, sample.ball);
+        Vector3 from = depth == 0 ? ray.from : path[depth - 1].point;
+        SurfacePoint surface = {sample.point, sample.normal, vector_normalized(from - sample.point)};
+        local[depth] = shade_local(surface, ball, scene);
+        reflective[depth] = ball.reflective_parameter;
+        c = local[depth];
+        last = depth;
+    }
+    for (int depth = last - 1; depth >= 0; depth--) {
+        c = color_linear_interpolate(local[depth], c, reflective[depth]);
+    }
+    return c;
+}
+
+const char gbuffer_magic[8] = {'R', 'T', 'G', 'B', 'U', 'F', '0', '3'};
+
+/*
+ * Writes the G-buffer as its header followed by the raw samples. Returns
+ * false on failure.
+ */
+inline bool save_gbuffer(const std::string &path, const GBuffer &gbuffer) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot open G-buffer file %s for writing\n", path.c_str());
+        return false;
+    }
+    int32_t header[3] = {gbuffer.width, gbuffer.height, gbuffer_path_length};
+    bool ok = fwrite(gbuffer_magic, sizeof(gbuffer_magic), 1, file) == 1 &&
+        fwrite(header, sizeof(header), 1, file) == 1 &&
+        fwrite(&gbuffer.geometry_hash, sizeof(uint64_t), 1, file) == 1 &&
+        fwrite(&gbuffer.camera, sizeof(Camera), 1, file) == 1 &&
+        fwrite(gbuffer.samples.data(), sizeof(GBufferSample), gbuffer.samples.size(), file) ==
+            gbuffer.samples.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Cannot write G-buffer file %s\n", path.c_str());
+    }
+    return ok;
+}
+
+inline std::optional<GBuffer> load_gbuffer(const std::string &path) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        fprintf(stderr, "Cannot open G-buffer file %s\n", path.c_str());
+        return std::nullopt;
+    }
+    GBuffer gbuffer;
+    char magic[8];
+    int32_t header[3];
+    bool ok = fread(magic, sizeof(magic), 1, file) == 1 &&
+        memcmp(magic, gbuffer_magic, sizeof(magic)) == 0 &&
+        fread(header, sizeof(header), 1, file) == 1 &&
+        header[0] > 0 && header[1] > 0 && header[2] == gbuffer_path_length &&
+        fread(&gbuffer.geometry_hash, sizeof(uint64_t), 1, file) == 1 &&
+        fread(&gbuffer.camera, sizeof(Camera), 1, file) == 1;
+    if (ok) {
+        gbuffer.resize(header[0], header[1]);
+        ok = fread(gbuffer.samples.data(), sizeof(GBufferSample), gbuffer.samples.size(), file) ==
+            gbuffer.samples.size();
+    }
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "%s is not a valid G-buffer file\n", path.c_str());
+        return std::nullopt;
+    }
+    return gbuffer;
+}
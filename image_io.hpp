@@ -0,0 +1,219 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <optional>
+#include <string>
+
+#include "framebuffer.hpp"
+#include "ppma_io.hpp"
+#include "qoi_io.hpp"
+#include "rle_io.hpp"
+
+/*
+ * Image file formats and their encoders. Every encoder turns a framebuffer
+ * into the bytes of a whole file in memory, so encoding and writing can
+ * run on different threads.
+ */
+
+enum class ImageFormat {
+    p3, // ASCII PPM, exactly as ppma_write writes it
+    p6, // binary PPM
+    qoi, // QOI, see qoi_io.hpp
+    rle, // PackBits run length encoding, see rle_io.hpp
+};
+
+/*
+ * Format named by the user, or nothing if there is no such format.
+ */
+inline std::optional<ImageFormat> parse_image_format(const std::string &name) {
+    if (name == "p3") {
+        return ImageFormat::p3;
+    }
+    if (name == "p6") {
+        return ImageFormat::p6;
+    }
+    if (name == "qoi") {
+        return ImageFormat::qoi;
+    }
+    if (name == "rle") {
+        return ImageFormat::rle;
+    }
+    return std::nullopt;
+}
+
+/*
+ * Format to write the file at path in: the ASCII PPM of ppma_write unless
+ * the extension says otherwise.
+ */
+inline ImageFormat image_format_for(const std::string &path) {
+    size_t dot = path.rfind('.');
+    std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+    if (extension == "pnm") {
+        return ImageFormat::p6;
+    }
+    if (extension == "qoi") {
+        return ImageFormat::qoi;
+    }
+    if (extension == "rle") {
+        return ImageFormat::rle;
+    }
+    return ImageFormat::p3;
+}
+
+/*
+ * The file ppma_write writes for the framebuffer under the name name,
+ * formatted on threads threads.
+ */
+inline std::string encode_p3(const Framebuffer &framebuffer, const std::string &name, int threads) {
+    return ppma_encode(name, framebuffer.width, framebuffer.height, framebuffer.red.data(),
+            framebuffer.green.data(), framebuffer.blue.data(), threads);
+}
+
+/*
+ * Binary PPM with 8 bit samples.
+ */
+inline std::string encode_p6(const Framebuffer &framebuffer) {
+    std::string header = "P6\n" + std::to_string(framebuffer.width) + " " +
+        std::to_string(framebuffer.height) + "\n255\n";
+    size_t pixels = static_cast<size_t>(framebuffer.width) * framebuffer.height;
+    std::string image(header.size() + 3 * pixels, '\0');
+    memcpy(image.data(), header.data(), header.size());
+    unsigned char *out = reinterpret_cast<unsigned char*>(image.data()) + header.size();
+    for (size_t i = 0; i < pixels; i++) {
+        out[3*i] = static_cast<unsigned char>(framebuffer.red[i]);
+        out[3*i + 1] = static_cast<unsigned char>(framebuffer.green[i]);
+        out[3*i + 2] = static_cast<unsigned char>(framebuffer.blue[i]);
+    }
+    return image;
+}
+
+/*
+ * True if a width by height image can be written in format. Prints why not
+ * otherwise.
+ */
+inline bool format_holds(ImageFormat format, int width, int height) {
+    if (format == ImageFormat::qoi && static_cast<long>(width) * height > qoi_max_pixels) {
+        fprintf(stderr, "QOI images have at most %ld pixels, %dx%d has more\n", qoi_max_pixels,
+                width, height);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * The bytes of the file at path holding the framebuffer in format, which
+ * must hold an image of its size (see format_holds). Formats
+ * that can encode in parallel use threads threads.
+ */
+inline std::string encode_image(const Framebuffer &framebuffer, const std::string &path, ImageFormat format,
+        int threads = 1) {
+    switch (format) {
+    case ImageFormat::p6:
+        return encode_p6(framebuffer);
+    case ImageFormat::qoi:
+        return qoi_encode(framebuffer.width, framebuffer.height, framebuffer.red.data(),
+                framebuffer.green.data(), framebuffer.blue.data());
+    case ImageFormat::rle:
+        return rle_encode(framebuffer.width, framebuffer.height, framebuffer.red.data(),
+                framebuffer.green.data(), framebuffer.blue.data());
+    case ImageFormat::p3:
+    default:
+        return encode_p3(framebuffer, path, threads);
+    }
+}
+
+/*
+ * Decodes a binary image file, P6, QOI or RLE, told apart by their magic.
+ * The ASCII P3 files are read with ppma_read. Returns nothing if data is
+ * none of them.
+ */
+inline std::optional<Framebuffer> decode_image(const std::string &data) {
+    int width = 0, height = 0;
+    std::string r, g, b;
+    if (data.compare(0, 4, "qoif") == 0) {
+        if (!qoi_decode(data, width, height, r, g, b)) {
+            return std::nullopt;
+        }
+    } else if (data.compare(0, 4, "RLE8") == 0) {
+        if (!rle_decode(data, width, height, r, g, b)) {
+            return std::nullopt;
+        }
+    } else if (data.compare(0, 3, "P6\n") == 0) {
+        int max_color = 0, offset = 0;
+        if (sscanf(data.c_str(), "P6 %d %d %d%n", &width, &height, &max_color, &offset) != 3 ||
+                max_color != 255 || width <= 0 || height <= 0 ||
+                data.size() != offset + 1 + 3 * static_cast<size_t>(width) * height) {
+            return std::nullopt;
+        }
+        size_t pixels = static_cast<size_t>(width) * height;
+        r.resize(pixels);
+        g.resize(pixels);
+        b.resize(pixels);
+        for (size_t i = 0; i < pixels; i++) {
+            r[i] = data[offset + 1 + 3*i];
+            g[i] = data[offset + 1 + 3*i + 1];
+            b[i] = data[offset + 1 + 3*i + 2];
+        }
+    } else {
+        return std::nullopt;
+    }
+    Framebuffer framebuffer(width, height);
+    for (size_t i = 0; i < r.size(); i++) {
+        framebuffer.red[i] = static_cast<unsigned char>(r[i]);
+        framebuffer.green[i] = static_cast<unsigned char>(g[i]);
+        framebuffer.blue[i] = static_cast<unsigned char>(b[i]);
+    }
+    return framebuffer;
+}
+
+/*
+ * Writes data to the file at path. Returns false on failure.
+ */
+inline bool write_file(const std::string &path, const std::string &data) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s for writing\n", path.c_str());
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Cannot write %s\n", path.c_str());
+    }
+    return ok;
+}
+
+/*
+ * path with its run of '#' characters replaced by the zero padded frame
+ * number, e.g. frame_###.ppm becomes frame_007.ppm. Paths without '#' are
+ * returned as they are.
+ */
+inline std::string numbered_path(const std::string &path, int frame) {
+    size_t first = path.find('#');
+    if (first == std::string::npos) {
+        return path;
+    }
+    size_t last = path.find_first_not_of('#', first);
+    size_t width = (last == std::string::npos ? path.size() : last) - first;
+    std::string number = std::to_string(frame);
+    if (number.size() < width) {
+        number.insert(0, width - number.size(), '0');
+    }
+    return path.substr(0, first) + number + (last == std::string::npos ? "" : path.substr(last));
+}
+
+/*
+ * Reads the whole file at path into data. Returns false on failure.
+ */
+inline bool read_file(const std::string &path, std::string &data) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        return false;
+    }
+    std::ostringstream contents;
+    contents << input.rdbuf();
+    data = contents.str();
+    return static_cast<bool>(input);
+}
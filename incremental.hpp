@@ -0,0 +1,166 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+
+#include "gbuffer.hpp"
+#include "render.hpp"
+
+/*
+ * Re-rendering only what a scene edit can change.
+ *
+ * The G-buffer of the previous render holds every ray of every pixel: which
+ * ball each ray hit and how far away. A tile of the previous image is still
+ * valid if none of the balls its rays hit changed and none of its rays can
+ * reach a changed ball, at its new place, before the ball the ray hit.
+ */
+
+inline bool same_ball(const Ball &a, const Ball &b) {
+    return a.pos.x == b.pos.x && a.pos.y == b.pos.y && a.pos.z == b.pos.z &&
+        a.radius == b.radius &&
+        a.color.r == b.color.r && a.color.g == b.color.g && a.color.b == b.color.b &&
+        a.specular_parameter == b.specular_parameter &&
+        a.reflective_parameter == b.reflective_parameter;
+}
+
+inline bool same_lights(const Scene &before, const Scene &after) {
+    if (before.lights.size() != after.lights.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < before.lights.size(); i++) {
+        const Light &a = before.lights[i];
+        const Light &b = after.lights[i];
+        auto same = [](const Vector3 &u, const Vector3 &v) {
+            return u.x == v.x && u.y == v.y && u.z == v.z;
+        };
+        if (!same(a.pos, b.pos) || a.intensity != b.intensity || a.shape != b.shape ||
+                a.radius != b.radius || !same(a.edge_u, b.edge_u) || !same(a.edge_v, b.edge_v)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Sorted ids of the balls that differ between the two scenes in any way,
+ * including balls that only exist in one of them. Both scenes must have
+ * their acceleration structures built.
+ */
+inline std::vector<int> changed_balls(const Scene &before, const Scene &after) {
+    int count_before = static_cast<int>(scene_ball_count(before));
+    int count_after = static_cast<int>(scene_ball_count(after));
+    std::vector<int> changed;
+    for (int id = 0; id < std::max(count_before, count_after); id++) {
+        if (id >= count_before || id >= count_after ||
+                !same_ball(scene_ball(before, id), scene_ball(after, id))) {
+            changed.push_back(id);
+        }
+    }
+    return changed;
+}
+
+/*
+ * Sorted ids of all balls hit by the primary and reflected rays of the tile.
+ */
+inline std::vector<int> tile_dependencies(const GBuffer &gbuffer, const Tile &tile) {
+    std::vector<int> balls;
+    for (int y = tile.y0; y < tile.y1; y++) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            const GBufferSample *path = gbuffer.path(x, y);
+            for (int depth = 0; depth < gbuffer_path_length && path[depth].ball >= 0; depth++) {
+                balls.push_back(path[depth].ball);
+            }
+        }
+    }
+    std::sort(balls.begin(), balls.end());
+    balls.erase(std::unique(balls.begin(), balls.end()), balls.end());
+    return balls;
+}
+
+/*
+ * True if any ray recorded for the tile could hit one of spheres before the
+ * ball it hit. The rays are rebuilt from the recorded hits exactly as they
+ * were traced.
+ */
+inline bool tile_rays_reach(const GBuffer &gbuffer, const Tile &tile,
+        const std::vector<BoundingSphere> &spheres) {
+    for (int y = tile.y0; y < tile.y1; y++) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            const GBufferSample *path = gbuffer.path(x, y);
+            Ray ray = primary_ray(gbuffer.camera, x, y, gbuffer.width, gbuffer.height);
+            for (int depth = 0; depth < gbuffer_path_length; depth++) {
+                const GBufferSample &sample = path[depth];
+                Vector3 dir = vector_normalized(ray.dir);
+                double t_max = sample.ball >= 0 ? sample.t : 1e300;
+                for (auto &sphere : spheres) {
+                    if (ray_reaches_sphere(ray.from, dir, sphere, t_max)) {
+                        return true;
+                    }
+                }
+                if (sample.ball < 0 || depth == max_recursion_depth) {
+                    break;
+                }
+                SurfacePoint surface = {sample.point, sample.normal, vector_normalized(ray.from - sample.point)};
+                ray = reflected_ray(surface);
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * Tiles of the previous render, whose G-buffer is previous, that have to be
+ * rendered again after before was edited into after. Returns every tile if
+ * the lights, the camera or the resolution changed, or if any ball changed
+ * while an area light casts shadows, which may fall anywhere.
+ */
+inline std::vector<int> dirty_tiles(const Scene &before, const Scene &after,
+        const GBuffer &previous, const RenderSettings &settings) {
+    int tile_count = tiles_x(settings) * tiles_y(settings);
+    std::vector<int> dirty;
+    if (!same_lights(before, after) || !same_camera(previous.camera, settings.camera) ||
+            previous.width != settings.width || previous.height != settings.height) {
+        for (int tile = 0; tile < tile_count; tile++) {
+            dirty.push_back(tile);
+        }
+        return dirty;
+    }
+
+    std::vector<int> changed = changed_balls(before, after);
+    if (changed.empty()) {
+        return dirty;
+    }
+    for (auto &light : after.lights) {
+        if (light.shape != LightShape::point) {
+            for (int tile = 0; tile < tile_count; tile++) {
+                dirty.push_back(tile);
+            }
+            return dirty;
+        }
+    }
+    std::vector<BoundingSphere> moved_to;
+    int count_after = static_cast<int>(scene_ball_count(after));
+    for (int id : changed) {
+        if (id < count_after) {
+            Ball ball = scene_ball(after, id);
+            // Padded like sphere_bounds to be safe against rounding
+            moved_to.push_back({ball.pos, ball.radius * (1 + 1e-9) + 1e-9});
+        }
+    }
+
+    for (int tile = 0; tile < tile_count; tile++) {
+        Tile rect = tile_rect(settings, tile);
+        std::vector<int> dependencies = tile_dependencies(previous, rect);
+        bool touched = false;
+        for (size_t i = 0, j = 0; i < dependencies.size() && j < changed.size();) {
+            if (dependencies[i] == changed[j]) {
+                touched = true;
+                break;
+            }
+            dependencies[i] < changed[j] ? i++ : j++;
+        }
+        if (touched || tile_rays_reach(previous, rect, moved_to)) {
+            dirty.push_back(tile);
+        }
+    }
+    return dirty;
+}
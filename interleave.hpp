@@ -0,0 +1,226 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <optional>
+
+#include "ball_pages.hpp"
+#include "bvh.hpp"
+#include "scene.hpp"
+#include "trace.hpp"
+
+/*
+ * Interleaved closest hit traversal of a batch of rays, to hide the cache
+ * misses of scenes larger than the caches. A ray that needs a node or the
+ * balls of a leaf prefetches them and the thread moves on to another of up
+ * to interleave_width rays in flight, coming back to the ray once the data
+ * had time to arrive.
+ *
+ * Every ray in flight is a stackless state machine in place of a C++20
+ * coroutine, as the build is C++17: its traversal stack of bvh_stack_size
+ * entries, its closest hit and a leaf waiting to be tested. A step of a ray either tests the leaf it
+ * waited for, or pops nodes until it has to wait. An inner node has its
+ * children tested, and every child pushed gets what its own step will read
+ * prefetched: the children of an inner node, the items of a leaf, or the
+ * balls of a leaf of ball pages, which also asks the kernel for the page
+ * (see ball_pages.hpp). A popped leaf of the ball BVH has its balls
+ * prefetched through the items and is tested in the next step of the ray.
+ * Switching rays costs branch mispredictions, so a ray does not wait for
+ * the nodes above interleave_cached_depth, which stay in the caches anyway.
+ *
+ * The rays visit the same leaves as with bvh_traverse and keep the closest
+ * hit by the same rule, so the hits are those of closest_hit. On the
+ * machines measured so far switching rays costs more than the misses it
+ * hides, so the mode is opt in and --autotune does not try it.
+ */
+
+const int interleave_width = 8;
+const int interleave_cached_depth = 12;
+const int interleave_batch = 256;
+
+struct InterleavedRay {
+    int index;          // in the batch, or -1 when the slot is free
+    BoxRay box_ray;
+    int stack[bvh_stack_size];
+    double stack_entry[bvh_stack_size];
+    int stack_depth[bvh_stack_size];
+    int size;
+    int leaf;           // popped leaf whose balls are on their way, or -1
+};
+
+inline void prefetch_bytes(const void *data, size_t bytes) {
+    const char *begin = static_cast<const char*>(data);
+    for (size_t offset = 0; offset < bytes; offset += 64) {
+        __builtin_prefetch(begin + offset);
+    }
+    __builtin_prefetch(begin + bytes - 1);
+}
+
+/*
+ * Finds the closest hits of rays [0, count) in the hierarchy of nodes,
+ * updating closest. on_push(leaf) prefetches what on_pop(leaf) reads, and
+ * on_pop(leaf) what test(leaf, ray, closest) reads.
+ */
+template <class OnPush, class OnPop, class Test>
+void interleaved_traverse(const BvhNode *nodes, const Ray *rays, int count, ClosestHit *closest,
+        OnPush &&on_push, OnPop &&on_pop, Test &&test) {
+    auto push = [&](InterleavedRay &ray, int node, double t_entry, int depth) {
+        const BvhNode &n = nodes[node];
+        if (n.count > 0) {
+            on_push(n);
+        } else {
+            prefetch_bytes(&nodes[n.first], 2 * sizeof(BvhNode));
+        }
+        // Holds as long as the tree is no deeper than bvh_stack_size - 1
+        assert(ray.size < bvh_stack_size);
+        ray.stack[ray.size] = node;
+        ray.stack_depth[ray.size] = depth;
+        ray.stack_entry[ray.size++] = t_entry;
+    };
+    int next = 0;
+    auto start = [&](InterleavedRay &ray) {
+        while (next < count) {
+            int i = next++;
+            double t_entry;
+            ray.box_ray = make_box_ray(rays[i].from, rays[i].dir);
+            if (ray_enters_box(ray.box_ray, nodes[0].bounds, closest[i].t, t_entry)) {
+                ray.index = i;
+                ray.size = 0;
+                ray.leaf = -1;
+                push(ray, 0, t_entry, 0);
+                return;
+            }
+        }
+        ray.index = -1;
+    };
+    // Returns false once the ray is done
+    auto step = [&](InterleavedRay &ray) {
+        ClosestHit &hit = closest[ray.index];
+        if (ray.leaf >= 0) {
+            test(nodes[ray.leaf], rays[ray.index], hit);
+            ray.leaf = -1;
+            return ray.size > 0;
+        }
+        while (ray.size > 0) {
+            ray.size--;
+            if (ray.stack_entry[ray.size] > hit.t) {
+                continue;
+            }
+            const BvhNode &node = nodes[ray.stack[ray.size]];
+            int depth = ray.stack_depth[ray.size] + 1;
+            if (node.count > 0) {
+                on_pop(node);
+                ray.leaf = ray.stack[ray.size];
+                return true;
+            }
+            double t_left, t_right;
+            bool left = ray_enters_box(ray.box_ray, nodes[node.first].bounds, hit.t, t_left);
+            bool right = ray_enters_box(ray.box_ray, nodes[node.first + 1].bounds, hit.t, t_right);
+            if (left && right) {
+                if (t_left <= t_right) {
+                    push(ray, node.first + 1, t_right, depth);
+                    push(ray, node.first, t_left, depth);
+                } else {
+                    push(ray, node.first, t_left, depth);
+                    push(ray, node.first + 1, t_right, depth);
+                }
+            } else if (left) {
+                push(ray, node.first, t_left, depth);
+            } else if (right) {
+                push(ray, node.first + 1, t_right, depth);
+            }
+            if (depth >= interleave_cached_depth) {
+                return ray.size > 0;
+            }
+        }
+        return false;
+    };
+
+    InterleavedRay in_flight[interleave_width];
+    int active = 0;
+    for (auto &ray : in_flight) {
+        start(ray);
+        active += ray.index >= 0;
+    }
+    int lane = 0;
+    while (active > 0) {
+        InterleavedRay &ray = in_flight[lane];
+        lane = lane + 1 == interleave_width ? 0 : lane + 1;
+        if (ray.index >= 0 && !step(ray)) {
+            start(ray);
+            active -= ray.index < 0;
+        }
+    }
+}
+
+/*
+ * closest_hit of rays [0, count) into hits, with the ball BVH and the ball
+ * pages traversed interleaved. Instances are traced one ray at a time.
+ */
+inline void closest_hits(const Ray *rays, int count, const Scene &scene, std::optional<Hit> *hits) {
+    ClosestHit closest[interleave_batch];
+    for (int begin = 0; begin < count; begin += interleave_batch) {
+        int n = std::min(interleave_batch, count - begin);
+        const Ray *batch = rays + begin;
+        std::fill(closest, closest + n, ClosestHit());
+
+        if (scene.ball_bvh.nodes.empty()) {
+            for (int r = 0; r < n; r++) {
+                for (int i = 0; i < static_cast<int>(scene.balls.size()); i++) {
+                    auto intersection = intersects_ball(batch[r], scene.balls[i]);
+                    if (intersection) {
+                        closest[r].offer(intersection.value(), i, &scene.balls[i]);
+                    }
+                }
+            }
+        } else {
+            const int *items = scene.ball_bvh.items.data();
+            const Ball *balls = scene.balls.data();
+            interleaved_traverse(scene.ball_bvh.nodes.data(), batch, n, closest,
+                [&](const BvhNode &leaf) {
+                    prefetch_bytes(items + leaf.first, leaf.count * sizeof(int));
+                },
+                [&](const BvhNode &leaf) {
+                    for (int i = leaf.first; i < leaf.first + leaf.count; i++) {
+                        prefetch_bytes(balls + items[i], sizeof(Ball));
+                    }
+                },
+                [&](const BvhNode &leaf, const Ray &ray, ClosestHit &hit) {
+                    for (int i = leaf.first; i < leaf.first + leaf.count; i++) {
+                        auto intersection = intersects_ball(ray, balls[items[i]]);
+                        if (intersection) {
+                            hit.offer(intersection.value(), items[i], &balls[items[i]]);
+                        }
+                    }
+                });
+        }
+
+        if (scene.pages) {
+            const BallPages &pages = *scene.pages;
+            int first_id = paged_first_id(scene);
+            interleaved_traverse(pages.nodes, batch, n, closest,
+                [&](const BvhNode &leaf) {
+                    if (pages.prefetch) {
+                        prefetch_ball_page(pages, leaf.first / pages.balls_per_page);
+                    }
+                    prefetch_bytes(&pages.ball(leaf.first), leaf.count * sizeof(Ball));
+                },
+                [&](const BvhNode &) {},
+                [&](const BvhNode &leaf, const Ray &ray, ClosestHit &hit) {
+                    for (long i = leaf.first; i < leaf.first + leaf.count; i++) {
+                        const Ball &ball = pages.ball(i);
+                        auto intersection = intersects_ball(ray, ball);
+                        if (intersection) {
+                            hit.offer(intersection.value(), first_id + static_cast<int>(i), &ball);
+                        }
+                    }
+                });
+        }
+
+        for (int r = 0; r < n; r++) {
+            if (!scene.instances.empty()) {
+                closest_instance_hit(batch[r], scene, closest[r]);
+            }
+            hits[begin + r] = closest_hit_result(closest[r]);
+        }
+    }
+}
@@ -1,161 +1,391 @@
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <cstring>
 #include <vector>
-#include <optional>
+#include <ctime>
+#include <string>
+#include <thread>
 
 #include "ppma_io.hpp"
-#include "vector.hpp"
-#include "color.hpp"
-
-struct Ball {
-    Vector3 pos;
-    double radius;
-    Color color;
-    double specular_parameter;
-    double reflective_parameter;
-};
-
-struct Camera {
-    Vector3 pos;
-};
+#include "raytracer.hpp"
+#include "gbuffer.hpp"
+#include "incremental.hpp"
+#include "distributed.hpp"
+#include "daemon.hpp"
+#include "checkpoint.hpp"
+#include "image_io.hpp"
+#include "output_pipeline.hpp"
+#include "pyramid.hpp"
+#include "animation.hpp"
+#include "temporal.hpp"
+#include "autotune.hpp"
 
-struct Light {
-    Vector3 pos;
-    double intensity;
-};
-
-struct Ray {
-    Vector3 from;
-    Vector3 dir;
-};
+double frand(double min, double max) {
+    double f = static_cast<double>(rand())/RAND_MAX;
+    return min + f * (max - min);
+}
 
 /*
- * Standard algorithm for intersection between line and sphere.
- * Returns optional which has a value if they intersected containing the 
- * parameter of the ray t.
- * 
- * Since reflection rays are cast from intersection locations we need to exclude
- * intersections that are with the reflective surface itself. We therefore 
- * require that the parameter t is larger than 0.00001.
+ * Command line options:
+ * --scene FILE  load the scene from FILE instead of generating a random one.
+ * --save-scene FILE write the scene to FILE.
+ * --seed N      seed for the random scene, defaults to the current time.
+ * --balls N     number of small random balls in the scene.
+ * --instances N add N instances of a small cluster of balls.
+ * --flatten     store instanced balls explicitly instead, for comparison.
+ * --no-bvh      test explicit balls one by one instead of through a BVH.
+ * --save-pages FILE write the explicit balls of the scene to the ball page
+ *               FILE, for scenes too large to keep in memory.
+ * --pages FILE  add the balls of the ball page FILE to the scene, mapped
+ *               from disk and paged in as rays reach them.
+ * --page-size KB page size of --save-pages, 64 KB by default.
+ * --no-prefetch do not read ahead the pages rays are about to enter.
+ * --bin-primary test primary rays only against the balls binned to their
+ *               tile by screen projection.
+ * --wavefront   trace bounce by bounce instead of recursively per pixel.
+ * --sort-rays   like --wavefront but sorting reflected rays for coherence.
+ * --interleave  like --wavefront but tracing the rays of a bounce
+ *               interleaved, prefetching instead of waiting for memory.
+ * --threads N   number of render threads, defaults to the hardware threads.
+ * --pin P       pin render threads to CPUs: none (the default), compact to
+ *               fill one NUMA node before the next, or scatter to spread
+ *               them over the nodes.
+ * --numa-replicate give every NUMA node of the pinned threads its own copy
+ *               of the scene.
+ * --autotune FILE pick tile size, thread count and traversal mode by
+ *               rendering probes of the scene, caching the choice in FILE
+ *               for later runs on similar scenes and the same machine.
+ * --scaling     benchmark: render the frame with 1, 2, 4, ... up to
+ *               --threads threads and print the speedup of each.
+ * --width N, --height N image size, 800x800 by default.
+ * --tile-size N edge length of the square tiles handed to threads.
+ * --camera X,Y,Z camera position, at the origin by default.
+ * --look-at X,Y,Z point the camera looks at, straight down -z by default.
+ * --fov DEG     vertical field of view of the camera, about 53 degrees by
+ *               default.
+ * --views FILE  render every view of the views FILE in one batch, sharing
+ *               the scene and threads. With several views the output file
+ *               needs a run of '#' for the view number.
+ * --samples N   primary rays per pixel, spread over the pixel for
+ *               anti-aliasing. 1 by default.
+ * --denoise     filter the rendered frame with the edge aware denoiser.
+ * --math precise|fast math tier of shading and intersection, precise by
+ *               default. fast trades a little accuracy for speed.
+ * --frames N    render the frame N times, e.g. to measure steady state.
+ * --gbuffer FILE also store the path of every pixel in the G-buffer FILE.
+ * --relight FILE shade the paths stored in the G-buffer FILE with the lights
+ *               and materials of the scene instead of rendering.
+ * --previous-scene FILE, --previous-gbuffer FILE, --previous-image FILE
+ *               re-render only the tiles that changed since the previous
+ *               render of the scene in FILE, which left the G-buffer and
+ *               image in the given files.
+ * --tile-cache DIR reuse tiles rendered by earlier runs from the cache in
+ *               DIR and add new tiles to it.
+ * --tile-cache-size MB size cap of the tile cache, 256 MB by default.
+ * --coordinator PORT render on the worker processes that connect to PORT.
+ * --spawn-workers N start N local worker processes for the coordinator.
+ * --worker HOST:PORT render tiles for the coordinator at HOST:PORT; the
+ *               scene and settings come from the coordinator.
+ * --serve SOCKET run as a render daemon on the Unix socket SOCKET.
+ * --daemon SOCKET render the --scene file on the daemon at SOCKET; the
+ *               output is a binary PPM.
+ * --checkpoint FILE keep finished tiles in the checkpoint FILE while
+ *               rendering, and remove it once the image is written.
+ * --resume      continue the render in the --checkpoint FILE.
+ * --checkpoint-interval S flush the checkpoint to disk every S seconds.
+ * --pyramid FILE also write the image as a tiled multi-resolution pyramid
+ *               to FILE, built as tiles finish. Needs an even --tile-size.
+ * --view-pyramid FILE write level --level of the pyramid in FILE to the
+ *               output file instead of rendering.
+ * --level N     pyramid level for --view-pyramid, 0 is full size.
+ * --trajectory FILE render one frame per frame of the trajectory FILE,
+ *               moving the balls and refitting the BVH in between. The
+ *               output file needs a run of '#' for the frame number.
+ * --temporal    with --trajectory, reproject each frame from the one before
+ *               to bound the rays and reuse shadows where settled.
+ * --verify      also render the full frame and report pixels that differ.
+ * --stats       print render time, ray throughput and heap allocations.
+ * --format F    output format p3, p6, qoi or rle, by default chosen by the
+ *               extension of the output file.
+ * --encoder-threads N threads encoding frames in the background.
+ * --output-queue N frames that may wait to be encoded and written before
+ *               rendering waits for them.
+ * -o FILE       output file, defaults to out.ppm. A run of '#' is replaced
+ *               by the frame number, and then every frame is written.
  */
-std::optional<double> intersects_ball(const Ray& ray, const Ball& ball) {
-    Vector3 norm_dir = vector_normalized(ray.dir);
-    double a = vector_length(norm_dir);
-    a = a * a;
-    double b = -2 * vector_dot(norm_dir, ball.pos - ray.from);
-    double c = vector_length(ball.pos - ray.from); 
-    c = c*c - (ball.radius*ball.radius);
+struct Options {
+    std::string scene_file;
+    std::string save_scene_file;
+    unsigned seed = time(NULL);
+    int ball_count = 30;
+    int instance_count = 0;
+    bool flatten = false;
+    bool ball_bvh = true;
+    std::string save_pages_file;
+    std::string pages_file;
+    int page_kb = default_ball_page_kb;
+    bool prefetch = true;
+    bool bin_primary = false;
+    bool wavefront = false;
+    bool sort_rays = false;
+    bool interleave = false;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    PinPolicy pin = PinPolicy::none;
+    bool numa_replicate = false;
+    bool scaling = false;
+    std::string autotune_file;
+    int width = 800;
+    int height = 800;
+    int tile_size = 32;
+    std::optional<Vector3> camera;
+    std::optional<Vector3> look_at_target;
+    double fov = 0;
+    std::string views_file;
+    int samples = 1;
+    bool denoise = false;
+    MathTier math = MathTier::precise;
+    int frames = 1;
+    std::string gbuffer_file;
+    std::string relight_file;
+    std::string previous_scene_file;
+    std::string previous_gbuffer_file;
+    std::string previous_image_file;
+    std::string tile_cache_dir;
+    int tile_cache_mb = 256;
+    int coordinator_port = 0;
+    int spawn_workers = 0;
+    std::string worker_address;
+    std::string serve_socket;
+    std::string daemon_socket;
+    std::string checkpoint_file;
+    bool resume = false;
+    double checkpoint_interval = 10;
+    std::string pyramid_file;
+    std::string trajectory_file;
+    bool temporal = false;
+    std::string view_pyramid_file;
+    int level = 0;
+    bool verify = false;
+    bool stats = false;
+    std::optional<ImageFormat> format;
+    int encoder_threads = 1;
+    int output_queue = 2;
+    std::string output = "out.ppm";
+};
 
-    if(b*b - 4*a*c > 0) {
-        double t = (-b - sqrt(b*b - 4*a*c)) / 2*a;
-        if(t < 0.00001) // dont intersect one self
-            return std::nullopt;
-        return std::optional<double>(t);
+Options parse_options(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "--scene") && has_value) {
+            options.scene_file = argv[++i];
+        } else if (!strcmp(argv[i], "--save-scene") && has_value) {
+            options.save_scene_file = argv[++i];
+        } else if (!strcmp(argv[i], "--seed") && has_value) {
+            options.seed = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--balls") && has_value) {
+            options.ball_count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--instances") && has_value) {
+            options.instance_count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--flatten")) {
+            options.flatten = true;
+        } else if (!strcmp(argv[i], "--no-bvh")) {
+            options.ball_bvh = false;
+        } else if (!strcmp(argv[i], "--save-pages") && has_value) {
+            options.save_pages_file = argv[++i];
+        } else if (!strcmp(argv[i], "--pages") && has_value) {
+            options.pages_file = argv[++i];
+        } else if (!strcmp(argv[i], "--page-size") && has_value) {
+            options.page_kb = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--no-prefetch")) {
+            options.prefetch = false;
+        } else if (!strcmp(argv[i], "--bin-primary")) {
+            options.bin_primary = true;
+        } else if (!strcmp(argv[i], "--wavefront")) {
+            options.wavefront = true;
+        } else if (!strcmp(argv[i], "--sort-rays")) {
+            options.wavefront = true;
+            options.sort_rays = true;
+        } else if (!strcmp(argv[i], "--interleave")) {
+            options.wavefront = true;
+            options.interleave = true;
+        } else if (!strcmp(argv[i], "--threads") && has_value) {
+            options.threads = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--pin") && has_value) {
+            if (!parse_pin_policy(argv[++i], options.pin)) {
+                fprintf(stderr, "Unknown pin policy %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--numa-replicate")) {
+            options.numa_replicate = true;
+        } else if (!strcmp(argv[i], "--scaling")) {
+            options.scaling = true;
+        } else if (!strcmp(argv[i], "--autotune") && has_value) {
+            options.autotune_file = argv[++i];
+        } else if (!strcmp(argv[i], "--width") && has_value) {
+            options.width = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--height") && has_value) {
+            options.height = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--tile-size") && has_value) {
+            options.tile_size = std::max(1, atoi(argv[++i]));
+        } else if ((!strcmp(argv[i], "--camera") || !strcmp(argv[i], "--look-at")) && has_value) {
+            Vector3 v;
+            if (sscanf(argv[i + 1], "%lf,%lf,%lf", &v.x, &v.y, &v.z) != 3) {
+                fprintf(stderr, "%s needs X,Y,Z, not %s\n", argv[i], argv[i + 1]);
+                exit(1);
+            }
+            (!strcmp(argv[i], "--camera") ? options.camera : options.look_at_target) = v;
+            i++;
+        } else if (!strcmp(argv[i], "--fov") && has_value) {
+            options.fov = atof(argv[++i]);
+            if (options.fov <= 0 || options.fov >= 180) {
+                fprintf(stderr, "--fov must be between 0 and 180 degrees\n");
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--views") && has_value) {
+            options.views_file = argv[++i];
+        } else if (!strcmp(argv[i], "--samples") && has_value) {
+            options.samples = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--denoise")) {
+            options.denoise = true;
+        } else if (!strcmp(argv[i], "--math") && has_value) {
+            i++;
+            if (!strcmp(argv[i], "precise")) {
+                options.math = MathTier::precise;
+            } else if (!strcmp(argv[i], "fast")) {
+                options.math = MathTier::fast;
+            } else {
+                fprintf(stderr, "Unknown math tier %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--frames") && has_value) {
+            options.frames = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--gbuffer") && has_value) {
+            options.gbuffer_file = argv[++i];
+        } else if (!strcmp(argv[i], "--relight") && has_value) {
+            options.relight_file = argv[++i];
+        } else if (!strcmp(argv[i], "--previous-scene") && has_value) {
+            options.previous_scene_file = argv[++i];
+        } else if (!strcmp(argv[i], "--previous-gbuffer") && has_value) {
+            options.previous_gbuffer_file = argv[++i];
+        } else if (!strcmp(argv[i], "--previous-image") && has_value) {
+            options.previous_image_file = argv[++i];
+        } else if (!strcmp(argv[i], "--tile-cache") && has_value) {
+            options.tile_cache_dir = argv[++i];
+        } else if (!strcmp(argv[i], "--tile-cache-size") && has_value) {
+            options.tile_cache_mb = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--coordinator") && has_value) {
+            options.coordinator_port = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--spawn-workers") && has_value) {
+            options.spawn_workers = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--worker") && has_value) {
+            options.worker_address = argv[++i];
+        } else if (!strcmp(argv[i], "--serve") && has_value) {
+            options.serve_socket = argv[++i];
+        } else if (!strcmp(argv[i], "--daemon") && has_value) {
+            options.daemon_socket = argv[++i];
+        } else if (!strcmp(argv[i], "--checkpoint") && has_value) {
+            options.checkpoint_file = argv[++i];
+        } else if (!strcmp(argv[i], "--resume")) {
+            options.resume = true;
+        } else if (!strcmp(argv[i], "--checkpoint-interval") && has_value) {
+            options.checkpoint_interval = std::max(0.01, atof(argv[++i]));
+        } else if (!strcmp(argv[i], "--pyramid") && has_value) {
+            options.pyramid_file = argv[++i];
+        } else if (!strcmp(argv[i], "--view-pyramid") && has_value) {
+            options.view_pyramid_file = argv[++i];
+        } else if (!strcmp(argv[i], "--level") && has_value) {
+            options.level = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--trajectory") && has_value) {
+            options.trajectory_file = argv[++i];
+        } else if (!strcmp(argv[i], "--temporal")) {
+            options.temporal = true;
+        } else if (!strcmp(argv[i], "--verify")) {
+            options.verify = true;
+        } else if (!strcmp(argv[i], "--stats")) {
+            options.stats = true;
+        } else if (!strcmp(argv[i], "--format") && has_value) {
+            options.format = parse_image_format(argv[++i]);
+            if (!options.format) {
+                fprintf(stderr, "Unknown format %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--encoder-threads") && has_value) {
+            options.encoder_threads = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--output-queue") && has_value) {
+            options.output_queue = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-o") && has_value) {
+            options.output = argv[++i];
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(1);
+        }
     }
-    return std::nullopt;
+    return options;
 }
 
 /*
- * Returns the light intensity as a function of:
- * - normal: The normal of the surface at the intersection point.
- * - light_dir: A vector pointing towards the point light.
- * - camera_vector: A vector pointing towards the camera used for specular
- *   lighting.
- * - specular_parameter: Specifies the exponent in the specular equation.
+ * A small molecule like cluster: a center ball with six smaller balls around
+ * it along the axes.
  */
-double light_intensity(const Vector3& normal, const Vector3& light_dir,
-        const Vector3& camera_vector, double specular_parameter) {
-
-    double cos_angle = vector_dot(vector_normalized(normal), vector_normalized(light_dir));
-    
-    // Ambient light
-    double lighting = 0.2;
-
-    // Diffuse light
-    lighting += (cos_angle >= 0.0 ? cos_angle : 0.0);
-
-    // Specular light
-    float s = specular_parameter;
-    Vector3 R = (normal*2*vector_dot(normal, light_dir)) - light_dir;
-    double numerator = vector_dot(R, camera_vector);
-    double denominator = (vector_length(R) * vector_length(camera_vector));
-    if(numerator >= 0) {
-        double tmp = std::pow(numerator / denominator, s); 
-        lighting += tmp;
+Cluster make_cluster() {
+    Cluster cluster;
+    cluster.balls.push_back({{0, 0, 0}, 0.05, {frand(0.3, 1), frand(0.3, 1), frand(0.3, 1)}, 500, 0.8});
+    const Vector3 offsets[] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+    for (auto &offset : offsets) {
+        cluster.balls.push_back({
+            offset * 0.07,
+            0.025,
+            {frand(0.3, 1), frand(0.3, 1), frand(0.3, 1)},
+            frand(100, 1000),
+            frand(0.7, 1.0)
+        });
     }
-    return lighting;
+    return cluster;
 }
 
-/* 
- * Returns the color resulting from casting the ray, ray in the scene 
- * with balls and lights. 
- * Recursion depth should be set to zero when calling from outside function.
+/*
+ * Random rotation from a random unit quaternion, with random scale and a
+ * translation in the same region as the random balls.
  */
-Color cast_ray(const Ray& ray,
-        const std::vector<Ball> &balls,
-        const std::vector<Light> &lights, int recursion_depth) {
-
-    auto light = lights[0]; // TODO: Handle more than one light 
-    // t is ray parameter of the intersection point.
-    double closest_t = 999999;
-    Color return_color;
-    for (auto &ball : balls) {
-        auto intersection = intersects_ball(ray, ball);
-        if (intersection) {
-            double t = intersection.value();
-            // Only redraw pixel if this ball is closer (smaller t)
-            if (t < closest_t) {
-                Vector3 intersection_point = (vector_normalized(ray.dir) * t) + ray.from;
-                Vector3 normal_vector = vector_normalized(intersection_point - ball.pos);
-                Vector3 light_dir = light.pos - intersection_point;
-                Vector3 camera_vector = vector_normalized(ray.from - intersection_point);
-                Color local_color = ball.color * light.intensity * 
-                    light_intensity(
-                        vector_normalized(normal_vector), 
-                        light_dir, 
-                        camera_vector, 
-                        ball.specular_parameter);
-
-                Ray reflected = {
-                    intersection_point, 
-                    normal_vector * (vector_dot(normal_vector, camera_vector) * 2) - camera_vector,
-                };
-
-                if (recursion_depth < 2) {
-                    Color reflected_color = cast_ray(reflected, balls, lights, recursion_depth+1);
-                    return_color = color_linear_interpolate(local_color, reflected_color, ball.reflective_parameter);
-                } else {
-                    return_color = local_color;
-                }
-                closest_t = t;
-            }
-        }    
-    }
-
-    // If no objects closer than 10000 units draw background
-    if(closest_t >= 10000) {
-        return Color({0.2, 0.2, 0.2});
-    }
-    return return_color;
+Transform random_transform() {
+    double qw, qx, qy, qz, length;
+    do {
+        qw = frand(-1, 1);
+        qx = frand(-1, 1);
+        qy = frand(-1, 1);
+        qz = frand(-1, 1);
+        length = std::sqrt(qw*qw + qx*qx + qy*qy + qz*qz);
+    } while (length > 1 || length < 0.01);
+    qw /= length;
+    qx /= length;
+    qy /= length;
+    qz /= length;
+    return {
+        {1 - 2*(qy*qy + qz*qz), 2*(qx*qy + qw*qz), 2*(qx*qz - qw*qy)},
+        {2*(qx*qy - qw*qz), 1 - 2*(qx*qx + qz*qz), 2*(qy*qz + qw*qx)},
+        {2*(qx*qz + qw*qy), 2*(qy*qz - qw*qx), 1 - 2*(qx*qx + qy*qy)},
+        frand(0.5, 1.5),
+        {frand(-0.5, 0.5), frand(-0.5, 0.5), frand(-3, -0.2)},
+    };
 }
 
-double frand(double min, double max) {
-    double f = static_cast<double>(rand())/RAND_MAX;
-    return min + f * (max - min);
-}
-
-int main(int argc, char **argv) {
-    const int W = 800;
-    const int H = 800;
-    const int max_color = 255;
-
+/*
+ * The default scene: random small balls in front of four large mirror
+ * balls, plus the optional random cluster instances.
+ */
+Scene random_scene(const Options &options) {
     Light l1 = {{1.0, 1.0, 0.0}, 0.5};
 
-    std::vector<Ball> balls;
-    std::vector<Light> lights = {l1};
+    Scene scene;
+    std::vector<Ball> &balls = scene.balls;
+    scene.lights = {l1};
 
-    srand(time(NULL));
+    srand(options.seed);
 
-    for(int i = 0; i < 30; i++) {
+    for(int i = 0; i < options.ball_count; i++) {
         
         Ball b1 = {
             {(frand(-0.5, 0.5)), frand(-0.5, 0.5), frand(-3, -0.2)}, 
@@ -196,30 +426,632 @@ int main(int argc, char **argv) {
                 0.1
             });
 
-    int red[W*H];
-    int green[W*H];
-    int blue[W*H];
-    for(int x = 0; x < W; x++) {
-        for(int y = 0; y < H; y++) {
-            double dx = static_cast<double>(x)/W - 0.5;
-            double dy = static_cast<double>(H-y)/H - 0.5;
-            const Vector3 from_vector = {dx, dy, 0};
+    if (options.instance_count > 0) {
+        scene.clusters.push_back(make_cluster());
+        for (int i = 0; i < options.instance_count; i++) {
+            scene.instances.push_back({0, random_transform()});
+        }
+    }
+    return scene;
+}
+
+RenderSettings render_settings(const Options &options) {
+    RenderSettings settings;
+    settings.width = options.width;
+    settings.height = options.height;
+    settings.tile_size = options.tile_size;
+    settings.threads = options.threads;
+    settings.wavefront = options.wavefront;
+    settings.sort_rays = options.sort_rays;
+    settings.interleave = options.interleave;
+    settings.bin_primary = options.bin_primary;
+    settings.samples = options.samples;
+    settings.denoise = options.denoise;
+    settings.math = options.math;
+    Vector3 pos = options.camera ? *options.camera : Vector3{0, 0, 0};
+    if (options.look_at_target || options.fov > 0) {
+        Vector3 target = options.look_at_target ? *options.look_at_target : pos + Vector3{0, 0, -1};
+        // The default field of view spans the unit image plane of the
+        // default camera
+        settings.camera = look_at(pos, target, options.fov > 0 ? options.fov : 2 * std::atan(0.5) * 180 / pi);
+    } else {
+        settings.camera.pos = pos;
+    }
+    return settings;
+}
+
+void print_frame_stats(int frame, const RenderStats &stats, const RenderSettings &settings) {
+    printf("frame %d: %.1f ms", frame, stats.seconds * 1000);
+    if (stats.rays > 0) {
+        printf(", %ld rays, %.2f Mrays/s", stats.rays, stats.rays / stats.seconds / 1e6);
+    }
+    if (settings.bin_primary) {
+        printf(", %.1f candidates per tile", stats.candidates_per_tile);
+    }
+    if (stats.cached_tiles > 0) {
+        printf(", %ld cached tiles", stats.cached_tiles);
+    }
+    if (settings.denoise) {
+        printf(", %.1f ms denoising", stats.denoise_seconds * 1000);
+    }
+    printf(", %ld heap allocations\n", stats.heap_allocations);
+}
+
+void mark_first_pixel(Framebuffer &framebuffer) {
+    framebuffer.red[0] = 255;
+    framebuffer.green[0] = 255;
+    framebuffer.blue[0] = 255;
+}
+
+ImageFormat output_format(const Options &options, const std::string &path) {
+    return options.format ? *options.format : image_format_for(path);
+}
+
+bool write_image(const std::string &name, Framebuffer &framebuffer, ImageFormat format, int threads) {
+    mark_first_pixel(framebuffer);
+    if (format == ImageFormat::p3) {
+        // Straight from the per thread buffers, without joining them first
+        return !ppma_write_parallel(name, framebuffer.width, framebuffer.height,
+                framebuffer.red.data(), framebuffer.green.data(), framebuffer.blue.data(), threads);
+    }
+    return write_file(name, encode_image(framebuffer, name, format, threads));
+}
+
+/*
+ * Loads an image written by write_image into framebuffer.
+ */
+bool read_image(const std::string &name, Framebuffer &framebuffer) {
+    std::string data;
+    if (!read_file(name, data)) {
+        fprintf(stderr, "Cannot read %s\n", name.c_str());
+        return false;
+    }
+    if (data.compare(0, 3, "P3\n") != 0) {
+        auto decoded = decode_image(data);
+        if (!decoded || decoded->width != framebuffer.width || decoded->height != framebuffer.height) {
+            fprintf(stderr, "%s is not a %dx%d image\n", name.c_str(), framebuffer.width,
+                    framebuffer.height);
+            return false;
+        }
+        framebuffer = std::move(*decoded);
+        return true;
+    }
+    int width, height, max_color;
+    int *red, *green, *blue;
+    if (ppma_read(name, width, height, max_color, &red, &green, &blue)) {
+        return false;
+    }
+    bool ok = width == framebuffer.width && height == framebuffer.height;
+    if (ok) {
+        std::copy(red, red + width*height, framebuffer.red.begin());
+        std::copy(green, green + width*height, framebuffer.green.begin());
+        std::copy(blue, blue + width*height, framebuffer.blue.begin());
+    } else {
+        fprintf(stderr, "%s is %dx%d, expected %dx%d\n", name.c_str(), width, height,
+                framebuffer.width, framebuffer.height);
+    }
+    delete[] red;
+    delete[] green;
+    delete[] blue;
+    return ok;
+}
+
+/*
+ * Renders the full frame in the precise math tier and prints how many
+ * channel values of framebuffer differ from it and by how much at most.
+ * Returns true if none differ, or with the fast tier if none differ by more
+ * than fast_math_max_difference.
+ */
+bool verify_frame(Renderer &renderer, const Scene &scene, const RenderSettings &settings,
+        Framebuffer &framebuffer) {
+    Framebuffer reference(framebuffer.width, framebuffer.height);
+    TileCache *cache = renderer.current_tile_cache();
+    renderer.use_tile_cache(nullptr);
+    RenderSettings precise = settings;
+    precise.math = MathTier::precise;
+    renderer.render_frame(scene, precise, reference);
+    renderer.use_tile_cache(cache);
+    // write_image overwrites the first pixel in both
+    reference.red[0] = framebuffer.red[0];
+    reference.green[0] = framebuffer.green[0];
+    reference.blue[0] = framebuffer.blue[0];
+    long differing = 0;
+    long total_difference = 0;
+    int max_difference = 0;
+    for (size_t i = 0; i < reference.red.size(); i++) {
+        for (int d : {reference.red[i] - framebuffer.red[i], reference.green[i] - framebuffer.green[i],
+                reference.blue[i] - framebuffer.blue[i]}) {
+            if (d != 0) {
+                differing++;
+                total_difference += std::abs(d);
+                max_difference = std::max(max_difference, std::abs(d));
+            }
+        }
+    }
+    printf("verify: %ld channel values differ from a full render, max difference %d, mean %.3f\n",
+            differing, max_difference, total_difference / (3.0 * reference.red.size()));
+    if (settings.math == MathTier::fast) {
+        return max_difference <= fast_math_max_difference;
+    }
+    return differing == 0;
+}
+
+/*
+ * Renders only the tiles the edit from the previous scene can have changed,
+ * reusing the rest of the previous image.
+ */
+int render_incremental(const Options &options, const Scene &scene, const RenderSettings &settings,
+        Renderer &renderer) {
+    auto before = load_scene(options.previous_scene_file);
+    if (!before) {
+        return 1;
+    }
+    build_acceleration(*before, options.ball_bvh);
+    auto gbuffer = load_gbuffer(options.previous_gbuffer_file);
+    if (!gbuffer) {
+        return 1;
+    }
+    if (gbuffer->geometry_hash != scene_geometry_hash(*before)) {
+        fprintf(stderr, "%s was not rendered from %s\n", options.previous_gbuffer_file.c_str(),
+                options.previous_scene_file.c_str());
+        return 1;
+    }
+    Framebuffer framebuffer(settings.width, settings.height);
+    if (!read_image(options.previous_image_file, framebuffer)) {
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int> tiles = dirty_tiles(*before, scene, *gbuffer, settings);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    RenderStats stats = renderer.render_frame(scene, settings, framebuffer, &*gbuffer, &tiles);
+    if (options.stats) {
+        printf("incremental: %zu of %d tiles dirty, found in %.1f ms\n", tiles.size(),
+                tiles_x(settings) * tiles_y(settings), elapsed.count() * 1000);
+        print_frame_stats(0, stats, settings);
+    }
+    if (options.verify && !verify_frame(renderer, scene, settings, framebuffer)) {
+        return 1;
+    }
+    if (!options.gbuffer_file.empty() && !save_gbuffer(options.gbuffer_file, *gbuffer)) {
+        return 1;
+    }
+    return write_image(options.output, framebuffer, output_format(options, options.output), options.threads) ? 0 : 1;
+}
+
+/*
+ * Renders the frames of the trajectory file with one renderer, framebuffer
+ * and output pipeline, refitting the BVH to the moved balls before each
+ * frame. With --temporal frames are reprojected from the frame before. With
+ * --verify every frame is compared with a full render of the scene with its
+ * BVH built from scratch, and must not differ unless --temporal reused
+ * light visibility.
+ */
+int render_sequence(const Options &options, Scene &scene, RenderSettings settings,
+        Renderer &renderer) {
+    if (numbered_path(options.output, 0) == options.output) {
+        fprintf(stderr, "--trajectory needs an output file with a run of '#', e.g. frame_###.ppm\n");
+        return 1;
+    }
+    auto trajectory = load_trajectory(options.trajectory_file, static_cast<int>(scene.balls.size()));
+    if (!trajectory) {
+        return 1;
+    }
+    Framebuffer framebuffer(settings.width, settings.height);
+    OutputPipeline pipeline(options.encoder_threads, options.output_queue);
+    TemporalRenderer temporal;
+    bool ok = true;
+    for (int frame = 0; frame < trajectory->frame_count() && ok; frame++) {
+        auto start = std::chrono::steady_clock::now();
+        apply_frame(*trajectory, frame, scene);
+        settings.camera = trajectory->cameras[frame];
+        std::chrono::duration<double> refit = std::chrono::steady_clock::now() - start;
+        RenderStats stats = options.temporal ?
+            temporal.render_frame(renderer, scene, settings, framebuffer) :
+            renderer.render_frame(scene, settings, framebuffer);
+        if (options.stats) {
+            printf("refit: %.2f ms, ", refit.count() * 1000);
+            print_frame_stats(frame, stats, settings);
+            if (options.temporal) {
+                printf("temporal: %ld hits reused their light visibility, %ld sampled it\n",
+                        temporal.reused_hits, temporal.sampled_hits);
+            }
+        }
+        if (options.verify) {
+            Scene rebuilt = scene;
+            build_acceleration(rebuilt, options.ball_bvh);
+            // Reused light visibility is an approximation, whose error is
+            // only reported
+            ok = verify_frame(renderer, rebuilt, settings, framebuffer) ||
+                (options.temporal && temporal.reused_hits > 0);
+        }
+        std::string path = numbered_path(options.output, frame);
+        mark_first_pixel(framebuffer);
+        pipeline.submit(framebuffer, path, output_format(options, path));
+    }
+    ok = pipeline.finish() && ok;
+    if (options.stats) {
+        printf("output: render waited %.1f ms for the encoder and writer\n",
+                pipeline.stalled_seconds * 1000);
+    }
+    return ok ? 0 : 1;
+}
+
+/*
+ * Renders the views of the views file in one batch and writes view i to the
+ * output file numbered i. With --verify every view is compared with a render
+ * of that view on its own.
+ */
+int render_batch(const Options &options, const Scene &scene, const RenderSettings &settings,
+        Renderer &renderer) {
+    auto views = load_views(options.views_file);
+    if (!views) {
+        return 1;
+    }
+    if (views->size() > 1 && numbered_path(options.output, 0) == options.output) {
+        fprintf(stderr, "--views needs an output file with a run of '#', e.g. view_##.ppm\n");
+        return 1;
+    }
+    std::vector<RenderSettings> view_settings;
+    std::vector<Framebuffer> framebuffers;
+    for (size_t v = 0; v < views->size(); v++) {
+        const View &view = (*views)[v];
+        std::string path = numbered_path(options.output, static_cast<int>(v));
+        if (!format_holds(output_format(options, path), view.width, view.height)) {
+            return 1;
+        }
+        RenderSettings s = settings;
+        s.camera = view.camera;
+        s.width = view.width;
+        s.height = view.height;
+        view_settings.push_back(s);
+        framebuffers.emplace_back(view.width, view.height);
+    }
+    bool ok = true;
+    for (int frame = 0; frame < options.frames; frame++) {
+        RenderStats stats = renderer.render_views(scene, view_settings, framebuffers);
+        if (options.stats) {
+            printf("%zu views: ", views->size());
+            print_frame_stats(frame, stats, settings);
+        }
+    }
+    OutputPipeline pipeline(options.encoder_threads, options.output_queue);
+    for (size_t v = 0; v < views->size(); v++) {
+        if (options.verify) {
+            ok = verify_frame(renderer, scene, view_settings[v], framebuffers[v]) && ok;
+        }
+        std::string path = numbered_path(options.output, static_cast<int>(v));
+        mark_first_pixel(framebuffers[v]);
+        pipeline.submit(framebuffers[v], path, output_format(options, path));
+    }
+    return pipeline.finish() && ok ? 0 : 1;
+}
+
+/*
+ * Renders the frame with 1, 2, 4, ... and finally --threads threads, each
+ * with a renderer of its own placed by --pin, and prints the time of the
+ * best of --frames frames after a warm up frame, the speedup over one
+ * thread and the NUMA nodes the threads ran on.
+ */
+int run_scaling(const Options &options, const Scene &scene, const RenderSettings &settings) {
+    NumaTopology topology = detect_numa_topology();
+    printf("numa: %d nodes", topology.node_count());
+    for (int node = 0; node < topology.node_count(); node++) {
+        printf("%s node %d with %zu cpus", node == 0 ? ":" : ",", topology.nodes[node],
+                topology.node_cpus[node].size());
+    }
+    printf("\n");
+    Framebuffer framebuffer(settings.width, settings.height);
+    double single = 0;
+    for (int threads = 1;; threads = std::min(threads * 2, options.threads)) {
+        Renderer renderer(threads, options.pin);
+        if (options.numa_replicate) {
+            renderer.replicate_scene(scene);
+        }
+        renderer.render_frame(scene, settings, framebuffer);
+        RenderStats best;
+        for (int frame = 0; frame < options.frames; frame++) {
+            RenderStats stats = renderer.render_frame(scene, settings, framebuffer);
+            if (frame == 0 || stats.seconds < best.seconds) {
+                best = stats;
+            }
+        }
+        if (threads == 1) {
+            single = best.seconds;
+        }
+        printf("%d threads on %d nodes: %.1f ms", threads, renderer.thread_pool().band_count(),
+                best.seconds * 1000);
+        if (best.rays > 0) {
+            printf(", %.2f Mrays/s", best.rays / best.seconds / 1e6);
+        }
+        printf(", speedup %.2f\n", single / best.seconds);
+        if (threads == options.threads) {
+            return 0;
+        }
+    }
+}
 
-            // this defines atan(1/2) fov
-            const Ray ray = {from_vector, {dx, dy, -1}};
+/*
+ * Writes one level of a pyramid file to the output file, reading it tile by
+ * tile through the mapping the way a viewer does.
+ */
+int view_pyramid(const Options &options) {
+    PyramidReader pyramid;
+    if (!pyramid.open(options.view_pyramid_file)) {
+        return 1;
+    }
+    if (options.level >= pyramid.level_count()) {
+        fprintf(stderr, "%s has only %d levels\n", options.view_pyramid_file.c_str(),
+                pyramid.level_count());
+        return 1;
+    }
+    const PyramidLevel &level = pyramid.level(options.level);
+    Framebuffer framebuffer(level.width, level.height);
+    for (int y = 0; y < level.height; y++) {
+        for (int x = 0; x < level.width; x++) {
+            const unsigned char *pixel = pyramid.pixel(options.level, x, y);
+            int i = x + y * level.width;
+            framebuffer.red[i] = pixel[0];
+            framebuffer.green[i] = pixel[1];
+            framebuffer.blue[i] = pixel[2];
+        }
+    }
+    return write_image(options.output, framebuffer, output_format(options, options.output),
+            options.threads) ? 0 : 1;
+}
 
-            // cast the ray from this pixel
-            Color c = cast_ray(ray, balls, lights, 0);
-            c = color_clamped(c);
+int main(int argc, char **argv) {
+    Options options = parse_options(argc, argv);
+    if ((options.samples > 1 || options.denoise) && (!options.gbuffer_file.empty() ||
+                !options.relight_file.empty() || !options.previous_scene_file.empty() || options.temporal)) {
+        fprintf(stderr, "--samples and --denoise do not work with G-buffers or --temporal\n");
+        return 1;
+    }
+    if (options.math != MathTier::precise && (!options.gbuffer_file.empty() ||
+                !options.relight_file.empty() || !options.previous_scene_file.empty() || options.temporal)) {
+        fprintf(stderr, "--math fast does not work with G-buffers or --temporal\n");
+        return 1;
+    }
+    if (options.denoise && (options.coordinator_port > 0 || !options.daemon_socket.empty() ||
+                !options.views_file.empty())) {
+        fprintf(stderr, "--denoise only works for single views rendered in this process\n");
+        return 1;
+    }
+    if (options.numa_replicate && !options.trajectory_file.empty()) {
+        fprintf(stderr, "--numa-replicate does not work with --trajectory, which moves the balls\n");
+        return 1;
+    }
+    if (!options.pages_file.empty() && (options.coordinator_port > 0 || !options.daemon_socket.empty())) {
+        fprintf(stderr, "--pages only works for renders in this process\n");
+        return 1;
+    }
+    if (!options.worker_address.empty()) {
+        return run_worker(options.worker_address, options.threads);
+    }
+    if (!options.serve_socket.empty()) {
+        RenderDaemon daemon(options.threads);
+        return daemon.serve(options.serve_socket) ? 0 : 1;
+    }
+    if (!options.view_pyramid_file.empty()) {
+        return view_pyramid(options);
+    }
+    if (!options.daemon_socket.empty()) {
+        if (options.scene_file.empty()) {
+            fprintf(stderr, "--daemon needs --scene\n");
+            return 1;
+        }
+        return render_with_daemon(options.daemon_socket, options.scene_file, render_settings(options),
+                options.ball_bvh, options.output, options.stats) ? 0 : 1;
+    }
 
-            red[x + y*W] = static_cast<int>(c.r*max_color);
-            green[x + y*W] = static_cast<int>(c.g*max_color);
-            blue[x + y*W] = static_cast<int>(c.b*max_color);
+    Scene scene;
+    if (!options.scene_file.empty()) {
+        auto loaded = load_scene(options.scene_file);
+        if (!loaded) {
+            return 1;
+        }
+        scene = std::move(*loaded);
+    } else {
+        scene = random_scene(options);
+    }
+    if (options.flatten) {
+        flatten_instances(scene);
+    }
+    if (!options.save_scene_file.empty() && !save_scene(options.save_scene_file, scene)) {
+        return 1;
+    }
+    if (!options.save_pages_file.empty() &&
+            !save_ball_pages(options.save_pages_file, scene.balls, options.page_kb * 1024)) {
+        return 1;
+    }
+    build_acceleration(scene, options.ball_bvh);
+    if (!options.pages_file.empty()) {
+        scene.pages = load_ball_pages(options.pages_file, options.prefetch);
+        if (!scene.pages) {
+            return 1;
         }
     }
-    red[0] = 255;
-    green[0] = 255;
-    blue[0] = 255;
-    ppma_write("out.ppm", W, H, red, green, blue);
+
+    if (options.stats) {
+        printf("scene: %ld balls, %zu stored, %zu instances, %.1f KB\n",
+                scene_ball_count(scene), scene.balls.size(), scene.instances.size(),
+                scene_memory_bytes(scene) / 1024.0);
+    }
+
+    RenderSettings settings = render_settings(options);
+    if (!format_holds(output_format(options, options.output), settings.width, settings.height)) {
+        return 1;
+    }
+    if (!options.autotune_file.empty()) {
+        uint64_t key = autotune_key(scene, settings);
+        auto tuned = load_tuned_settings(options.autotune_file, key);
+        bool cached = tuned.has_value();
+        if (!cached) {
+            tuned = autotune(scene, settings, options.pin, options.stats);
+            if (!store_tuned_settings(options.autotune_file, key, *tuned)) {
+                return 1;
+            }
+        }
+        apply_tuned_settings(*tuned, settings);
+        if (options.stats) {
+            printf("autotune: tile %d, %d threads, %s%s\n", tuned->tile_size, tuned->threads,
+                    traversal_mode_names[static_cast<int>(tuned->mode)], cached ? ", cached" : "");
+        }
+    }
+
+    if (options.coordinator_port > 0) {
+        // Before the renderer starts its threads, which spawned workers
+        // would not inherit
+        Framebuffer framebuffer(settings.width, settings.height);
+        if (!render_distributed(scene, settings, options.ball_bvh, options.coordinator_port,
+                    options.spawn_workers, framebuffer, options.stats)) {
+            return 1;
+        }
+        if (options.verify) {
+            Renderer renderer(settings.threads);
+            if (!verify_frame(renderer, scene, settings, framebuffer)) {
+                return 1;
+            }
+        }
+        return write_image(options.output, framebuffer, output_format(options, options.output), options.threads) ? 0 : 1;
+    }
+
+    if (options.scaling) {
+        return run_scaling(options, scene, settings);
+    }
+
+    Renderer renderer(settings.threads, options.pin);
+    if (options.numa_replicate) {
+        renderer.replicate_scene(scene);
+    }
+    TileCache tile_cache(options.tile_cache_dir, static_cast<uint64_t>(options.tile_cache_mb) << 20);
+    if (!options.tile_cache_dir.empty()) {
+        if (!tile_cache.open()) {
+            return 1;
+        }
+        renderer.use_tile_cache(&tile_cache);
+    }
+
+    if (!options.relight_file.empty()) {
+        auto gbuffer = load_gbuffer(options.relight_file);
+        if (!gbuffer) {
+            return 1;
+        }
+        if (gbuffer->geometry_hash != scene_geometry_hash(scene)) {
+            fprintf(stderr, "The scene geometry differs from the one %s was rendered with\n",
+                    options.relight_file.c_str());
+            return 1;
+        }
+        Framebuffer framebuffer(gbuffer->width, gbuffer->height);
+        for (int frame = 0; frame < options.frames; frame++) {
+            RenderStats stats = renderer.relight_frame(scene, *gbuffer, framebuffer);
+            if (options.stats) {
+                print_frame_stats(frame, stats, settings);
+            }
+        }
+        return write_image(options.output, framebuffer, output_format(options, options.output), options.threads) ? 0 : 1;
+    }
+
+    if (!options.previous_scene_file.empty()) {
+        return render_incremental(options, scene, settings, renderer);
+    }
+    if (!options.trajectory_file.empty()) {
+        return render_sequence(options, scene, settings, renderer);
+    }
+    if (!options.views_file.empty()) {
+        return render_batch(options, scene, settings, renderer);
+    }
+
+    GBuffer gbuffer;
+    GBuffer *recorded = options.gbuffer_file.empty() ? nullptr : &gbuffer;
+    Framebuffer framebuffer(settings.width, settings.height);
+
+    Checkpoint checkpoint;
+    std::vector<int> remaining;
+    std::vector<int> *tiles = nullptr;
+    if (!options.checkpoint_file.empty()) {
+        if (recorded && options.resume) {
+            fprintf(stderr, "--resume can not record a G-buffer\n");
+            return 1;
+        }
+        if (!checkpoint.open(options.checkpoint_file, settings, scene_hash(scene),
+                    options.resume, options.checkpoint_interval)) {
+            return 1;
+        }
+        remaining = checkpoint.restore(settings, framebuffer);
+        tiles = &remaining;
+        renderer.observe_tiles(&checkpoint);
+        if (options.stats) {
+            printf("checkpoint: %zu of %d tiles left\n", remaining.size(),
+                    tiles_x(settings) * tiles_y(settings));
+        }
+    }
+
+    PyramidWriter pyramid;
+    if (!options.pyramid_file.empty()) {
+        if (!pyramid.open(options.pyramid_file, settings)) {
+            return 1;
+        }
+        renderer.observe_tiles(&pyramid);
+    }
+
+    // Numbered outputs get every frame, written while the next one renders
+    bool numbered = numbered_path(options.output, 0) != options.output;
+    OutputPipeline pipeline(options.encoder_threads, options.output_queue);
+    for (int frame = 0; frame < options.frames; frame++) {
+        if (!options.pyramid_file.empty()) {
+            pyramid.start_frame();
+            // Tiles restored from the checkpoint are not rendered again
+            std::vector<bool> rendered(tiles_x(settings) * tiles_y(settings), !tiles);
+            for (int tile : remaining) {
+                rendered[tile] = true;
+            }
+            for (int tile = 0; tile < static_cast<int>(rendered.size()); tile++) {
+                if (!rendered[tile]) {
+                    pyramid.tile_done(tile, tile_rect(settings, tile), framebuffer);
+                }
+            }
+        }
+        RenderStats stats = renderer.render_frame(scene, settings, framebuffer, recorded, tiles);
+        if (options.stats) {
+            print_frame_stats(frame, stats, settings);
+        }
+        if (numbered) {
+            std::string path = numbered_path(options.output, frame);
+            mark_first_pixel(framebuffer);
+            pipeline.submit(framebuffer, path, output_format(options, path));
+        }
+    }
+    if (!pipeline.finish()) {
+        return 1;
+    }
+    if (scene.pages && options.stats) {
+        const BallPages &pages = *scene.pages;
+        printf("ball pages: %ld balls in %ld pages of %d KB, %.1f MB resident\n", pages.ball_count,
+                pages.page_count(), pages.page_bytes / 1024, ball_pages_resident_bytes(pages) / 1048576.0);
+    }
+    if (numbered && options.stats) {
+        printf("output: render waited %.1f ms for the encoder and writer\n",
+                pipeline.stalled_seconds * 1000);
+    }
+    if (recorded && !save_gbuffer(options.gbuffer_file, gbuffer)) {
+        return 1;
+    }
+    if (options.verify && !verify_frame(renderer, scene, settings, framebuffer)) {
+        return 1;
+    }
+
+    if (!numbered && !write_image(options.output, framebuffer, output_format(options, options.output), options.threads)) {
+        return 1;
+    }
+    if (!options.pyramid_file.empty()) {
+        renderer.stop_observing(&pyramid);
+        pyramid.close();
+    }
+    if (!options.checkpoint_file.empty()) {
+        renderer.stop_observing(&checkpoint);
+        checkpoint.close();
+        unlink(options.checkpoint_file.c_str());
+    }
     return 0;
 }
@@ -0,0 +1,208 @@
+#pragma once
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * NUMA placement of the render threads and of the memory they work on.
+ *
+ * The topology is read from /sys/devices/system/node, restricted to the
+ * CPUs the process may run on; machines without it are one node holding
+ * all of those CPUs. Pinned workers take the tasks of a parallel_for from
+ * the band of their own node first (see ThreadPool), so the tiles of a band
+ * of the image are written by the threads of one node. The framebuffer rows
+ * of the band and per-node copies of the scene are moved to that node with
+ * mbind. Pages are only moved when the workers span more than one node.
+ */
+
+enum class PinPolicy {
+    none,       // threads run wherever the kernel puts them
+    compact,    // fill the CPUs of one node before using the next
+    scatter,    // spread threads round robin over the nodes
+};
+
+inline bool parse_pin_policy(const char *text, PinPolicy &policy) {
+    if (!strcmp(text, "none")) {
+        policy = PinPolicy::none;
+    } else if (!strcmp(text, "compact")) {
+        policy = PinPolicy::compact;
+    } else if (!strcmp(text, "scatter")) {
+        policy = PinPolicy::scatter;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+struct NumaTopology {
+    // Nodes with any CPU the process may run on, and those CPUs
+    std::vector<int> nodes;
+    std::vector<std::vector<int>> node_cpus;
+
+    int node_count() const {
+        return static_cast<int>(node_cpus.size());
+    }
+};
+
+/*
+ * CPUs of a list like "0-3,8-11" as found in /sys.
+ */
+inline std::vector<int> parse_cpu_list(const std::string &text) {
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find(',', pos);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        std::string range = text.substr(pos, end - pos);
+        int first, last;
+        if (sscanf(range.c_str(), "%d-%d", &first, &last) == 2) {
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        } else if (sscanf(range.c_str(), "%d", &first) == 1) {
+            cpus.push_back(first);
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+inline NumaTopology detect_numa_topology() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_SET(0, &allowed);
+    }
+    NumaTopology topology;
+    for (int node = 0;; node++) {
+        std::ifstream input("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string text;
+        if (!input || !std::getline(input, text)) {
+            // Node numbers may have holes, but not many
+            if (node >= 64) {
+                break;
+            }
+            continue;
+        }
+        std::vector<int> cpus;
+        for (int cpu : parse_cpu_list(text)) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty()) {
+            topology.nodes.push_back(node);
+            topology.node_cpus.push_back(cpus);
+        }
+    }
+    if (topology.node_cpus.empty()) {
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        topology.nodes.push_back(0);
+        topology.node_cpus.push_back(cpus);
+    }
+    return topology;
+}
+
+/*
+ * Where the workers of a thread pool run: the CPU of every worker and its
+ * band, the index of its node among the nodes with workers. Unpinned
+ * workers have no CPU and all share band 0.
+ */
+struct ThreadPlacement {
+    std::vector<int> cpus;
+    std::vector<int> bands;
+    std::vector<int> band_nodes = {0};
+};
+
+/*
+ * Places threads workers on the CPUs of topology by policy. With more
+ * workers than CPUs the placement wraps around.
+ */
+inline ThreadPlacement thread_placement(const NumaTopology &topology, PinPolicy policy, int threads) {
+    ThreadPlacement placement;
+    if (policy == PinPolicy::none) {
+        return placement;
+    }
+    int nodes = topology.node_count();
+    std::vector<std::pair<int, int>> order;
+    if (policy == PinPolicy::compact) {
+        for (int node = 0; node < nodes; node++) {
+            for (int cpu : topology.node_cpus[node]) {
+                order.push_back({cpu, node});
+            }
+        }
+    } else {
+        for (size_t i = 0; order.size() < static_cast<size_t>(threads); i++) {
+            bool any = false;
+            for (int node = 0; node < nodes; node++) {
+                if (i < topology.node_cpus[node].size()) {
+                    order.push_back({topology.node_cpus[node][i], node});
+                    any = true;
+                }
+            }
+            if (!any) {
+                break;
+            }
+        }
+    }
+    placement.band_nodes.clear();
+    std::vector<int> band(nodes, -1);
+    for (int worker = 0; worker < threads; worker++) {
+        auto [cpu, node] = order[worker % order.size()];
+        // Nodes without workers get no band of the tasks
+        if (band[node] < 0) {
+            band[node] = static_cast<int>(placement.band_nodes.size());
+            placement.band_nodes.push_back(topology.nodes[node]);
+        }
+        placement.cpus.push_back(cpu);
+        placement.bands.push_back(band[node]);
+    }
+    return placement;
+}
+
+inline bool pin_current_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/*
+ * Moves the pages of [data, data + bytes) to node, and has later pages of
+ * the range allocated there. The range is widened to whole pages. A no-op
+ * where the kernel has no NUMA support.
+ */
+inline void move_to_node(const void *data, size_t bytes, int node) {
+    if (bytes == 0 || node < 0 || node >= 64) {
+        return;
+    }
+    // From <numaif.h>, which only comes with libnuma
+    const int mpol_preferred = 1;
+    const unsigned mpol_mf_move = 1 << 1;
+    uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    uintptr_t begin = reinterpret_cast<uintptr_t>(data) & ~(page - 1);
+    uintptr_t end = reinterpret_cast<uintptr_t>(data) + bytes;
+    unsigned long mask = 1ul << node;
+    syscall(SYS_mbind, begin, end - begin, mpol_preferred, &mask, 64ul, mpol_mf_move);
+}
+
+template <class T>
+void move_to_node(const std::vector<T> &v, int node) {
+    move_to_node(v.data(), v.size() * sizeof(T), node);
+}
@@ -0,0 +1,167 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "framebuffer.hpp"
+#include "image_io.hpp"
+
+/*
+ * Encodes and writes finished frames in the background while the next frame
+ * renders.
+ *
+ * submit copies the frame into one of capacity slots and returns. Encoder
+ * threads take submitted frames and encode them, and one writer thread
+ * writes the encoded files in the order they were submitted. When all slots
+ * are taken submit blocks until the writer has finished with the oldest
+ * frame, so rendering can never run more than capacity frames ahead of the
+ * disk. The slots keep their buffers, so a steady stream of frames of one
+ * size does not allocate framebuffers.
+ */
+class OutputPipeline {
+public:
+    OutputPipeline(int encoder_threads, int capacity) {
+        for (int i = 0; i < std::max(1, capacity); i++) {
+            slots.push_back(std::make_unique<Job>());
+            free_slots.push_back(slots.back().get());
+        }
+        for (int i = 0; i < std::max(1, encoder_threads); i++) {
+            encoders.emplace_back([this] { encode_loop(); });
+        }
+        writer = std::thread([this] { write_loop(); });
+    }
+
+    OutputPipeline(const OutputPipeline&) = delete;
+    OutputPipeline& operator=(const OutputPipeline&) = delete;
+
+    ~OutputPipeline() {
+        finish();
+    }
+
+    /*
+     * Queues framebuffer to be written to path in format. Blocks while all
+     * slots are in use.
+     */
+    void submit(const Framebuffer &framebuffer, const std::string &path, ImageFormat format) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto start = std::chrono::steady_clock::now();
+        changed.wait(lock, [this] { return !free_slots.empty(); });
+        std::chrono::duration<double> waited = std::chrono::steady_clock::now() - start;
+        stalled_seconds += waited.count();
+        Job *job = free_slots.back();
+        free_slots.pop_back();
+        lock.unlock();
+
+        job->pixels.width = framebuffer.width;
+        job->pixels.height = framebuffer.height;
+        job->pixels.red = framebuffer.red;
+        job->pixels.green = framebuffer.green;
+        job->pixels.blue = framebuffer.blue;
+        job->path = path;
+        job->format = format;
+
+        lock.lock();
+        job->sequence = submitted++;
+        job->encoded = false;
+        to_encode.push_back(job);
+        changed.notify_all();
+    }
+
+    /*
+     * Waits until every submitted frame is written and stops the threads.
+     * Returns false if any frame could not be written.
+     */
+    bool finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        for (auto &encoder : encoders) {
+            encoder.join();
+        }
+        encoders.clear();
+        if (writer.joinable()) {
+            writer.join();
+        }
+        return !failed;
+    }
+
+    // Time submit spent waiting for a free slot
+    double stalled_seconds = 0;
+
+private:
+    struct Job {
+        Framebuffer pixels{0, 0};
+        std::string path;
+        ImageFormat format = ImageFormat::p3;
+        std::string data;
+        long sequence = -1;
+        bool encoded = false;
+    };
+
+    void encode_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this] { return stopping || !to_encode.empty(); });
+            if (to_encode.empty()) {
+                return;
+            }
+            Job *job = to_encode.front();
+            to_encode.pop_front();
+            lock.unlock();
+            job->data = encode_image(job->pixels, job->path, job->format);
+            lock.lock();
+            job->encoded = true;
+            changed.notify_all();
+        }
+    }
+
+    Job* next_to_write() {
+        for (auto &slot : slots) {
+            if (slot->encoded && slot->sequence == written) {
+                return slot.get();
+            }
+        }
+        return nullptr;
+    }
+
+    void write_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this] {
+                return next_to_write() || (stopping && written == submitted);
+            });
+            Job *job = next_to_write();
+            if (!job) {
+                return;
+            }
+            lock.unlock();
+            bool ok = write_file(job->path, job->data);
+            lock.lock();
+            failed = failed || !ok;
+            job->encoded = false;
+            written++;
+            free_slots.push_back(job);
+            changed.notify_all();
+        }
+    }
+
+    std::vector<std::unique_ptr<Job>> slots;
+    std::vector<Job*> free_slots;
+    std::deque<Job*> to_encode;
+    std::vector<std::thread> encoders;
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable changed;
+    long submitted = 0;
+    long written = 0;
+    bool stopping = false;
+    bool failed = false;
+};
@@ -1,11 +1,19 @@
 #pragma once
 #include <string>
+#include <vector>
 
 char ch_cap ( char ch );
 int i4_max ( int i1, int i2 );
 
 bool ppma_check_data ( int xsize, int ysize, int maxrgb, int *rarray,
        int *garray, int *barray );
+std::string ppma_encode ( std::string output_name, int xsize, int ysize, const int *r,
+       const int *g, const int *b, int thread_num );
+std::vector<std::string> ppma_encode_blocks ( int xsize, int ysize, const int *r,
+       const int *g, const int *b, int thread_num );
+std::string ppma_encode_header ( std::string output_name, int xsize, int ysize, int rgb_max );
+void ppma_encode_rows ( int xsize, int ysize, const int *r, const int *g,
+       const int *b, int row_lo, int row_hi, std::string *text );
 bool ppma_example ( int xsize, int ysize, int *rarray, int *garray, int *barray );
 
 bool ppma_read ( std::string file_in_name, int &xsize, int &ysize, int &maxrgb,
@@ -15,12 +23,16 @@ bool ppma_read_data ( std::ifstream &file_in, int xsize, int ysize, int *rarray,
 bool ppma_read_header ( std::ifstream &file_in, int &xsize, int &ysize, int &maxrgb );
 bool ppma_read_test ( std::string file_in_name );
 
+int ppma_rgb_max ( int xsize, int ysize, const int *r, const int *g, const int *b );
+
 bool ppma_write ( std::string file_out_name, int xsize, int ysize, int *rarray, 
       int *garray, int *barray );
 bool ppma_write_data ( std::ofstream &file_out, int xsize, int ysize, int *rarray,
        int *garray, int *barray );
 bool ppma_write_header ( std::ofstream &file_out, std::string file_out_name, int xsize, 
        int ysize, int maxrgb );
+bool ppma_write_parallel ( std::string output_name, int xsize, int ysize,
+       const int *r, const int *g, const int *b, int thread_num );
 bool ppma_write_test ( std::string file_out_name );
 
 bool s_eqi ( std::string s1, std::string s2 );
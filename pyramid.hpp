@@ -0,0 +1,352 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "framebuffer.hpp"
+#include "render.hpp"
+
+/*
+ * Tiled multi-resolution image pyramid in one file, for viewers that pan and
+ * zoom over images too large to load whole.
+ *
+ * Level 0 is the rendered image cut into the renderer's tiles, and every
+ * further level halves the previous one until it fits in one tile. The file
+ * starts with a PyramidHeader and an index of one PyramidTile per tile,
+ * level by level and row by row within a level, followed by the tiles. Every
+ * tile has a slot of tile_size * tile_size 8 bit RGB pixels with rows
+ * tile_size pixels apart, of which the top left width by height are used.
+ * A viewer maps the file and reads only the tiles it shows.
+ *
+ * The pyramid is built while rendering. Every finished tile is stored at
+ * level 0 and box filtered into its quarter of the tile above it; the
+ * render thread that completes the last quarter of a tile filters that tile
+ * into the level above in turn. No pass over the whole image is needed.
+ */
+
+const char pyramid_magic[8] = {'R', 'T', 'P', 'Y', 'R', '0', '0', '1'};
+
+struct PyramidHeader {
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    int32_t tile_size;
+    int32_t levels;
+    int32_t tile_count;
+    int32_t reserved;
+};
+
+struct PyramidTile {
+    uint64_t offset;    // of the pixels from the start of the file
+    int32_t width;
+    int32_t height;
+};
+
+/*
+ * Size and tile grid of one level.
+ */
+struct PyramidLevel {
+    int width;
+    int height;
+    int tiles_x;
+    int tiles_y;
+    int first_tile; // index of the level's first tile
+};
+
+/*
+ * The levels of a pyramid over a width by height image.
+ */
+inline std::vector<PyramidLevel> pyramid_levels(int width, int height, int tile_size) {
+    std::vector<PyramidLevel> levels;
+    int first = 0;
+    while (true) {
+        PyramidLevel level = {width, height, (width + tile_size - 1) / tile_size,
+            (height + tile_size - 1) / tile_size, first};
+        levels.push_back(level);
+        first += level.tiles_x * level.tiles_y;
+        if (level.tiles_x == 1 && level.tiles_y == 1) {
+            return levels;
+        }
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+    }
+}
+
+class PyramidWriter : public TileObserver {
+public:
+    PyramidWriter() = default;
+    PyramidWriter(const PyramidWriter&) = delete;
+    PyramidWriter& operator=(const PyramidWriter&) = delete;
+
+    ~PyramidWriter() {
+        close();
+    }
+
+    /*
+     * Creates the pyramid file at path for frames rendered with settings.
+     * The tile size must be even. Returns false on failure.
+     */
+    bool open(const std::string &path, const RenderSettings &settings) {
+        if (settings.tile_size % 2 != 0) {
+            fprintf(stderr, "Pyramids need an even tile size\n");
+            return false;
+        }
+        tile_size = settings.tile_size;
+        levels = pyramid_levels(settings.width, settings.height, tile_size);
+        int tile_count = levels.back().first_tile + 1;
+        size_t slot = static_cast<size_t>(tile_size) * tile_size * 3;
+        size_t pixels_start = sizeof(PyramidHeader) + tile_count * sizeof(PyramidTile);
+        // Tiles start on a page so viewers can map single tiles
+        pixels_start = (pixels_start + 4095) / 4096 * 4096;
+        size = pixels_start + tile_count * slot;
+
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0) {
+            fprintf(stderr, "Cannot create pyramid %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            fprintf(stderr, "Cannot map pyramid %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        data = static_cast<unsigned char*>(mapped);
+
+        PyramidHeader header = {{}, settings.width, settings.height, tile_size,
+            static_cast<int32_t>(levels.size()), tile_count, 0};
+        memcpy(header.magic, pyramid_magic, sizeof(pyramid_magic));
+        memcpy(data, &header, sizeof(header));
+        PyramidTile *index = reinterpret_cast<PyramidTile*>(data + sizeof(PyramidHeader));
+        for (auto &level : levels) {
+            for (int ty = 0; ty < level.tiles_y; ty++) {
+                for (int tx = 0; tx < level.tiles_x; tx++) {
+                    int tile = level.first_tile + tx + ty * level.tiles_x;
+                    index[tile] = {pixels_start + tile * slot,
+                        std::min(tile_size, level.width - tx * tile_size),
+                        std::min(tile_size, level.height - ty * tile_size)};
+                }
+            }
+        }
+        tiles = index;
+        children_done = std::make_unique<std::atomic<int>[]>(tile_count);
+        start_frame();
+        return true;
+    }
+
+    /*
+     * Forgets the tiles of the previous frame. Call before each frame.
+     */
+    void start_frame() {
+        for (int tile = 0; tile < levels.back().first_tile + 1; tile++) {
+            children_done[tile] = 0;
+        }
+    }
+
+    void tile_done(int tile, const Tile &rect, const Framebuffer &framebuffer) override {
+        unsigned char *out = data + tiles[tile].offset;
+        for (int y = rect.y0; y < rect.y1; y++) {
+            for (int x = rect.x0; x < rect.x1; x++) {
+                int i = x + y * framebuffer.width;
+                unsigned char *pixel = out + 3 * ((x - rect.x0) + (y - rect.y0) * tile_size);
+                pixel[0] = static_cast<unsigned char>(framebuffer.red[i]);
+                pixel[1] = static_cast<unsigned char>(framebuffer.green[i]);
+                pixel[2] = static_cast<unsigned char>(framebuffer.blue[i]);
+            }
+        }
+        const PyramidLevel &level = levels[0];
+        propagate(0, tile % level.tiles_x, tile / level.tiles_x);
+    }
+
+    void close() {
+        if (data) {
+            munmap(data, size);
+            data = nullptr;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+private:
+    /*
+     * Filters the finished tile (tx, ty) of level l into its quarter of the
+     * tile above and carries on upwards if that completed the tile above.
+     */
+    void propagate(int l, int tx, int ty) {
+        while (l + 1 < static_cast<int>(levels.size())) {
+            const PyramidLevel &level = levels[l];
+            const PyramidLevel &above = levels[l + 1];
+            const PyramidTile &source = tiles[level.first_tile + tx + ty * level.tiles_x];
+            int parent = above.first_tile + tx / 2 + (ty / 2) * above.tiles_x;
+            const unsigned char *in = data + source.offset;
+            unsigned char *out = data + tiles[parent].offset +
+                3 * ((tx % 2) * tile_size / 2 + (ty % 2) * tile_size / 2 * tile_size);
+            for (int y = 0; y < (source.height + 1) / 2; y++) {
+                for (int x = 0; x < (source.width + 1) / 2; x++) {
+                    int sum[3] = {0, 0, 0};
+                    int count = 0;
+                    for (int dy = 0; dy < 2 && 2*y + dy < source.height; dy++) {
+                        for (int dx = 0; dx < 2 && 2*x + dx < source.width; dx++) {
+                            const unsigned char *pixel = in + 3 * ((2*x + dx) + (2*y + dy) * tile_size);
+                            sum[0] += pixel[0];
+                            sum[1] += pixel[1];
+                            sum[2] += pixel[2];
+                            count++;
+                        }
+                    }
+                    unsigned char *pixel = out + 3 * (x + y * tile_size);
+                    for (int c = 0; c < 3; c++) {
+                        pixel[c] = static_cast<unsigned char>((sum[c] + count / 2) / count);
+                    }
+                }
+            }
+
+            // Children of the parent that exist at the edges of the level
+            int children_x = std::min(2, level.tiles_x - tx / 2 * 2);
+            int children_y = std::min(2, level.tiles_y - ty / 2 * 2);
+            int done = children_done[parent].fetch_add(1, std::memory_order_acq_rel) + 1;
+            if (done < children_x * children_y) {
+                return;
+            }
+            l++;
+            tx /= 2;
+            ty /= 2;
+        }
+    }
+
+    int fd = -1;
+    size_t size = 0;
+    int tile_size = 0;
+    unsigned char *data = nullptr;
+    PyramidTile *tiles = nullptr;
+    std::vector<PyramidLevel> levels;
+    std::unique_ptr<std::atomic<int>[]> children_done;
+};
+
+/*
+ * Read only view of a pyramid file through a memory mapping. Tiles are only
+ * paged in when their pixels are touched.
+ */
+class PyramidReader {
+public:
+    PyramidReader() = default;
+    PyramidReader(const PyramidReader&) = delete;
+    PyramidReader& operator=(const PyramidReader&) = delete;
+
+    ~PyramidReader() {
+        if (data) {
+            munmap(const_cast<unsigned char*>(data), size);
+        }
+    }
+
+    bool open(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            fprintf(stderr, "Cannot open pyramid %s\n", path.c_str());
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            return false;
+        }
+        size = info.st_size;
+        void *mapped = size >= sizeof(PyramidHeader) ?
+            mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            fprintf(stderr, "Cannot map pyramid %s\n", path.c_str());
+            return false;
+        }
+        data = static_cast<const unsigned char*>(mapped);
+        memcpy(&header, data, sizeof(header));
+        if (!valid()) {
+            fprintf(stderr, "%s is not a pyramid file\n", path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    int level_count() const {
+        return static_cast<int>(levels.size());
+    }
+
+    const PyramidLevel& level(int l) const {
+        return levels[l];
+    }
+
+    /*
+     * Pixel (x, y) of level l, with x and y inside the level.
+     */
+    const unsigned char* pixel(int l, int x, int y) const {
+        const PyramidLevel &level = levels[l];
+        int ts = header.tile_size;
+        const PyramidTile *index = reinterpret_cast<const PyramidTile*>(data + sizeof(PyramidHeader));
+        const PyramidTile &tile = index[level.first_tile + x / ts + (y / ts) * level.tiles_x];
+        return data + tile.offset + 3 * ((x % ts) + (y % ts) * ts);
+    }
+
+private:
+    /*
+     * True if the header and the tile index describe a pyramid that fits in
+     * the file, so that pixel() stays inside the mapping. Sets levels.
+     */
+    bool valid() {
+        const int32_t max_side = INT32_MAX / 2;
+        if (memcmp(header.magic, pyramid_magic, sizeof(pyramid_magic)) != 0 ||
+                header.width <= 0 || header.height <= 0 || header.tile_size <= 0 ||
+                header.width > max_side || header.height > max_side || header.tile_size > max_side ||
+                header.tile_count <= 0 ||
+                sizeof(PyramidHeader) + header.tile_count * sizeof(PyramidTile) > size) {
+            return false;
+        }
+        // Counts the tiles of the levels in 64 bits, so that a header that
+        // does not match its index can not overflow pyramid_levels
+        int64_t tiles = 0;
+        int64_t width = header.width;
+        int64_t height = header.height;
+        while (true) {
+            int64_t across = (width + header.tile_size - 1) / header.tile_size;
+            int64_t down = (height + header.tile_size - 1) / header.tile_size;
+            tiles += across * down;
+            if (tiles > header.tile_count) {
+                return false;
+            }
+            if (across == 1 && down == 1) {
+                break;
+            }
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+        if (tiles != header.tile_count) {
+            return false;
+        }
+        levels = pyramid_levels(header.width, header.height, header.tile_size);
+        if (static_cast<int>(levels.size()) != header.levels) {
+            return false;
+        }
+        uint64_t slot = 3 * static_cast<uint64_t>(header.tile_size) * header.tile_size;
+        const PyramidTile *index = reinterpret_cast<const PyramidTile*>(data + sizeof(PyramidHeader));
+        for (int i = 0; i < header.tile_count; i++) {
+            if (index[i].offset > size || slot > size - index[i].offset) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    PyramidHeader header;
+    std::vector<PyramidLevel> levels;
+};
@@ -0,0 +1,176 @@
+#include <cstdint>
+#include <cstring>
+
+#include "qoi_io.hpp"
+
+// Opcodes of the QOI specification 1.0
+static const unsigned char qoi_op_index = 0x00;
+static const unsigned char qoi_op_diff = 0x40;
+static const unsigned char qoi_op_luma = 0x80;
+static const unsigned char qoi_op_run = 0xc0;
+static const unsigned char qoi_op_rgb = 0xfe;
+static const unsigned char qoi_op_rgba = 0xff;
+static const unsigned char qoi_mask = 0xc0;
+static const unsigned char qoi_end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+static const int qoi_header_size = 14;
+
+struct QoiPixel {
+    unsigned char r, g, b, a;
+
+    bool operator==(const QoiPixel &o) const {
+        return r == o.r && g == o.g && b == o.b && a == o.a;
+    }
+};
+
+static int qoi_hash(const QoiPixel &p) {
+    return (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64;
+}
+
+static void put_u32_big_endian(unsigned char *out, uint32_t v) {
+    out[0] = v >> 24;
+    out[1] = v >> 16;
+    out[2] = v >> 8;
+    out[3] = v;
+}
+
+static uint32_t get_u32_big_endian(const unsigned char *in) {
+    return static_cast<uint32_t>(in[0]) << 24 | static_cast<uint32_t>(in[1]) << 16 |
+        static_cast<uint32_t>(in[2]) << 8 | in[3];
+}
+
+std::string qoi_encode(int width, int height, const int *r, const int *g, const int *b) {
+    const long pixels = static_cast<long>(width) * height;
+    if (pixels > qoi_max_pixels) {
+        return {};
+    }
+    // Worst case: every pixel is QOI_OP_RGB
+    std::string data(qoi_header_size + pixels * 4 + sizeof(qoi_end), '\0');
+    unsigned char *out = reinterpret_cast<unsigned char*>(data.data());
+    memcpy(out, "qoif", 4);
+    put_u32_big_endian(out + 4, width);
+    put_u32_big_endian(out + 8, height);
+    out[12] = 3; // RGB
+    out[13] = 0; // sRGB with linear alpha
+    out += qoi_header_size;
+
+    QoiPixel index[64] = {};
+    QoiPixel previous = {0, 0, 0, 255};
+    int run = 0;
+    for (long i = 0; i < pixels; i++) {
+        QoiPixel pixel = {static_cast<unsigned char>(r[i]), static_cast<unsigned char>(g[i]),
+            static_cast<unsigned char>(b[i]), 255};
+        if (pixel == previous) {
+            run++;
+            if (run == 62 || i == pixels - 1) {
+                *out++ = qoi_op_run | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            *out++ = qoi_op_run | (run - 1);
+            run = 0;
+        }
+        int hash = qoi_hash(pixel);
+        if (index[hash] == pixel) {
+            *out++ = qoi_op_index | hash;
+        } else {
+            index[hash] = pixel;
+            signed char vr = static_cast<signed char>(pixel.r - previous.r);
+            signed char vg = static_cast<signed char>(pixel.g - previous.g);
+            signed char vb = static_cast<signed char>(pixel.b - previous.b);
+            signed char vg_r = static_cast<signed char>(vr - vg);
+            signed char vg_b = static_cast<signed char>(vb - vg);
+            if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                *out++ = qoi_op_diff | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+            } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                *out++ = qoi_op_luma | (vg + 32);
+                *out++ = (vg_r + 8) << 4 | (vg_b + 8);
+            } else {
+                *out++ = qoi_op_rgb;
+                *out++ = pixel.r;
+                *out++ = pixel.g;
+                *out++ = pixel.b;
+            }
+        }
+        previous = pixel;
+    }
+    memcpy(out, qoi_end, sizeof(qoi_end));
+    out += sizeof(qoi_end);
+    data.resize(out - reinterpret_cast<unsigned char*>(data.data()));
+    return data;
+}
+
+bool qoi_decode(const std::string &data, int &width, int &height,
+        std::string &r, std::string &g, std::string &b) {
+    const unsigned char *in = reinterpret_cast<const unsigned char*>(data.data());
+    size_t size = data.size();
+    if (size < qoi_header_size + sizeof(qoi_end) || memcmp(in, "qoif", 4) != 0) {
+        return false;
+    }
+    uint32_t w = get_u32_big_endian(in + 4);
+    uint32_t h = get_u32_big_endian(in + 8);
+    if (w == 0 || h == 0 || static_cast<uint64_t>(w) * h > qoi_max_pixels ||
+            (in[12] != 3 && in[12] != 4)) {
+        return false;
+    }
+    width = w;
+    height = h;
+    const long pixels = static_cast<long>(w) * h;
+    r.resize(pixels);
+    g.resize(pixels);
+    b.resize(pixels);
+
+    QoiPixel index[64] = {};
+    QoiPixel pixel = {0, 0, 0, 255};
+    size_t p = qoi_header_size;
+    size_t end = size - sizeof(qoi_end);
+    int run = 0;
+    for (long i = 0; i < pixels; i++) {
+        if (run > 0) {
+            run--;
+        } else {
+            if (p >= end) {
+                return false;
+            }
+            unsigned char op = in[p++];
+            if (op == qoi_op_rgb) {
+                if (p + 3 > end) {
+                    return false;
+                }
+                pixel.r = in[p];
+                pixel.g = in[p + 1];
+                pixel.b = in[p + 2];
+                p += 3;
+            } else if (op == qoi_op_rgba) {
+                if (p + 4 > end) {
+                    return false;
+                }
+                pixel = {in[p], in[p + 1], in[p + 2], in[p + 3]};
+                p += 4;
+            } else if ((op & qoi_mask) == qoi_op_index) {
+                pixel = index[op];
+            } else if ((op & qoi_mask) == qoi_op_diff) {
+                pixel.r += ((op >> 4) & 3) - 2;
+                pixel.g += ((op >> 2) & 3) - 2;
+                pixel.b += (op & 3) - 2;
+            } else if ((op & qoi_mask) == qoi_op_luma) {
+                if (p >= end) {
+                    return false;
+                }
+                unsigned char second = in[p++];
+                int vg = (op & 0x3f) - 32;
+                pixel.r += vg - 8 + ((second >> 4) & 0x0f);
+                pixel.g += vg;
+                pixel.b += vg - 8 + (second & 0x0f);
+            } else {
+                run = op & 0x3f;
+            }
+            index[qoi_hash(pixel)] = pixel;
+        }
+        r[i] = pixel.r;
+        g[i] = pixel.g;
+        b[i] = pixel.b;
+    }
+    return true;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+
+/*
+ * QOI, the "Quite OK Image" format (https://qoiformat.org), for 8 bit RGB
+ * images given as one array per channel. Losslessly compresses rendered
+ * images several times smaller than PPM in a single fast pass.
+ */
+
+/*
+ * Most pixels of a QOI image, as the specification bounds them so decoders
+ * can trust the header.
+ */
+const long qoi_max_pixels = 400000000;
+
+/*
+ * The QOI file of the width by height image with channels r, g and b, or an
+ * empty string if the image has more than qoi_max_pixels pixels.
+ */
+std::string qoi_encode(int width, int height, const int *r, const int *g, const int *b);
+
+/*
+ * Decodes a QOI file with 3 or 4 channels into one array per channel,
+ * dropping alpha. Returns false if data is not a valid QOI file or has more
+ * than qoi_max_pixels pixels.
+ */
+bool qoi_decode(const std::string &data, int &width, int &height,
+        std::string &r, std::string &g, std::string &b);
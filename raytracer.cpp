@@ -0,0 +1,18 @@
+#include <algorithm>
+#include <thread>
+
+#include "raytracer.hpp"
+
+RenderStats render(const Scene &scene, const Camera &camera, Framebuffer &framebuffer) {
+    RenderSettings settings;
+    settings.width = framebuffer.width;
+    settings.height = framebuffer.height;
+    settings.threads = std::max(1u, std::thread::hardware_concurrency());
+    settings.camera = camera;
+    return render(scene, settings, framebuffer);
+}
+
+RenderStats render(const Scene &scene, const RenderSettings &settings, Framebuffer &framebuffer) {
+    Renderer renderer(settings.threads);
+    return renderer.render_frame(scene, settings, framebuffer);
+}
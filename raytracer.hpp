@@ -0,0 +1,29 @@
+#pragma once
+#include "camera.hpp"
+#include "framebuffer.hpp"
+#include "render.hpp"
+#include "scene.hpp"
+#include "scene_io.hpp"
+
+/*
+ * In-process entry points of the raytracer_core library, for programs that
+ * render without going through the raytracer command and an image file.
+ * The engine headers included here can be used directly for more control,
+ * e.g. a long lived Renderer that keeps its threads between frames.
+ *
+ * The scene must have its acceleration structures built with
+ * build_acceleration before rendering, and again after editing its balls.
+ */
+
+/*
+ * Renders scene as seen by camera into framebuffer, at the size of the
+ * framebuffer and with the default settings otherwise, on all hardware
+ * threads.
+ */
+RenderStats render(const Scene &scene, const Camera &camera, Framebuffer &framebuffer);
+
+/*
+ * Renders scene with settings into framebuffer, which must have the size of
+ * settings. Starts and stops settings.threads threads.
+ */
+RenderStats render(const Scene &scene, const RenderSettings &settings, Framebuffer &framebuffer);
@@ -0,0 +1,618 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+#include "allocation_counter.hpp"
+#include "arena.hpp"
+#include "binning.hpp"
+#include "camera.hpp"
+#include "denoise.hpp"
+#include "framebuffer.hpp"
+#include "gbuffer.hpp"
+#include "numa.hpp"
+#include "thread_pool.hpp"
+#include "tile_cache.hpp"
+#include "trace.hpp"
+#include "wavefront.hpp"
+
+struct RenderSettings {
+    int width = 800;
+    int height = 800;
+    int tile_size = 32;
+    int threads = 1;
+    bool wavefront = false;
+    bool sort_rays = false;
+    // Trace the rays of a wavefront bounce interleaved, see interleave.hpp
+    bool interleave = false;
+    bool bin_primary = false;
+    Camera camera;
+    // Primary rays per pixel, jittered over the pixel when more than one
+    int samples = 1;
+    // Filter the frame with the Denoiser after rendering it
+    bool denoise = false;
+    // Approximations in shading and intersection, see fast_math.hpp
+    MathTier math = MathTier::precise;
+};
+
+/*
+ * Tiles with more binned balls than this trace primary rays through the ball
+ * BVH instead of testing the candidates one by one.
+ */
+const int max_binned_candidates = 16;
+
+struct RenderStats {
+    double seconds = 0;
+    long rays = 0;
+    long heap_allocations = 0;
+    double candidates_per_tile = 0;
+    long cached_tiles = 0;
+    double denoise_seconds = 0;
+};
+
+inline int tiles_x(const RenderSettings &settings) {
+    return (settings.width + settings.tile_size - 1) / settings.tile_size;
+}
+
+inline int tiles_y(const RenderSettings &settings) {
+    return (settings.height + settings.tile_size - 1) / settings.tile_size;
+}
+
+inline Tile tile_rect(const RenderSettings &settings, int tile) {
+    int tx = tile % tiles_x(settings);
+    int ty = tile / tiles_x(settings);
+    return {
+        tx * settings.tile_size,
+        ty * settings.tile_size,
+        std::min((tx + 1) * settings.tile_size, settings.width),
+        std::min((ty + 1) * settings.tile_size, settings.height),
+    };
+}
+
+inline void store_pixel(Framebuffer &framebuffer, int x, int y, Color c) {
+    const int max_color = 255;
+    c = color_clamped(c);
+    framebuffer.red[x + y*framebuffer.width] = static_cast<int>(c.r*max_color);
+    framebuffer.green[x + y*framebuffer.width] = static_cast<int>(c.g*max_color);
+    framebuffer.blue[x + y*framebuffer.width] = static_cast<int>(c.b*max_color);
+}
+
+/*
+ * Offset (sx, sy) in [0, 1) of sample of pixel (x, y) from the pixel's
+ * corner. The samples of a pixel follow the R2 low discrepancy sequence,
+ * which spreads any number of them evenly over the pixel, shifted by a
+ * hash of the pixel so neighbouring pixels do not share a pattern. A single
+ * sample is taken at the corner like without sampling.
+ */
+inline void pixel_sample_offset(int x, int y, int sample, int samples, double &sx, double &sy) {
+    if (samples == 1) {
+        sx = 0;
+        sy = 0;
+        return;
+    }
+    uint32_t h = static_cast<uint32_t>(x) * 0x8da6b343u ^ static_cast<uint32_t>(y) * 0xd8163841u;
+    h = (h ^ (h >> 15)) * 0x2c1b3c6du;
+    h ^= h >> 12;
+    double shift_x = (h & 0xffff) / 65536.0;
+    double shift_y = (h >> 16) / 65536.0;
+    sx = shift_x + sample * 0.7548776662466927;
+    sy = shift_y + sample * 0.5698402909980532;
+    sx -= std::floor(sx);
+    sy -= std::floor(sy);
+}
+
+/*
+ * Renders one tile into the framebuffer. Temporary buffers are taken from
+ * arena. If candidates is not null primary rays only test the
+ * candidate_count explicit balls it lists. If gbuffer is not null the path
+ * of every pixel is recorded in it and the pixel is shaded from there.
+ * With more than one sample per pixel, or if guides is not null, pixels are
+ * traced recursively whatever the traversal settings, and if guides is not
+ * null the pixels go there for the denoiser instead of into framebuffer.
+ * The tile is rendered in the math tier of settings. Returns the number of
+ * rays traced by the wavefront path; the other paths do not count rays and
+ * return 0.
+ */
+inline long render_tile(const Tile &tile,
+        const Scene &scene,
+        const RenderSettings &settings,
+        Framebuffer &framebuffer,
+        std::pmr::memory_resource *arena,
+        const int *candidates = nullptr, int candidate_count = 0,
+        GBuffer *gbuffer = nullptr,
+        DenoiseGuides *guides = nullptr) {
+
+    ScopedMathTier tier(settings.math);
+    if (gbuffer) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            for (int y = tile.y0; y < tile.y1; y++) {
+                const Ray ray = primary_ray(settings.camera, x, y, settings.width, settings.height);
+                auto hit = candidates ?
+                    closest_hit_among(ray, scene, candidates, candidate_count) :
+                    closest_hit(ray, scene);
+                trace_gbuffer_path(ray, hit, scene, gbuffer->path(x, y));
+                store_pixel(framebuffer, x, y, shade_gbuffer_path(ray, gbuffer->path(x, y), scene));
+            }
+        }
+        return 0;
+    }
+
+    if (settings.samples > 1 || guides) {
+        bool sampled_light = scene.lights[0].shape != LightShape::point;
+        for (int x = tile.x0; x < tile.x1; x++) {
+            for (int y = tile.y0; y < tile.y1; y++) {
+                Color color = {0, 0, 0};
+                // The lit surface the primary rays hit, apart from what it
+                // reflects, and its luminance statistics
+                Color local_color = {0, 0, 0};
+                double luminance_sum = 0;
+                double luminance_squares = 0;
+                Color albedo = {0, 0, 0};
+                Vector3 normal = {0, 0, 0};
+                double depth = 0;
+                int first_hit = -1;
+                bool same_hit = true;
+                for (int sample = 0; sample < settings.samples; sample++) {
+                    double sx, sy;
+                    pixel_sample_offset(x, y, sample, settings.samples, sx, sy);
+                    const Ray ray = primary_ray(settings.camera, x + sx, y + sy, settings.width, settings.height);
+                    auto hit = candidates ?
+                        closest_hit_among(ray, scene, candidates, candidate_count) :
+                        closest_hit(ray, scene);
+                    // Traced like cast_ray, keeping the local part of the
+                    // color apart
+                    Color c = background_color;
+                    Color local = {0, 0, 0};
+                    int hit_id = -1;
+                    if (hit) {
+                        SurfacePoint surface = surface_point(ray, hit->ball, hit->t);
+                        Color shaded = shade_local(surface, hit->ball, scene);
+                        c = reflects(hit->ball) ?
+                            color_linear_interpolate(shaded, cast_ray(reflected_ray(surface), scene, 1),
+                                    hit->ball.reflective_parameter) :
+                            shaded;
+                        local = shaded * hit->ball.reflective_parameter;
+                        hit_id = hit->id;
+                        albedo = albedo + hit->ball.color;
+                        normal = normal + surface.normal;
+                        depth += camera_space(settings.camera, surface.point).z;
+                    } else {
+                        albedo = albedo + background_color;
+                        depth += max_hit_distance;
+                    }
+                    c = color_clamped(c);
+                    double l = luminance(local.r, local.g, local.b);
+                    color = color + c;
+                    local_color = local_color + local;
+                    luminance_sum += l;
+                    luminance_squares += l * l;
+                    if (sample == 0) {
+                        first_hit = hit_id;
+                    }
+                    same_hit = same_hit && hit_id == first_hit;
+                }
+                int n = settings.samples;
+                color = color / n;
+                if (guides) {
+                    // Only the local part is filtered. The rest, what the
+                    // pixel reflects and whatever clamping took off, is
+                    // added back as sampled, so mirror images stay sharp.
+                    // Variance of the mean of the local part, unknown and
+                    // taken as 0 for a single sample. Where the samples hit
+                    // different balls the noise is in what the pixel covers,
+                    // which the guides do not resolve, so it is taken as 0
+                    // there too and the pixel is left as sampled. A point
+                    // light shades without sampling, so its local colors
+                    // have no noise either.
+                    local_color = local_color / n;
+                    double variance = n > 1 && same_hit && sampled_light ?
+                        std::max(0.0, luminance_squares - luminance_sum * luminance_sum / n) / (n - 1) / n : 0;
+                    guides->store(x, y, local_color, color - local_color, variance, albedo / n, normal / n,
+                            depth / n);
+                } else {
+                    store_pixel(framebuffer, x, y, color);
+                }
+            }
+        }
+        return 0;
+    }
+
+    if (!settings.wavefront) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            for (int y = tile.y0; y < tile.y1; y++) {
+                const Ray ray = primary_ray(settings.camera, x, y, settings.width, settings.height);
+                Color c = candidates ?
+                    cast_ray_from_hit(ray, closest_hit_among(ray, scene, candidates, candidate_count), scene, 0) :
+                    cast_ray(ray, scene, 0);
+                store_pixel(framebuffer, x, y, c);
+            }
+        }
+        return 0;
+    }
+
+    int tile_width = tile.x1 - tile.x0;
+    int pixels = tile_width * (tile.y1 - tile.y0);
+    std::pmr::vector<QueuedRay> queue(arena);
+    std::pmr::vector<Color> colors(pixels, arena);
+    queue.reserve(pixels);
+    for (int x = tile.x0; x < tile.x1; x++) {
+        for (int y = tile.y0; y < tile.y1; y++) {
+            int pixel = (x - tile.x0) + (y - tile.y0) * tile_width;
+            queue.push_back({primary_ray(settings.camera, x, y, settings.width, settings.height), pixel, 0});
+        }
+    }
+    long rays = trace_wavefront(queue, scene, settings.sort_rays, settings.interleave, colors,
+            candidates, candidate_count);
+    for (int x = tile.x0; x < tile.x1; x++) {
+        for (int y = tile.y0; y < tile.y1; y++) {
+            store_pixel(framebuffer, x, y, colors[(x - tile.x0) + (y - tile.y0) * tile_width]);
+        }
+    }
+    return rays;
+}
+
+/*
+ * Told about every tile a Renderer finishes, on the render thread that
+ * finished it, right after its pixels are in the framebuffer. Tiles copied
+ * from the tile cache count as finished too.
+ */
+struct TileObserver {
+    virtual ~TileObserver() = default;
+    virtual void tile_done(int tile, const Tile &rect, const Framebuffer &framebuffer) = 0;
+};
+
+/*
+ * Moves every array of scene to node.
+ */
+inline void move_scene_to_node(const Scene &scene, int node) {
+    move_to_node(scene.balls, node);
+    move_to_node(scene.instances, node);
+    move_to_node(scene.ball_bvh.nodes, node);
+    move_to_node(scene.ball_bvh.items, node);
+    move_to_node(scene.instance_bvh.nodes, node);
+    move_to_node(scene.instance_bvh.items, node);
+    move_to_node(scene.instance_parts, node);
+    move_to_node(scene.instance_first_id, node);
+    for (auto &cluster : scene.clusters) {
+        move_to_node(cluster.balls, node);
+        move_to_node(cluster.bvh.nodes, node);
+        move_to_node(cluster.bvh.items, node);
+    }
+}
+
+/*
+ * Renders frames with a persistent thread pool. Every worker thread owns a
+ * FrameArena that is reset at the start of each frame and rewound after
+ * each tile, so after the first frame rendering makes no heap allocations.
+ *
+ * With settings.bin_primary every frame starts with binning the explicit
+ * balls to the tiles their screen projection overlaps, and primary rays only
+ * test the balls of their tile.
+ *
+ * With a tile cache, tiles found in it are copied from there instead of
+ * being traced, and traced tiles are added to it. Frames that record a
+ * G-buffer trace every tile.
+ *
+ * With a pin policy other than none the threads are pinned to CPUs (see
+ * numa.hpp). When they span several NUMA nodes the tiles of a frame are
+ * split into one band of rows per node, the framebuffer rows of each band
+ * are moved to its node the first time a framebuffer is rendered to, and
+ * replicate_scene keeps a copy of the scene on every node.
+ */
+class Renderer {
+public:
+    explicit Renderer(int threads, PinPolicy pin = PinPolicy::none) :
+        pool(threads, pin == PinPolicy::none ? ThreadPlacement() :
+                thread_placement(detect_numa_topology(), pin, threads)) {
+        for (int i = 0; i < pool.size(); i++) {
+            arenas.push_back(std::make_unique<FrameArena>());
+        }
+        worker_rays.resize(pool.size());
+    }
+
+    /*
+     * The render threads, for passes over the image other than render_frame.
+     */
+    ThreadPool& thread_pool() {
+        return pool;
+    }
+
+    /*
+     * Looks tiles up in cache, and stores them there, from the next frame
+     * on. Pass nullptr to stop using a cache.
+     */
+    void use_tile_cache(TileCache *cache) {
+        tile_cache = cache;
+    }
+
+    TileCache *current_tile_cache() const {
+        return tile_cache;
+    }
+
+    /*
+     * Has the threads of every NUMA node read their own copy of scene in
+     * the frames of scene from the next frame on, until the next call. The
+     * copies are not updated when scene changes, so this has to be called
+     * again after every edit. Does nothing when the threads are all on one
+     * node.
+     */
+    void replicate_scene(const Scene &scene) {
+        replicas.clear();
+        replicated = nullptr;
+        if (pool.band_count() == 1) {
+            return;
+        }
+        for (int band = 0; band < pool.band_count(); band++) {
+            replicas.push_back(std::make_unique<Scene>(scene));
+            move_scene_to_node(*replicas.back(), pool.band_node(band));
+        }
+        replicated = &scene;
+    }
+
+    /*
+     * Reports every finished tile to observer from the next frame on, in
+     * addition to the observers already added.
+     */
+    void observe_tiles(TileObserver *observer) {
+        tile_observers.push_back(observer);
+    }
+
+    void stop_observing(TileObserver *observer) {
+        tile_observers.erase(std::remove(tile_observers.begin(), tile_observers.end(), observer),
+                tile_observers.end());
+    }
+
+    /*
+     * Renders scene into framebuffer. If gbuffer is not null it is filled
+     * with the path of every pixel as well. If tiles is not null only the
+     * listed tiles are rendered and the rest of framebuffer and gbuffer is
+     * left as it is.
+     *
+     * With settings.denoise all tiles are traced into the denoiser's guides
+     * and filtered once the frame is done; tiles and the tile cache are
+     * ignored, and tile observers are told about the tiles after filtering.
+     */
+    RenderStats render_frame(const Scene &scene,
+            const RenderSettings &settings,
+            Framebuffer &framebuffer,
+            GBuffer *gbuffer = nullptr,
+            const std::vector<int> *tiles = nullptr) {
+
+        auto start = std::chrono::steady_clock::now();
+        long allocations = heap_allocation_count();
+        for (int i = 0; i < pool.size(); i++) {
+            arenas[i]->reset();
+            worker_rays[i] = 0;
+        }
+
+        int tile_count = tiles_x(settings) * tiles_y(settings);
+        if (settings.bin_primary) {
+            bin_balls(scene, settings.camera, settings.width, settings.height, settings.tile_size, bins);
+        }
+        if (scene.pages) {
+            scene.pages->next_frame();
+        }
+        if (pool.band_count() > 1 && framebuffer.red.data() != placed_framebuffer) {
+            place_framebuffer(settings, framebuffer);
+        }
+        if (gbuffer) {
+            gbuffer->resize(settings.width, settings.height);
+            gbuffer->geometry_hash = scene_geometry_hash(scene);
+            gbuffer->camera = settings.camera;
+        }
+
+        DenoiseGuides *guides = nullptr;
+        if (settings.denoise) {
+            guides = &denoise_guides;
+            guides->resize(settings.width, settings.height);
+            tiles = nullptr;
+        }
+
+        TileCache *cache = gbuffer || guides ? nullptr : tile_cache;
+        uint64_t hash = cache ? scene_hash(scene) : 0;
+        std::atomic<long> cached_tiles{0};
+
+        int task_count = tiles ? static_cast<int>(tiles->size()) : tile_count;
+        pool.parallel_for(task_count, [&](int task, int worker) {
+            int tile = tiles ? (*tiles)[task] : task;
+            if (render_frame_tile(scene, settings, framebuffer, bins, tile, worker, cache, hash,
+                        gbuffer, guides)) {
+                cached_tiles++;
+            }
+            if (!guides) {
+                for (TileObserver *observer : tile_observers) {
+                    observer->tile_done(tile, tile_rect(settings, tile), framebuffer);
+                }
+            }
+        });
+        if (cache && cached_tiles < task_count) {
+            cache->trim();
+        }
+
+        RenderStats stats;
+        if (guides) {
+            auto denoise_start = std::chrono::steady_clock::now();
+            denoiser.denoise(pool, *guides, settings.tile_size, framebuffer);
+            std::chrono::duration<double> denoise_elapsed = std::chrono::steady_clock::now() - denoise_start;
+            stats.denoise_seconds = denoise_elapsed.count();
+            if (!tile_observers.empty()) {
+                pool.parallel_for(tile_count, [&](int tile, int) {
+                    for (TileObserver *observer : tile_observers) {
+                        observer->tile_done(tile, tile_rect(settings, tile), framebuffer);
+                    }
+                });
+            }
+        }
+        stats.cached_tiles = cached_tiles;
+        if (settings.bin_primary) {
+            stats.candidates_per_tile = static_cast<double>(bins.balls.size()) / tile_count;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        stats.seconds = elapsed.count();
+        stats.heap_allocations = heap_allocation_count() - allocations;
+        for (long rays : worker_rays) {
+            stats.rays += rays;
+        }
+        return stats;
+    }
+
+    /*
+     * Renders every view of views into the framebuffer of the same index,
+     * which must have the size of the view. The tiles of all views are
+     * interleaved in one queue, so threads that are done with the tiles of
+     * one view carry on with the others instead of waiting at the end of
+     * each view. Tile observers are not told about these tiles, and the
+     * views are not denoised.
+     */
+    RenderStats render_views(const Scene &scene, const std::vector<RenderSettings> &views,
+            std::vector<Framebuffer> &framebuffers) {
+        auto start = std::chrono::steady_clock::now();
+        long allocations = heap_allocation_count();
+        for (int i = 0; i < pool.size(); i++) {
+            arenas[i]->reset();
+            worker_rays[i] = 0;
+        }
+
+        view_bins.resize(views.size());
+        view_tasks.clear();
+        int most_tiles = 0;
+        for (size_t v = 0; v < views.size(); v++) {
+            if (views[v].bin_primary) {
+                bin_balls(scene, views[v].camera, views[v].width, views[v].height,
+                        views[v].tile_size, view_bins[v]);
+            }
+            most_tiles = std::max(most_tiles, tiles_x(views[v]) * tiles_y(views[v]));
+        }
+        for (int tile = 0; tile < most_tiles; tile++) {
+            for (size_t v = 0; v < views.size(); v++) {
+                if (tile < tiles_x(views[v]) * tiles_y(views[v])) {
+                    view_tasks.push_back({static_cast<int>(v), tile});
+                }
+            }
+        }
+
+        TileCache *cache = tile_cache;
+        uint64_t hash = cache ? scene_hash(scene) : 0;
+        std::atomic<long> cached_tiles{0};
+        pool.parallel_for(static_cast<int>(view_tasks.size()), [&](int task, int worker) {
+            auto [v, tile] = view_tasks[task];
+            if (render_frame_tile(scene, views[v], framebuffers[v], view_bins[v], tile, worker,
+                        cache, hash, nullptr, nullptr)) {
+                cached_tiles++;
+            }
+        });
+        if (cache && cached_tiles < static_cast<long>(view_tasks.size())) {
+            cache->trim();
+        }
+
+        RenderStats stats;
+        stats.cached_tiles = cached_tiles;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        stats.seconds = elapsed.count();
+        stats.heap_allocations = heap_allocation_count() - allocations;
+        for (long rays : worker_rays) {
+            stats.rays += rays;
+        }
+        return stats;
+    }
+
+    /*
+     * Shades the paths recorded in gbuffer with the current lights and
+     * materials of scene, tracing no rays other than the shadow rays of
+     * area lights. The scene geometry must be the one the G-buffer was
+     * rendered with.
+     */
+    RenderStats relight_frame(const Scene &scene, const GBuffer &gbuffer, Framebuffer &framebuffer) {
+        auto start = std::chrono::steady_clock::now();
+        long allocations = heap_allocation_count();
+        pool.parallel_for(gbuffer.height, [&](int y, int) {
+            for (int x = 0; x < gbuffer.width; x++) {
+                const Ray ray = primary_ray(gbuffer.camera, x, y, gbuffer.width, gbuffer.height);
+                store_pixel(framebuffer, x, y, shade_gbuffer_path(ray, gbuffer.path(x, y), scene));
+            }
+        });
+        RenderStats stats;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        stats.seconds = elapsed.count();
+        stats.heap_allocations = heap_allocation_count() - allocations;
+        return stats;
+    }
+
+private:
+    /*
+     * Moves the rows of the tiles of every band to the node of the band.
+     */
+    void place_framebuffer(const RenderSettings &settings, Framebuffer &framebuffer) {
+        int tile_count = tiles_x(settings) * tiles_y(settings);
+        for (int band = 0; band < pool.band_count(); band++) {
+            int first = pool.band_begin(band, tile_count);
+            int last = pool.band_begin(band + 1, tile_count) - 1;
+            if (first > last) {
+                continue;
+            }
+            size_t begin = static_cast<size_t>(tile_rect(settings, first).y0) * settings.width;
+            size_t end = static_cast<size_t>(tile_rect(settings, last).y1) * settings.width;
+            for (auto *channel : {&framebuffer.red, &framebuffer.green, &framebuffer.blue}) {
+                move_to_node(channel->data() + begin, (end - begin) * sizeof(int), pool.band_node(band));
+            }
+        }
+        placed_framebuffer = framebuffer.red.data();
+    }
+
+    /*
+     * Renders one tile of a frame on worker, or copies it from cache if it
+     * is there. tile_bins holds the binned balls if settings.bin_primary is
+     * set. Returns true if the tile came from the cache.
+     */
+    bool render_frame_tile(const Scene &scene, const RenderSettings &settings, Framebuffer &framebuffer,
+            const ScreenBins &tile_bins, int tile, int worker, TileCache *cache, uint64_t hash,
+            GBuffer *gbuffer, DenoiseGuides *guides) {
+        const Scene &local = &scene == replicated ? *replicas[pool.worker_band(worker)] : scene;
+        Tile rect = tile_rect(settings, tile);
+        TileCacheKey key = {};
+        if (cache) {
+            key = tile_cache_key(hash, settings.camera, settings.width, settings.height,
+                    settings.samples, settings.math, rect.x0, rect.y0, rect.x1, rect.y1);
+            if (cache->load(key, framebuffer)) {
+                return true;
+            }
+        }
+        FrameArena &arena = *arenas[worker];
+        FrameArena::Marker marker = arena.mark();
+        const int *candidates = nullptr;
+        int candidate_count = 0;
+        int binned = settings.bin_primary ? tile_bins.offsets[tile + 1] - tile_bins.offsets[tile] : 0;
+        // Crowded tiles are better served by the BVH when there is one
+        if (settings.bin_primary &&
+                (binned <= max_binned_candidates || local.ball_bvh.nodes.empty())) {
+            candidates = tile_bins.balls.data() + tile_bins.offsets[tile];
+            candidate_count = binned;
+        }
+        worker_rays[worker] += render_tile(rect, local,
+                settings, framebuffer, &arena, candidates, candidate_count, gbuffer, guides);
+        if (cache) {
+            cache->store(key, framebuffer, &arena);
+        }
+        arena.rewind(marker);
+        return false;
+    }
+
+    ThreadPool pool;
+    std::vector<std::unique_ptr<FrameArena>> arenas;
+    std::vector<long> worker_rays;
+    ScreenBins bins;
+    std::vector<ScreenBins> view_bins;
+    std::vector<std::pair<int, int>> view_tasks;
+    TileCache *tile_cache = nullptr;
+    std::vector<TileObserver*> tile_observers;
+    DenoiseGuides denoise_guides;
+    Denoiser denoiser;
+    std::vector<std::unique_ptr<Scene>> replicas;
+    const Scene *replicated = nullptr;
+    const int *placed_framebuffer = nullptr;
+};
@@ -0,0 +1,135 @@
+#include <cstdint>
+#include <cstring>
+
+#include "rle_io.hpp"
+
+static const int rle_header_size = 12;
+
+static void put_u32_little_endian(unsigned char *out, uint32_t v) {
+    out[0] = v;
+    out[1] = v >> 8;
+    out[2] = v >> 16;
+    out[3] = v >> 24;
+}
+
+static uint32_t get_u32_little_endian(const unsigned char *in) {
+    return in[0] | static_cast<uint32_t>(in[1]) << 8 | static_cast<uint32_t>(in[2]) << 16 |
+        static_cast<uint32_t>(in[3]) << 24;
+}
+
+/*
+ * Appends the PackBits encoding of the count bytes of channel, given as
+ * ints, to out and returns the new end of out.
+ */
+static unsigned char* pack_bits(const int *channel, int count, unsigned char *out) {
+    int i = 0;
+    while (i < count) {
+        // Length of the run starting at i
+        int run = 1;
+        while (i + run < count && run < 128 &&
+                static_cast<unsigned char>(channel[i + run]) == static_cast<unsigned char>(channel[i])) {
+            run++;
+        }
+        if (run >= 3 || (run == 2 && i + run == count)) {
+            *out++ = static_cast<unsigned char>(257 - run);
+            *out++ = static_cast<unsigned char>(channel[i]);
+            i += run;
+            continue;
+        }
+        // Literals up to the next run of three
+        int start = i;
+        int length = 0;
+        while (i < count && length < 128) {
+            if (i + 2 < count &&
+                    static_cast<unsigned char>(channel[i]) == static_cast<unsigned char>(channel[i + 1]) &&
+                    static_cast<unsigned char>(channel[i]) == static_cast<unsigned char>(channel[i + 2])) {
+                break;
+            }
+            i++;
+            length++;
+        }
+        *out++ = static_cast<unsigned char>(length - 1);
+        for (int k = start; k < start + length; k++) {
+            *out++ = static_cast<unsigned char>(channel[k]);
+        }
+    }
+    return out;
+}
+
+std::string rle_encode(int width, int height, const int *r, const int *g, const int *b) {
+    // Worst case: a control byte for every 128 literals
+    size_t row_bound = static_cast<size_t>(width) + (width + 127) / 128;
+    std::string data(rle_header_size + 3 * row_bound * height, '\0');
+    unsigned char *out = reinterpret_cast<unsigned char*>(data.data());
+    memcpy(out, "RLE8", 4);
+    put_u32_little_endian(out + 4, width);
+    put_u32_little_endian(out + 8, height);
+    out += rle_header_size;
+    for (int y = 0; y < height; y++) {
+        size_t row = static_cast<size_t>(y) * width;
+        out = pack_bits(r + row, width, out);
+        out = pack_bits(g + row, width, out);
+        out = pack_bits(b + row, width, out);
+    }
+    data.resize(out - reinterpret_cast<unsigned char*>(data.data()));
+    return data;
+}
+
+/*
+ * Unpacks count bytes from in into out. Returns the new position in in,
+ * or nullptr if the data ends early or overflows the channel.
+ */
+static const unsigned char* unpack_bits(const unsigned char *in, const unsigned char *end,
+        char *out, int count) {
+    int filled = 0;
+    while (filled < count) {
+        if (in >= end) {
+            return nullptr;
+        }
+        unsigned char control = *in++;
+        if (control < 128) {
+            int length = control + 1;
+            if (filled + length > count || end - in < length) {
+                return nullptr;
+            }
+            memcpy(out + filled, in, length);
+            in += length;
+            filled += length;
+        } else if (control > 128) {
+            int length = 257 - control;
+            if (filled + length > count || in >= end) {
+                return nullptr;
+            }
+            memset(out + filled, *in++, length);
+            filled += length;
+        }
+    }
+    return in;
+}
+
+bool rle_decode(const std::string &data, int &width, int &height,
+        std::string &r, std::string &g, std::string &b) {
+    const unsigned char *in = reinterpret_cast<const unsigned char*>(data.data());
+    const unsigned char *end = in + data.size();
+    if (data.size() < rle_header_size || memcmp(in, "RLE8", 4) != 0) {
+        return false;
+    }
+    uint32_t w = get_u32_little_endian(in + 4);
+    uint32_t h = get_u32_little_endian(in + 8);
+    if (w == 0 || h == 0 || w > 1u << 15 || h > 1u << 15) {
+        return false;
+    }
+    width = w;
+    height = h;
+    r.resize(static_cast<size_t>(w) * h);
+    g.resize(static_cast<size_t>(w) * h);
+    b.resize(static_cast<size_t>(w) * h);
+    in += rle_header_size;
+    for (uint32_t y = 0; y < h && in; y++) {
+        size_t row = static_cast<size_t>(y) * w;
+        in = unpack_bits(in, end, &r[row], w);
+        in = in ? unpack_bits(in, end, &g[row], w) : nullptr;
+        in = in ? unpack_bits(in, end, &b[row], w) : nullptr;
+    }
+    return in != nullptr;
+}
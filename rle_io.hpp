@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+
+/*
+ * A simple run length encoded image format using PackBits, for 8 bit RGB
+ * images given as one array per channel.
+ *
+ * The file starts with the magic "RLE8", the width and the height as 32 bit
+ * little endian numbers. Then every row follows as its red, green and blue
+ * channel, each channel compressed with PackBits on its own: a control byte
+ * n from 0 to 127 is followed by n + 1 literal bytes, a control byte n from
+ * 129 to 255 by one byte repeated 257 - n times. 128 is not used. Rendered
+ * images are mostly smooth and flat, which planar runs compress well.
+ */
+
+std::string rle_encode(int width, int height, const int *r, const int *g, const int *b);
+
+/*
+ * Decodes data into one array per channel. Returns false if data is not a
+ * valid file.
+ */
+bool rle_decode(const std::string &data, int &width, int &height,
+        std::string &r, std::string &g, std::string &b);
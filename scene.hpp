@@ -0,0 +1,473 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "vector.hpp"
+#include "color.hpp"
+#include "bvh.hpp"
+
+struct Ball {
+    Vector3 pos;
+    double radius;
+    Color color;
+    double specular_parameter;
+    double reflective_parameter;
+};
+
+/*
+ * A pinhole view, see camera.hpp. right, up and forward are orthonormal and
+ * plane_size is the height of the image plane at distance 1 from the eye;
+ * the default of 1 is a field of view of 2 atan(1/2), about 53 degrees. The
+ * default camera is the view the renderer always had.
+ */
+struct Camera {
+    Vector3 pos = {0, 0, 0};
+    Vector3 right = {1, 0, 0};
+    Vector3 up = {0, 1, 0};
+    Vector3 forward = {0, 0, -1};
+    double plane_size = 1;
+};
+
+/*
+ * Point lights light everything they face and cast no shadows. Sphere and
+ * rectangle lights have an extent and cast soft shadows (see
+ * light_visibility). Surfaces are lit as if all light came from the center
+ * of the light, times the fraction of the light they see.
+ */
+enum class LightShape { point, sphere, rectangle };
+
+struct Light {
+    Vector3 pos;                    // center, or a corner of a rectangle
+    double intensity;
+    LightShape shape = LightShape::point;
+    double radius = 0;              // of a sphere
+    Vector3 edge_u = {0, 0, 0};     // sides of a rectangle from pos
+    Vector3 edge_v = {0, 0, 0};
+};
+
+struct Ray {
+    Vector3 from;
+    Vector3 dir;
+};
+
+struct BoundingSphere {
+    Vector3 center;
+    double radius;
+};
+
+/*
+ * Sphere around all of light. A point light has radius 0.
+ */
+inline BoundingSphere light_bounds(const Light &light) {
+    switch (light.shape) {
+    case LightShape::sphere:
+        return {light.pos, light.radius};
+    case LightShape::rectangle: {
+        Vector3 diagonal = light.edge_u + light.edge_v;
+        Vector3 other_diagonal = light.edge_u - light.edge_v;
+        return {light.pos + diagonal * 0.5,
+            std::max(vector_length(diagonal), vector_length(other_diagonal)) / 2};
+    }
+    default:
+        return {light.pos, 0};
+    }
+}
+
+/*
+ * Rotation, uniform scale and translation taking points from the local space
+ * of a cluster to world space: world = axes * (scale * local) + translation.
+ * The axes must be orthonormal.
+ */
+struct Transform {
+    Vector3 x_axis;
+    Vector3 y_axis;
+    Vector3 z_axis;
+    double scale;
+    Vector3 translation;
+};
+
+inline Vector3 transform_point(const Transform &transform, const Vector3 &p) {
+    return transform.x_axis * (transform.scale * p.x) +
+        transform.y_axis * (transform.scale * p.y) +
+        transform.z_axis * (transform.scale * p.z) +
+        transform.translation;
+}
+
+inline Vector3 inverse_transform_point(const Transform &transform, const Vector3 &p) {
+    Vector3 d = p - transform.translation;
+    return Vector3{vector_dot(d, transform.x_axis), vector_dot(d, transform.y_axis),
+        vector_dot(d, transform.z_axis)} / transform.scale;
+}
+
+inline Vector3 inverse_transform_direction(const Transform &transform, const Vector3 &v) {
+    return {vector_dot(v, transform.x_axis), vector_dot(v, transform.y_axis),
+        vector_dot(v, transform.z_axis)};
+}
+
+inline Ball transform_ball(const Transform &transform, const Ball &ball) {
+    Ball world = ball;
+    world.pos = transform_point(transform, ball.pos);
+    world.radius = ball.radius * transform.scale;
+    return world;
+}
+
+/*
+ * A non-empty group of balls defined once in its own local space, with the
+ * bottom level hierarchy over them.
+ */
+struct Cluster {
+    std::vector<Ball> balls;
+    Bvh bvh;
+};
+
+/*
+ * A placement of a cluster in the world.
+ */
+struct Instance {
+    int cluster;
+    Transform transform;
+};
+
+/*
+ * A subtree of the bottom level hierarchy of an instance, the unit the top
+ * level hierarchy is built over. Splitting each instance into the subtrees
+ * at instance_part_depth, up to eight, gives overlapping instances tight,
+ * mostly disjoint world bounds, where the bounds of whole instances would
+ * overlap and have rays enter most of them.
+ */
+struct InstancePart {
+    int instance;
+    int node;           // in the hierarchy of the instance's cluster
+};
+
+const int instance_part_depth = 3;
+
+/*
+ * The balls of a ball page file mapped into memory, see ball_pages.hpp. The
+ * hierarchy over them is in the file too, and so is only paged in where
+ * rays go.
+ */
+struct BallPages {
+    const BvhNode *nodes = nullptr;
+    const unsigned char *pages = nullptr;
+    long ball_count = 0;
+    int page_bytes = 0;
+    int balls_per_page = 0;
+    uint64_t hash = 0;
+
+    // The frame each page was last advised to be read ahead in, if prefetch
+    bool prefetch = false;
+    std::unique_ptr<std::atomic<uint8_t>[]> advised;
+    mutable std::atomic<uint8_t> frame{0};
+
+    long page_count() const {
+        return (ball_count + balls_per_page - 1) / balls_per_page;
+    }
+
+    const Ball& ball(long i) const {
+        const Ball *page = reinterpret_cast<const Ball*>(pages + i / balls_per_page * page_bytes);
+        return page[i % balls_per_page];
+    }
+
+    /*
+     * Starts a new frame, in which every page may be advised again.
+     */
+    void next_frame() const {
+        frame.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Everything that is rendered. balls are stored explicitly while instances
+ * reference the shared balls of clusters.
+ *
+ * Every ball, explicit or instanced, has an id: explicit balls use their
+ * index, and the balls of instance i follow at balls.size() +
+ * instance_first_id[i] in cluster order. These are the indices the balls would
+ * get if the scene was flattened with flatten_instances. The balls of a
+ * mapped ball page file, if any, follow the instanced balls in file order.
+ *
+ * build_acceleration must be called after the scene has been modified and
+ * before rendering.
+ */
+struct Scene {
+    std::vector<Ball> balls;
+    std::vector<Light> lights;
+    std::vector<Cluster> clusters;
+    std::vector<Instance> instances;
+
+    Bvh ball_bvh;
+    Bvh instance_bvh;
+    std::vector<InstancePart> instance_parts;
+    std::vector<int> instance_first_id;
+
+    // Shared by copies of the scene, as the mapping is read only
+    std::shared_ptr<const BallPages> pages;
+};
+
+/*
+ * World bounds of the balls of an instance under node of its cluster's
+ * hierarchy: the union of the bounds of the transformed balls, which is much
+ * tighter than transforming the node bounds when the instance is rotated.
+ */
+inline Aabb instance_part_bounds(const Scene &scene, const Instance &instance, int node) {
+    const Cluster &cluster = scene.clusters[instance.cluster];
+    const BvhNode &n = cluster.bvh.nodes[node];
+    if (n.count == 0) {
+        return aabb_union(instance_part_bounds(scene, instance, n.first),
+            instance_part_bounds(scene, instance, n.first + 1));
+    }
+    Aabb world = {};
+    for (int i = n.first; i < n.first + n.count; i++) {
+        Ball ball = transform_ball(instance.transform, cluster.balls[cluster.bvh.items[i]]);
+        Aabb bounds = sphere_bounds(ball.pos, ball.radius);
+        world = i == n.first ? bounds : aabb_union(world, bounds);
+    }
+    return world;
+}
+
+/*
+ * Calls visit(b) for the index b in the cluster of every ball of part. The
+ * balls under a node are a contiguous range of the cluster's items.
+ */
+template <class F>
+void for_each_part_ball(const Cluster &cluster, const InstancePart &part, F &&visit) {
+    const BvhNode *first = &cluster.bvh.nodes[part.node];
+    while (first->count == 0) {
+        first = &cluster.bvh.nodes[first->first];
+    }
+    const BvhNode *last = &cluster.bvh.nodes[part.node];
+    while (last->count == 0) {
+        last = &cluster.bvh.nodes[last->first + 1];
+    }
+    for (int i = first->first; i < last->first + last->count; i++) {
+        visit(cluster.bvh.items[i]);
+    }
+}
+
+/*
+ * Adds the parts of instance under node, cutting its cluster's hierarchy at
+ * instance_part_depth.
+ */
+inline void add_instance_parts(Scene &scene, int instance, int node, int depth, std::vector<Aabb> &bounds) {
+    const BvhNode &n = scene.clusters[scene.instances[instance].cluster].bvh.nodes[node];
+    if (n.count == 0 && depth < instance_part_depth) {
+        add_instance_parts(scene, instance, n.first, depth + 1, bounds);
+        add_instance_parts(scene, instance, n.first + 1, depth + 1, bounds);
+        return;
+    }
+    scene.instance_parts.push_back({instance, node});
+    bounds.push_back(instance_part_bounds(scene, scene.instances[instance], node));
+}
+
+/*
+ * Builds the bottom level hierarchy of every cluster, the top level
+ * hierarchy over the parts of the instances and, unless use_ball_bvh is
+ * false, a hierarchy over the explicit balls. Without it explicit balls are
+ * tested one by one.
+ */
+inline void build_acceleration(Scene &scene, bool use_ball_bvh = true) {
+    std::vector<Aabb> bounds;
+    for (auto &cluster : scene.clusters) {
+        bounds.clear();
+        for (auto &ball : cluster.balls) {
+            bounds.push_back(sphere_bounds(ball.pos, ball.radius));
+        }
+        // One ball per leaf, so that instances split into parts of few balls
+        cluster.bvh = build_bvh(bounds, 1);
+    }
+
+    bounds.clear();
+    scene.instance_parts.clear();
+    scene.instance_first_id.clear();
+    int next_id = 0;
+    for (int i = 0; i < static_cast<int>(scene.instances.size()); i++) {
+        add_instance_parts(scene, i, 0, 0, bounds);
+        scene.instance_first_id.push_back(next_id);
+        next_id += static_cast<int>(scene.clusters[scene.instances[i].cluster].balls.size());
+    }
+    scene.instance_bvh = build_bvh(bounds);
+
+    bounds.clear();
+    if (use_ball_bvh) {
+        for (auto &ball : scene.balls) {
+            bounds.push_back(sphere_bounds(ball.pos, ball.radius));
+        }
+    }
+    scene.ball_bvh = build_bvh(bounds);
+}
+
+/*
+ * Updates the acceleration structures after explicit balls moved or changed
+ * size, without rebuilding them. The set of balls must be the one
+ * build_acceleration saw.
+ */
+inline void refit_acceleration(Scene &scene) {
+    if (scene.ball_bvh.nodes.empty()) {
+        return;
+    }
+    std::vector<Aabb> bounds;
+    bounds.reserve(scene.balls.size());
+    for (auto &ball : scene.balls) {
+        bounds.push_back(sphere_bounds(ball.pos, ball.radius));
+    }
+    refit_bvh(scene.ball_bvh, bounds);
+}
+
+/*
+ * Replaces all instances with explicit copies of their balls. Ball ids stay
+ * the same.
+ */
+inline void flatten_instances(Scene &scene) {
+    for (auto &instance : scene.instances) {
+        for (auto &ball : scene.clusters[instance.cluster].balls) {
+            scene.balls.push_back(transform_ball(instance.transform, ball));
+        }
+    }
+    scene.instances.clear();
+    scene.clusters.clear();
+}
+
+/*
+ * Number of balls in the scene counting every instanced ball.
+ */
+inline long scene_ball_count(const Scene &scene) {
+    long count = scene.balls.size();
+    for (auto &instance : scene.instances) {
+        count += scene.clusters[instance.cluster].balls.size();
+    }
+    if (scene.pages) {
+        count += scene.pages->ball_count;
+    }
+    return count;
+}
+
+/*
+ * Id of the first ball of the ball page file, after the instanced balls.
+ */
+inline int paged_first_id(const Scene &scene) {
+    if (scene.instances.empty()) {
+        return static_cast<int>(scene.balls.size());
+    }
+    const Instance &last = scene.instances.back();
+    return static_cast<int>(scene.balls.size()) + scene.instance_first_id.back() +
+        static_cast<int>(scene.clusters[last.cluster].balls.size());
+}
+
+/*
+ * Bytes used by the geometry and acceleration structures of the scene.
+ */
+inline size_t scene_memory_bytes(const Scene &scene) {
+    size_t bytes = scene.balls.size() * sizeof(Ball) + bvh_memory_bytes(scene.ball_bvh);
+    for (auto &cluster : scene.clusters) {
+        bytes += cluster.balls.size() * sizeof(Ball) + bvh_memory_bytes(cluster.bvh);
+    }
+    bytes += scene.instances.size() * (sizeof(Instance) + sizeof(int));
+    bytes += scene.instance_parts.size() * sizeof(InstancePart);
+    bytes += bvh_memory_bytes(scene.instance_bvh);
+    return bytes;
+}
+
+/*
+ * The ball with the given id in world space.
+ */
+inline Ball scene_ball(const Scene &scene, int id) {
+    if (id < static_cast<int>(scene.balls.size())) {
+        return scene.balls[id];
+    }
+    if (scene.pages && id >= paged_first_id(scene)) {
+        return scene.pages->ball(id - paged_first_id(scene));
+    }
+    int instanced_id = id - static_cast<int>(scene.balls.size());
+    auto next = std::upper_bound(scene.instance_first_id.begin(), scene.instance_first_id.end(), instanced_id);
+    int instance = static_cast<int>(next - scene.instance_first_id.begin()) - 1;
+    const Instance &placement = scene.instances[instance];
+    return transform_ball(placement.transform,
+            scene.clusters[placement.cluster].balls[instanced_id - scene.instance_first_id[instance]]);
+}
+
+inline void hash_bytes(uint64_t &hash, const void *data, size_t size) {
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+}
+
+inline void hash_vector(uint64_t &hash, const Vector3 &v) {
+    hash_bytes(hash, &v.x, sizeof(double));
+    hash_bytes(hash, &v.y, sizeof(double));
+    hash_bytes(hash, &v.z, sizeof(double));
+}
+
+/*
+ * FNV-1a hash of everything that decides which ball a ray hits: positions and
+ * radii of all balls and the placement of all instances. Lights and
+ * materials are left out.
+ */
+inline uint64_t scene_geometry_hash(const Scene &scene) {
+    uint64_t hash = 14695981039346656037ull;
+    auto hash_ball = [&](const Ball &ball) {
+        hash_vector(hash, ball.pos);
+        hash_bytes(hash, &ball.radius, sizeof(double));
+    };
+    for (auto &ball : scene.balls) {
+        hash_ball(ball);
+    }
+    for (auto &cluster : scene.clusters) {
+        hash_bytes(hash, "cluster", 7);
+        for (auto &ball : cluster.balls) {
+            hash_ball(ball);
+        }
+    }
+    for (auto &instance : scene.instances) {
+        const Transform &t = instance.transform;
+        hash_bytes(hash, &instance.cluster, sizeof(int));
+        hash_vector(hash, t.x_axis);
+        hash_vector(hash, t.y_axis);
+        hash_vector(hash, t.z_axis);
+        hash_bytes(hash, &t.scale, sizeof(double));
+        hash_vector(hash, t.translation);
+    }
+    if (scene.pages) {
+        hash_bytes(hash, "pages", 5);
+        hash_bytes(hash, &scene.pages->hash, sizeof(uint64_t));
+    }
+    return hash;
+}
+
+/*
+ * FNV-1a hash of everything in the scene that shows in a rendered image:
+ * the geometry, the materials of all balls and the lights.
+ */
+inline uint64_t scene_hash(const Scene &scene) {
+    uint64_t hash = scene_geometry_hash(scene);
+    auto hash_material = [&](const Ball &ball) {
+        hash_bytes(hash, &ball.color.r, sizeof(double));
+        hash_bytes(hash, &ball.color.g, sizeof(double));
+        hash_bytes(hash, &ball.color.b, sizeof(double));
+        hash_bytes(hash, &ball.specular_parameter, sizeof(double));
+        hash_bytes(hash, &ball.reflective_parameter, sizeof(double));
+    };
+    for (auto &ball : scene.balls) {
+        hash_material(ball);
+    }
+    for (auto &cluster : scene.clusters) {
+        for (auto &ball : cluster.balls) {
+            hash_material(ball);
+        }
+    }
+    for (auto &light : scene.lights) {
+        hash_vector(hash, light.pos);
+        hash_bytes(hash, &light.intensity, sizeof(double));
+        if (light.shape != LightShape::point) {
+            hash_bytes(hash, &light.shape, sizeof(light.shape));
+            hash_bytes(hash, &light.radius, sizeof(double));
+            hash_vector(hash, light.edge_u);
+            hash_vector(hash, light.edge_v);
+        }
+    }
+    return hash;
+}
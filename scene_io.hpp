@@ -0,0 +1,211 @@
+#pragma once
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <optional>
+#include <sstream>
+#include <string>
+
+#include "scene.hpp"
+
+/*
+ * Text scene files have one element per line, '#' starts a comment:
+ *
+ *   light X Y Z INTENSITY
+ *   sphere_light X Y Z RADIUS INTENSITY
+ *   rect_light X Y Z UX UY UZ VX VY VZ INTENSITY
+ *   ball X Y Z RADIUS R G B SPECULAR REFLECTIVE
+ *   cluster
+ *   cluster_ball X Y Z RADIUS R G B SPECULAR REFLECTIVE
+ *   instance CLUSTER XX XY XZ YX YY YZ ZX ZY ZZ SCALE TX TY TZ
+ *
+ * light is a point light. A rect_light has a corner at X Y Z and the sides
+ * U and V from there. cluster starts a new cluster that the following
+ * cluster_ball lines are added to. Clusters are numbered from 0 in file
+ * order. An instance lists its cluster, the three axes of its rotation,
+ * which must be orthonormal, its scale, which must be positive, and its
+ * translation. Numbers are written with 17 significant digits so a saved
+ * scene loads back exactly.
+ */
+
+inline std::string format_ball(const Ball &b) {
+    char line[512];
+    snprintf(line, sizeof(line), "%.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g",
+            b.pos.x, b.pos.y, b.pos.z, b.radius, b.color.r, b.color.g, b.color.b,
+            b.specular_parameter, b.reflective_parameter);
+    return line;
+}
+
+inline std::string format_vector(const Vector3 &v) {
+    char text[128];
+    snprintf(text, sizeof(text), "%.17g %.17g %.17g", v.x, v.y, v.z);
+    return text;
+}
+
+/*
+ * Writes the scene in the text format to output.
+ */
+inline void write_scene(std::ostream &output, const Scene &scene) {
+    for (auto &light : scene.lights) {
+        char intensity[64];
+        snprintf(intensity, sizeof(intensity), "%.17g", light.intensity);
+        if (light.shape == LightShape::sphere) {
+            char radius[64];
+            snprintf(radius, sizeof(radius), "%.17g", light.radius);
+            output << "sphere_light " << format_vector(light.pos) << " " << radius << " " << intensity << "\n";
+        } else if (light.shape == LightShape::rectangle) {
+            output << "rect_light " << format_vector(light.pos) << " " << format_vector(light.edge_u) << " " <<
+                format_vector(light.edge_v) << " " << intensity << "\n";
+        } else {
+            output << "light " << format_vector(light.pos) << " " << intensity << "\n";
+        }
+    }
+    for (auto &ball : scene.balls) {
+        output << "ball " << format_ball(ball) << "\n";
+    }
+    for (auto &cluster : scene.clusters) {
+        output << "cluster\n";
+        for (auto &ball : cluster.balls) {
+            output << "cluster_ball " << format_ball(ball) << "\n";
+        }
+    }
+    for (auto &instance : scene.instances) {
+        const Transform &t = instance.transform;
+        char scale[64];
+        snprintf(scale, sizeof(scale), "%.17g", t.scale);
+        output << "instance " << instance.cluster << " " << format_vector(t.x_axis) << " "
+            << format_vector(t.y_axis) << " " << format_vector(t.z_axis) << " "
+            << scale << " " << format_vector(t.translation) << "\n";
+    }
+}
+
+/*
+ * Writes the scene to path. Returns false if the file could not be written.
+ */
+inline bool save_scene(const std::string &path, const Scene &scene) {
+    std::ofstream output(path);
+    if (!output) {
+        fprintf(stderr, "Cannot open scene file %s for writing\n", path.c_str());
+        return false;
+    }
+    write_scene(output, scene);
+    return static_cast<bool>(output);
+}
+
+inline bool parse_ball(std::istringstream &line, Ball &b) {
+    return static_cast<bool>(line >> b.pos.x >> b.pos.y >> b.pos.z >> b.radius
+            >> b.color.r >> b.color.g >> b.color.b
+            >> b.specular_parameter >> b.reflective_parameter);
+}
+
+inline bool parse_vector(std::istringstream &line, Vector3 &v) {
+    return static_cast<bool>(line >> v.x >> v.y >> v.z);
+}
+
+/*
+ * True if the axes of t are orthonormal to within the rounding of a file
+ * written by hand with a few digits fewer than write_scene uses, and its
+ * scale is positive.
+ */
+inline bool valid_transform(const Transform &t) {
+    const double tolerance = 1e-6;
+    auto unit = [&](const Vector3 &v) {
+        return std::abs(vector_length(v) - 1) < tolerance;
+    };
+    return unit(t.x_axis) && unit(t.y_axis) && unit(t.z_axis) &&
+        std::abs(vector_dot(t.x_axis, t.y_axis)) < tolerance &&
+        std::abs(vector_dot(t.y_axis, t.z_axis)) < tolerance &&
+        std::abs(vector_dot(t.z_axis, t.x_axis)) < tolerance &&
+        t.scale > 0 && std::isfinite(t.scale);
+}
+
+/*
+ * Reads a scene in the text format from input. path is the file name used in
+ * error messages. Prints the offending line and returns nothing if the scene
+ * is malformed. The acceleration structures are not built.
+ */
+inline std::optional<Scene> read_scene(std::istream &input, const std::string &path) {
+    Scene scene;
+    std::string text;
+    int line_number = 0;
+    while (std::getline(input, text)) {
+        line_number++;
+        std::istringstream line(text.substr(0, text.find('#')));
+        std::string kind;
+        if (!(line >> kind)) {
+            continue;
+        }
+        bool ok = true;
+        if (kind == "light") {
+            Light light;
+            ok = parse_vector(line, light.pos) && static_cast<bool>(line >> light.intensity);
+            scene.lights.push_back(light);
+        } else if (kind == "sphere_light") {
+            Light light;
+            light.shape = LightShape::sphere;
+            ok = parse_vector(line, light.pos) && static_cast<bool>(line >> light.radius >> light.intensity) &&
+                light.radius > 0;
+            scene.lights.push_back(light);
+        } else if (kind == "rect_light") {
+            Light light;
+            light.shape = LightShape::rectangle;
+            ok = parse_vector(line, light.pos) && parse_vector(line, light.edge_u) &&
+                parse_vector(line, light.edge_v) && static_cast<bool>(line >> light.intensity) &&
+                vector_length(vector_cross(light.edge_u, light.edge_v)) > 0;
+            scene.lights.push_back(light);
+        } else if (kind == "ball") {
+            Ball ball;
+            ok = parse_ball(line, ball);
+            scene.balls.push_back(ball);
+        } else if (kind == "cluster") {
+            scene.clusters.push_back({});
+        } else if (kind == "cluster_ball") {
+            Ball ball;
+            ok = parse_ball(line, ball) && !scene.clusters.empty();
+            if (ok) {
+                scene.clusters.back().balls.push_back(ball);
+            }
+        } else if (kind == "instance") {
+            Instance instance;
+            Transform &t = instance.transform;
+            ok = static_cast<bool>(line >> instance.cluster) &&
+                parse_vector(line, t.x_axis) && parse_vector(line, t.y_axis) &&
+                parse_vector(line, t.z_axis) && static_cast<bool>(line >> t.scale) &&
+                parse_vector(line, t.translation) &&
+                instance.cluster >= 0 && instance.cluster < static_cast<int>(scene.clusters.size()) &&
+                valid_transform(t);
+            scene.instances.push_back(instance);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%d: cannot parse \"%s\"\n", path.c_str(), line_number, text.c_str());
+            return std::nullopt;
+        }
+    }
+    for (auto &cluster : scene.clusters) {
+        if (cluster.balls.empty()) {
+            fprintf(stderr, "%s: clusters must not be empty\n", path.c_str());
+            return std::nullopt;
+        }
+    }
+    if (scene.lights.empty()) {
+        fprintf(stderr, "%s: the scene needs a light\n", path.c_str());
+        return std::nullopt;
+    }
+    return scene;
+}
+
+/*
+ * Reads a scene written by save_scene or by hand, see read_scene.
+ */
+inline std::optional<Scene> load_scene(const std::string &path) {
+    std::ifstream input(path);
+    if (!input) {
+        fprintf(stderr, "Cannot open scene file %s\n", path.c_str());
+        return std::nullopt;
+    }
+    return read_scene(input, path);
+}
@@ -0,0 +1,250 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "camera.hpp"
+#include "framebuffer.hpp"
+#include "render.hpp"
+#include "trace.hpp"
+
+/*
+ * Temporal reprojection for sequences with a moving camera: most pixels of
+ * a frame see the same surface points as the frame before, so what was
+ * found for them need not be found again.
+ *
+ * Every pixel keeps the path of its rays: for every bounce the ball hit, the
+ * hit point and how much of the light the point sees. For the next frame
+ * the primary hit points are projected into the new camera, nearest first
+ * where several land on one pixel, and a pixel that received a point reuses
+ * the path of the pixel it came from, bounce by bounce:
+ *
+ * - The ray of the bounce is first tested against the ball the old path
+ *   hit, and the hierarchy is only traversed in front of that hit. The ray
+ *   still finds the closest ball of the whole scene, so balls that came into
+ *   view, directly or in a reflection, are found like in a full render.
+ * - If that ball is still what the ray hits, the scene and its area light
+ *   are unchanged since the last frame, and the old hit lies in a settled
+ *   region (see settled()), the light visibility of the old hit is taken
+ *   instead of sampling the shadow rays again.
+ *
+ * Specular highlights and reflection directions depend on the view and are
+ * always shaded and traced anew, as are pixels no point landed on.
+ * Everything but the reused visibility is exactly what a full render
+ * computes, so with a point light, which has no shadow rays to save, frames
+ * equal full renders. With an area light a reused visibility can miss a
+ * shadow edge narrower than the pixels around it; --verify reports the
+ * difference to a full render. The first frame, and any frame after a
+ * change of resolution, is traced in full.
+ */
+
+const int temporal_path_length = max_recursion_depth + 1;
+
+struct TemporalHit {
+    int ball;           // id of the ball hit, -1 on a miss
+    Vector3 point;      // where it hit it
+    double visibility;  // fraction of the light point sees
+};
+
+struct TemporalSample {
+    // Ends at the first miss, after which all hits are misses
+    TemporalHit path[temporal_path_length];
+};
+
+class TemporalRenderer {
+public:
+    /*
+     * Renders the next frame of the sequence into framebuffer, reusing
+     * what it can of the frame before.
+     */
+    RenderStats render_frame(Renderer &renderer, const Scene &scene, const RenderSettings &settings,
+            Framebuffer &framebuffer) {
+        auto start = std::chrono::steady_clock::now();
+        ThreadPool &pool = renderer.thread_pool();
+        int width = settings.width;
+        int height = settings.height;
+        size_t pixels = static_cast<size_t>(width) * height;
+        bool full = previous.size() != pixels;
+        if (full) {
+            previous.assign(pixels, {});
+            current.assign(pixels, {});
+            landed = std::make_unique<std::atomic<uint64_t>[]>(pixels);
+        }
+        uint64_t hash = scene_hash(scene);
+        bool keep_visibility = !full && hash == previous_hash && scene.lights[0].shape != LightShape::point;
+        previous_hash = hash;
+        std::atomic<long> reused{0};
+        std::atomic<long> sampled{0};
+
+        if (!full) {
+            for (size_t i = 0; i < pixels; i++) {
+                landed[i].store(nothing_landed, std::memory_order_relaxed);
+            }
+            project(pool, settings);
+        }
+
+        pool.parallel_for(tiles_x(settings) * tiles_y(settings), [&](int tile, int) {
+            Tile rect = tile_rect(settings, tile);
+            long counts[2] = {0, 0};
+            for (int y = rect.y0; y < rect.y1; y++) {
+                for (int x = rect.x0; x < rect.x1; x++) {
+                    size_t i = x + static_cast<size_t>(y) * width;
+                    const Ray ray = primary_ray(settings.camera, x, y, width, height);
+                    uint64_t own = full ? nothing_landed : landed[i].load(std::memory_order_relaxed);
+                    Color c = trace(scene, settings, ray, own, keep_visibility, current[i], counts);
+                    store_pixel(framebuffer, x, y, c);
+                }
+            }
+            reused += counts[0];
+            sampled += counts[1];
+        });
+        previous.swap(current);
+
+        reused_hits = reused;
+        sampled_hits = sampled;
+        RenderStats stats;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        stats.seconds = elapsed.count();
+        return stats;
+    }
+
+    // Hits of the last frame, at any bounce, that reused the light
+    // visibility of the frame before, and that sampled it
+    long reused_hits = 0;
+    long sampled_hits = 0;
+
+private:
+    static const uint64_t nothing_landed = ~0ull;
+
+    /*
+     * Projects the primary hit points of the previous frame into the camera
+     * of settings.
+     */
+    void project(ThreadPool &pool, const RenderSettings &settings) {
+        int width = settings.width;
+        int height = settings.height;
+        pool.parallel_for(height, [&](int y, int) {
+            for (int x = 0; x < width; x++) {
+                uint32_t source = x + y * width;
+                const TemporalHit &hit = previous[source].path[0];
+                if (hit.ball < 0) {
+                    continue;
+                }
+                double px, py;
+                if (!project_point(settings.camera, hit.point, width, height, px, py)) {
+                    continue;
+                }
+                double tx = std::floor(px + 0.5);
+                double ty = std::floor(py + 0.5);
+                if (tx < 0 || ty < 0 || tx >= width || ty >= height) {
+                    continue;
+                }
+                // Positive floats order like their bits, so the nearest
+                // point has the smallest key
+                float depth = static_cast<float>(vector_length(hit.point - settings.camera.pos));
+                uint32_t depth_bits;
+                memcpy(&depth_bits, &depth, sizeof(depth_bits));
+                uint64_t key = static_cast<uint64_t>(depth_bits) << 32 | source;
+                std::atomic<uint64_t> &slot = landed[static_cast<int>(tx) + static_cast<int>(ty) * width];
+                uint64_t seen = slot.load(std::memory_order_relaxed);
+                while (key < seen && !slot.compare_exchange_weak(seen, key, std::memory_order_relaxed)) {
+                }
+            }
+        });
+    }
+
+    /*
+     * True if bounce depth of the previous frame's pixel source and of its
+     * eight neighbours all hit the same ball and see the same fraction of
+     * the light. A hit close to that of source then sees the light the same
+     * way, unless a shadow edge narrower than the hits around it passes
+     * between them.
+     */
+    bool settled(uint32_t source, int depth, const RenderSettings &settings) const {
+        int sx = static_cast<int>(source % settings.width);
+        int sy = static_cast<int>(source / settings.width);
+        const TemporalHit &center = previous[source].path[depth];
+        for (int y = sy - 1; y <= sy + 1; y++) {
+            for (int x = sx - 1; x <= sx + 1; x++) {
+                if (x < 0 || y < 0 || x >= settings.width || y >= settings.height) {
+                    return false;
+                }
+                const TemporalHit &near = previous[x + static_cast<size_t>(y) * settings.width].path[depth];
+                if (near.ball != center.ball || near.visibility != center.visibility) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /*
+     * Traces the pixel of ray like cast_ray, following the path of the pixel
+     * whose point own landed on it, if any, and records the path in sample.
+     * Adds the hits that reused their light visibility to counts[0] and
+     * those that sampled it to counts[1].
+     */
+    Color trace(const Scene &scene, const RenderSettings &settings, const Ray &ray, uint64_t own,
+            bool keep_visibility, TemporalSample &sample, long *counts) const {
+        const TemporalSample *source = own == nothing_landed ? nullptr : &previous[static_cast<uint32_t>(own)];
+        Color local[temporal_path_length];
+        double reflective[temporal_path_length];
+        Ray current_ray = ray;
+        int last = 0;
+        Color end = background_color;
+        for (int depth = 0; depth < temporal_path_length; depth++) {
+            const TemporalHit *old = source ? &source->path[depth] : nullptr;
+            ClosestHit closest;
+            if (old && old->ball >= 0 && old->ball < static_cast<int>(scene.balls.size())) {
+                const Ball &ball = scene.balls[old->ball];
+                auto intersection = intersects_ball(current_ray, ball);
+                if (intersection) {
+                    closest.offer(intersection.value(), old->ball, &ball);
+                }
+            }
+            auto hit = closest_hit_from(current_ray, scene, closest);
+            if (!hit) {
+                for (int d = depth; d < temporal_path_length; d++) {
+                    sample.path[d] = {-1, {0, 0, 0}, 0};
+                }
+                last = depth;
+                end = background_color;
+                break;
+            }
+            SurfacePoint surface = surface_point(current_ray, hit->ball, hit->t);
+            bool reuse = keep_visibility && old && hit->id == old->ball &&
+                settled(static_cast<uint32_t>(own), depth, settings);
+            double visibility = reuse ? old->visibility :
+                light_visibility(surface.point, scene.lights[0], scene);
+            counts[reuse ? 0 : 1]++;
+            sample.path[depth] = {hit->id, surface.point, visibility};
+            Color shaded = shade_local(surface, hit->ball, scene, visibility);
+            if (depth == max_recursion_depth || !reflects(hit->ball)) {
+                for (int d = depth + 1; d < temporal_path_length; d++) {
+                    sample.path[d] = {-1, {0, 0, 0}, 0};
+                }
+                last = depth;
+                end = shaded;
+                break;
+            }
+            local[depth] = shaded;
+            reflective[depth] = hit->ball.reflective_parameter;
+            current_ray = reflected_ray(surface);
+        }
+        // Blended back to front the same way cast_ray unwinds
+        Color c = end;
+        for (int depth = last - 1; depth >= 0; depth--) {
+            c = color_linear_interpolate(local[depth], c, reflective[depth]);
+        }
+        return c;
+    }
+
+    std::vector<TemporalSample> previous;
+    std::vector<TemporalSample> current;
+    std::unique_ptr<std::atomic<uint64_t>[]> landed;
+    uint64_t previous_hash = 0;
+};
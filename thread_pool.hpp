@@ -0,0 +1,169 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "numa.hpp"
+
+/*
+ * Fixed set of worker threads that are kept alive between frames.
+ *
+ * parallel_for hands out task indices dynamically to the workers and the
+ * calling thread, which acts as worker 0. The task function is passed by
+ * pointer rather than wrapped in std::function so dispatching work never
+ * allocates.
+ *
+ * With a placement every worker is pinned to its CPU; the calling thread
+ * moves to the CPU of worker 0 for the duration of parallel_for and gets
+ * its own affinity back afterwards, so threads it starts later are not
+ * pinned. When the workers span several nodes the tasks are split into one
+ * contiguous band per node, and every worker takes the tasks of its own
+ * band before helping with the others.
+ */
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads, const ThreadPlacement &placement = {}) :
+        placement(placement),
+        band_next(std::make_unique<std::atomic<int>[]>(placement.band_nodes.size())) {
+        for (int worker = 1; worker < threads; worker++) {
+            workers.emplace_back([this, worker] {
+                if (!this->placement.cpus.empty()) {
+                    pin_current_thread(this->placement.cpus[worker]);
+                }
+                worker_loop(worker);
+            });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &thread : workers) {
+            thread.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const {
+        return static_cast<int>(workers.size()) + 1;
+    }
+
+    int band_count() const {
+        return static_cast<int>(placement.band_nodes.size());
+    }
+
+    /*
+     * The band of worker and the NUMA node of a band.
+     */
+    int worker_band(int worker) const {
+        return placement.bands.empty() ? 0 : placement.bands[worker];
+    }
+
+    int band_node(int band) const {
+        return placement.band_nodes[band];
+    }
+
+    /*
+     * The first task of band when count tasks are split into bands.
+     */
+    int band_begin(int band, int count) const {
+        return static_cast<int>(static_cast<long>(count) * band / band_count());
+    }
+
+    /*
+     * Calls f(task, worker) for every task in [0, count) and returns when all
+     * calls have finished. worker is in [0, size()).
+     */
+    template <class F>
+    void parallel_for(int count, F &&f) {
+        using Function = std::remove_reference_t<F>;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            invoke = [](void *context, int task, int worker) {
+                (*static_cast<Function*>(context))(task, worker);
+            };
+            context = const_cast<void*>(static_cast<const void*>(&f));
+            task_count = count;
+            next_task = 0;
+            for (int band = 0; band < band_count(); band++) {
+                band_next[band] = band_begin(band, count);
+            }
+            active = static_cast<int>(workers.size());
+            generation++;
+        }
+        wake.notify_all();
+        cpu_set_t affinity;
+        bool pinned = !placement.cpus.empty() &&
+            pthread_getaffinity_np(pthread_self(), sizeof(affinity), &affinity) == 0 &&
+            pin_current_thread(placement.cpus[0]);
+        run_tasks(0);
+        if (pinned) {
+            pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return active == 0; });
+    }
+
+private:
+    void run_tasks(int worker) {
+        if (band_count() == 1) {
+            for (int task = next_task++; task < task_count; task = next_task++) {
+                invoke(context, task, worker);
+            }
+            return;
+        }
+        int home = worker_band(worker);
+        for (int i = 0; i < band_count(); i++) {
+            int band = (home + i) % band_count();
+            int end = band_begin(band + 1, task_count);
+            for (int task = band_next[band]++; task < end; task = band_next[band]++) {
+                invoke(context, task, worker);
+            }
+        }
+    }
+
+    void worker_loop(int worker) {
+        long seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            run_tasks(worker);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                active--;
+            }
+            done.notify_one();
+        }
+    }
+
+    ThreadPlacement placement;
+    std::unique_ptr<std::atomic<int>[]> band_next;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool stopping = false;
+    long generation = 0;
+    int active = 0;
+
+    void (*invoke)(void*, int, int) = nullptr;
+    void *context = nullptr;
+    int task_count = 0;
+    std::atomic<int> next_task{0};
+};
@@ -0,0 +1,254 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory_resource>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "camera.hpp"
+#include "fast_math.hpp"
+#include "framebuffer.hpp"
+#include "scene.hpp"
+
+/*
+ * Persistent cache of rendered tiles, shared by all runs that use the same
+ * directory. Every tile is a file named after the hash of its key, which
+ * holds everything the pixels of the tile depend on, so a cached tile never
+ * has to be invalidated; it just stops being asked for. The file starts
+ * with the whole key, and a tile is only taken if that matches, so two keys
+ * whose hashes collide are told apart.
+ *
+ * Files are written under a temporary name and renamed into place, so
+ * concurrent runs never see half written tiles. Reads map the file instead
+ * of copying it through a buffer. Every hit touches the file's modification
+ * time, and trim removes the least recently used tiles until the directory
+ * fits in the size cap.
+ */
+
+/*
+ * Bump when a change to the renderer changes the pixels of some scene, so
+ * tiles cached by older builds are no longer found.
+ */
+const uint32_t tile_cache_version = 2;
+
+const char tile_cache_magic[8] = {'R', 'T', 'T', 'I', 'L', 'E', '0', '2'};
+
+/*
+ * Key of the tile with pixels [x0, x1) x [y0, y1) of a width by height
+ * image of the scene with the given scene_hash seen from camera with
+ * samples per pixel in the math tier. The traversal settings are left out
+ * because every traversal mode gives the same pixels. The key has no
+ * padding, so it is hashed and compared as bytes.
+ */
+struct TileCacheKey {
+    uint64_t scene_hash;
+    Camera camera;
+    int32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t samples;
+    int32_t math;
+    int32_t x0;
+    int32_t y0;
+    int32_t x1;
+    int32_t y1;
+    int32_t reserved;
+};
+
+static_assert(sizeof(TileCacheKey) == sizeof(uint64_t) + sizeof(Camera) + 10 * sizeof(int32_t),
+        "TileCacheKey must not have padding");
+
+inline TileCacheKey tile_cache_key(uint64_t scene_hash, const Camera &camera, int width, int height,
+        int samples, MathTier math, int x0, int y0, int x1, int y1) {
+    return {scene_hash, camera, static_cast<int32_t>(tile_cache_version), width, height, samples,
+        static_cast<int32_t>(math), x0, y0, x1, y1, 0};
+}
+
+inline uint64_t tile_cache_hash(const TileCacheKey &key) {
+    uint64_t hash = 14695981039346656037ull;
+    hash_bytes(hash, &key, sizeof(key));
+    return hash;
+}
+
+class TileCache {
+public:
+    TileCache(std::string directory, uint64_t max_bytes) :
+        directory(std::move(directory)), max_bytes(max_bytes) {}
+
+    /*
+     * Creates the cache directory if needed. Returns false if that fails.
+     */
+    bool open() {
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        if (error) {
+            fprintf(stderr, "Cannot create tile cache %s: %s\n", directory.c_str(),
+                    error.message().c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /*
+     * Copies the cached tile with the given key into its pixels of
+     * framebuffer. Returns false if the tile is not cached or the file holds
+     * another tile.
+     */
+    bool load(const TileCacheKey &key, Framebuffer &framebuffer) {
+        char path[PATH_MAX];
+        int fd = tile_path(key, path) ? ::open(path, O_RDONLY) : -1;
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        size_t size = header_bytes + tile_bytes(key);
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) != size) {
+            close(fd);
+            return false;
+        }
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        const unsigned char *data = static_cast<const unsigned char*>(mapped);
+        bool ok = memcmp(data, tile_cache_magic, sizeof(tile_cache_magic)) == 0 &&
+            memcmp(data + sizeof(tile_cache_magic), &key, sizeof(key)) == 0;
+        if (ok) {
+            const unsigned char *pixel = data + header_bytes;
+            for (int y = key.y0; y < key.y1; y++) {
+                for (int x = key.x0; x < key.x1; x++) {
+                    int i = x + y * framebuffer.width;
+                    framebuffer.red[i] = pixel[0];
+                    framebuffer.green[i] = pixel[1];
+                    framebuffer.blue[i] = pixel[2];
+                    pixel += 3;
+                }
+            }
+            // Mark the tile as recently used
+            utimensat(AT_FDCWD, path, nullptr, 0);
+            hits++;
+        }
+        munmap(mapped, size);
+        return ok;
+    }
+
+    /*
+     * Writes the pixels of the tile of key in framebuffer to the cache. The
+     * file is put together in memory from arena. Failures only cost a later
+     * cache miss and are ignored.
+     */
+    void store(const TileCacheKey &key, const Framebuffer &framebuffer, std::pmr::memory_resource *arena) {
+        char path[PATH_MAX];
+        char temporary[PATH_MAX];
+        if (!tile_path(key, path) ||
+                !fits(snprintf(temporary, sizeof(temporary), "%s/tile.XXXXXX", directory.c_str()))) {
+            return;
+        }
+        std::pmr::vector<unsigned char> data(header_bytes + tile_bytes(key), arena);
+        memcpy(data.data(), tile_cache_magic, sizeof(tile_cache_magic));
+        memcpy(data.data() + sizeof(tile_cache_magic), &key, sizeof(key));
+        unsigned char *pixel = data.data() + header_bytes;
+        for (int y = key.y0; y < key.y1; y++) {
+            for (int x = key.x0; x < key.x1; x++) {
+                int i = x + y * framebuffer.width;
+                pixel[0] = static_cast<unsigned char>(framebuffer.red[i]);
+                pixel[1] = static_cast<unsigned char>(framebuffer.green[i]);
+                pixel[2] = static_cast<unsigned char>(framebuffer.blue[i]);
+                pixel += 3;
+            }
+        }
+
+        int fd = mkstemp(temporary);
+        if (fd < 0) {
+            return;
+        }
+        bool ok = write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size());
+        ok = close(fd) == 0 && ok;
+        if (!ok || rename(temporary, path) != 0) {
+            unlink(temporary);
+            return;
+        }
+        stored++;
+    }
+
+    /*
+     * Removes the least recently used tiles until all tiles together take
+     * at most max_bytes.
+     */
+    void trim() {
+        struct Entry {
+            std::filesystem::file_time_type used;
+            uintmax_t size;
+            std::filesystem::path path;
+        };
+        std::vector<Entry> entries;
+        uintmax_t total = 0;
+        std::error_code error;
+        for (auto &file : std::filesystem::directory_iterator(directory, error)) {
+            if (file.path().extension() != ".tile") {
+                continue;
+            }
+            std::error_code file_error;
+            Entry entry = {file.last_write_time(file_error), file.file_size(file_error), file.path()};
+            if (!file_error) {
+                total += entry.size;
+                entries.push_back(std::move(entry));
+            }
+        }
+        if (total <= max_bytes) {
+            return;
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+            return a.used < b.used;
+        });
+        for (auto &entry : entries) {
+            if (total <= max_bytes) {
+                break;
+            }
+            if (std::filesystem::remove(entry.path, error)) {
+                total -= entry.size;
+                evicted++;
+            }
+        }
+    }
+
+    std::atomic<long> hits{0};
+    std::atomic<long> stored{0};
+    std::atomic<long> evicted{0};
+
+private:
+    static const size_t header_bytes = sizeof(tile_cache_magic) + sizeof(TileCacheKey);
+
+    static size_t tile_bytes(const TileCacheKey &key) {
+        return static_cast<size_t>(key.x1 - key.x0) * (key.y1 - key.y0) * 3;
+    }
+
+    static bool fits(int length) {
+        return length >= 0 && length < PATH_MAX;
+    }
+
+    /*
+     * Writes the path of the file of key to path, without allocating.
+     * Returns false if it is too long.
+     */
+    bool tile_path(const TileCacheKey &key, char (&path)[PATH_MAX]) const {
+        return fits(snprintf(path, sizeof(path), "%s/%016" PRIx64 ".tile", directory.c_str(),
+                    tile_cache_hash(key)));
+    }
+
+    std::string directory;
+    uint64_t max_bytes;
+};
@@ -0,0 +1,666 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <optional>
+
+#include "ball_pages.hpp"
+#include "fast_math.hpp"
+#include "scene.hpp"
+
+/*
+ * Rays that hit nothing closer than this distance see the background.
+ */
+const double max_hit_distance = 10000;
+
+/*
+ * Maximum number of reflection bounces after the primary ray.
+ */
+const int max_recursion_depth = 2;
+
+const Color background_color = {0.2, 0.2, 0.2};
+
+/*
+ * Standard algorithm for intersection between line and sphere.
+ * Returns optional which has a value if they intersected containing the
+ * parameter of the ray t.
+ *
+ * Since reflection rays are cast from intersection locations we need to exclude
+ * intersections that are with the reflective surface itself. We therefore
+ * require that the parameter t is larger than 0.00001.
+ *
+ * The fast math tier solves the same equation for the unnormalized
+ * direction and scales the root, which spares a square root and three
+ * divisions for every ball the ray misses.
+ */
+inline std::optional<double> intersects_ball(const Ray& ray, const Ball& ball) {
+    if (math_tier == MathTier::fast) {
+        Vector3 to_center = ball.pos - ray.from;
+        double a = vector_dot(ray.dir, ray.dir);
+        double half_b = vector_dot(ray.dir, to_center);
+        double c = vector_dot(to_center, to_center) - ball.radius * ball.radius;
+        double quarter_discriminant = half_b * half_b - a * c;
+        if (quarter_discriminant <= 0) {
+            return std::nullopt;
+        }
+        double t = (half_b - std::sqrt(quarter_discriminant)) / std::sqrt(a);
+        if (t < 0.00001) {
+            return std::nullopt;
+        }
+        return t;
+    }
+    Vector3 norm_dir = vector_normalized(ray.dir);
+    double a = vector_length(norm_dir);
+    a = a * a;
+    double b = -2 * vector_dot(norm_dir, ball.pos - ray.from);
+    double c = vector_length(ball.pos - ray.from);
+    c = c*c - (ball.radius*ball.radius);
+
+    if(b*b - 4*a*c > 0) {
+        double t = (-b - sqrt(b*b - 4*a*c)) / 2*a;
+        if(t < 0.00001) // dont intersect one self
+            return std::nullopt;
+        return std::optional<double>(t);
+    }
+    return std::nullopt;
+}
+
+/*
+ * light_intensity in the fast math tier, for a normal and camera_vector of
+ * unit length. The reflection of light_dir has the length of light_dir, so
+ * the cosines of both the diffuse and the specular term divide by that one
+ * length.
+ */
+inline double fast_light_intensity(const Vector3& normal, const Vector3& light_dir,
+        const Vector3& camera_vector, double specular_parameter, double visibility) {
+    float normal_light = static_cast<float>(vector_dot(normal, light_dir));
+    float inverse_length = fast_rsqrt(static_cast<float>(vector_dot(light_dir, light_dir)));
+    float cos_angle = normal_light * inverse_length;
+    float cos_reflected = (2 * normal_light * static_cast<float>(vector_dot(normal, camera_vector)) -
+            static_cast<float>(vector_dot(light_dir, camera_vector))) * inverse_length;
+    float direct = std::max(cos_angle, 0.0f) +
+        fast_pow(cos_reflected, static_cast<float>(specular_parameter));
+    return 0.2 + direct * visibility;
+}
+
+/*
+ * Returns the light intensity as a function of:
+ * - normal: The normal of the surface at the intersection point.
+ * - light_dir: A vector pointing towards the light.
+ * - camera_vector: A vector pointing towards the camera used for specular
+ *   lighting.
+ * - specular_parameter: Specifies the exponent in the specular equation.
+ * - visibility: The fraction of the light that is not shadowed, which scales
+ *   the diffuse and specular light.
+ */
+inline double light_intensity(const Vector3& normal, const Vector3& light_dir,
+        const Vector3& camera_vector, double specular_parameter, double visibility = 1) {
+
+    double cos_angle = vector_dot(vector_normalized(normal), vector_normalized(light_dir));
+
+    // Ambient light
+    double lighting = 0.2;
+
+    // Diffuse light
+    lighting += (cos_angle >= 0.0 ? cos_angle : 0.0) * visibility;
+
+    // Specular light
+    float s = specular_parameter;
+    Vector3 R = (normal*2*vector_dot(normal, light_dir)) - light_dir;
+    double numerator = vector_dot(R, camera_vector);
+    double denominator = (vector_length(R) * vector_length(camera_vector));
+    if(numerator >= 0) {
+        double tmp = std::pow(numerator / denominator, s);
+        lighting += tmp * visibility;
+    }
+    return lighting;
+}
+
+/*
+ * Closest intersection of a ray: the ray parameter, the id of the ball and
+ * the ball itself in world space.
+ */
+struct Hit {
+    double t;
+    int id;
+    Ball ball;
+};
+
+/*
+ * Keeps the closest of the hits offered to it. On equal distances the lower
+ * id wins, which is the order a linear scan over the flattened scene would
+ * give.
+ */
+struct ClosestHit {
+    double t = 999999;
+    int id = -1;
+    const Ball *ball = nullptr;
+    Ball instanced_ball;
+
+    void offer(double hit_t, int hit_id, const Ball *hit_ball) {
+        if (hit_t < t || (hit_t == t && hit_id < id)) {
+            t = hit_t;
+            id = hit_id;
+            ball = hit_ball;
+        }
+    }
+};
+
+/*
+ * True if the ray with normalized direction dir passes within the sphere at a
+ * distance below t_max. Unlike intersects_ball this also accepts rays
+ * starting inside the sphere.
+ */
+inline bool ray_reaches_sphere(const Vector3 &from, const Vector3 &dir, const BoundingSphere &sphere,
+        double t_max) {
+    Vector3 to_center = sphere.center - from;
+    double along = vector_dot(to_center, dir);
+    double distance2 = vector_dot(to_center, to_center) - along * along;
+    double r2 = sphere.radius * sphere.radius;
+    if (distance2 > r2) {
+        return false;
+    }
+    double half_chord = std::sqrt(r2 - distance2);
+    return along + half_chord >= 0 && along - half_chord <= t_max;
+}
+
+/*
+ * Tests the ray against the instance parts it reaches through the top level
+ * hierarchy, and against the balls of each part through its subtree of the
+ * cluster's hierarchy, with the ray moved into the cluster's space. The
+ * balls themselves are moved to world space and tested there, exactly as
+ * their copies in the flattened scene, so both give the same hits.
+ */
+inline void closest_instance_hit(const Ray& ray, const Scene &scene, ClosestHit &closest) {
+    BoxRay box_ray = make_box_ray(ray.from, ray.dir);
+    bvh_traverse(scene.instance_bvh, box_ray, closest.t, [&](int p) {
+        const InstancePart &part = scene.instance_parts[p];
+        const Instance &instance = scene.instances[part.instance];
+        const Cluster &cluster = scene.clusters[instance.cluster];
+        const Transform &transform = instance.transform;
+        int first_id = static_cast<int>(scene.balls.size()) + scene.instance_first_id[part.instance];
+        auto test = [&](int b) {
+            Ball ball = transform_ball(transform, cluster.balls[b]);
+            auto intersection = intersects_ball(ray, ball);
+            if (!intersection) {
+                return;
+            }
+            double t = intersection.value();
+            if (t < closest.t || (t == closest.t && first_id + b < closest.id)) {
+                closest.instanced_ball = ball;
+                closest.offer(t, first_id + b, &closest.instanced_ball);
+            }
+        };
+        const BvhNode &node = cluster.bvh.nodes[part.node];
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                test(cluster.bvh.items[i]);
+            }
+            return;
+        }
+        // The padding of the ball bounds is far larger than the rounding of
+        // the moved ray, so this culls no ball the world space test hits
+        Ray local = {
+            inverse_transform_point(transform, ray.from),
+            inverse_transform_direction(transform, ray.dir),
+        };
+        BoxRay local_box_ray = make_box_ray(local.from, local.dir);
+        double local_t_max = closest.t / transform.scale;
+        bvh_traverse(cluster.bvh, local_box_ray, local_t_max, [&](int b) {
+            test(b);
+            local_t_max = closest.t / transform.scale;
+        }, part.node);
+    });
+}
+
+/*
+ * Tests the ray against the balls of the scene's ball page file, where they
+ * are in place and so need no copy.
+ */
+inline void closest_paged_hit(const Ray& ray, const Scene &scene, ClosestHit &closest) {
+    const BallPages &pages = *scene.pages;
+    int first_id = paged_first_id(scene);
+    BoxRay box_ray = make_box_ray(ray.from, ray.dir);
+    ball_pages_traverse(pages, box_ray, closest.t, [&](long i) {
+        const Ball &ball = pages.ball(i);
+        auto intersection = intersects_ball(ray, ball);
+        if (intersection) {
+            closest.offer(intersection.value(), first_id + static_cast<int>(i), &ball);
+        }
+    });
+}
+
+inline std::optional<Hit> closest_hit_result(const ClosestHit &closest) {
+    if (closest.t >= max_hit_distance) {
+        return std::nullopt;
+    }
+    return Hit{closest.t, closest.id, *closest.ball};
+}
+
+inline std::optional<Hit> finish_closest_hit(const Ray& ray, const Scene &scene, ClosestHit &closest) {
+    if (!scene.instances.empty()) {
+        closest_instance_hit(ray, scene, closest);
+    }
+    if (scene.pages) {
+        closest_paged_hit(ray, scene, closest);
+    }
+    return closest_hit_result(closest);
+}
+
+/*
+ * Like closest_hit, but starting from the hit already in closest, e.g. the
+ * ball a ray is expected to hit, so that the traversal skips everything
+ * behind it. The result is that of closest_hit. closest must not hold an
+ * instanced ball.
+ */
+inline std::optional<Hit> closest_hit_from(const Ray& ray, const Scene &scene, ClosestHit &closest) {
+    if (scene.ball_bvh.nodes.empty()) {
+        for (int i = 0; i < static_cast<int>(scene.balls.size()); i++) {
+            auto intersection = intersects_ball(ray, scene.balls[i]);
+            if (intersection) {
+                closest.offer(intersection.value(), i, &scene.balls[i]);
+            }
+        }
+    } else {
+        BoxRay box_ray = make_box_ray(ray.from, ray.dir);
+        bvh_traverse(scene.ball_bvh, box_ray, closest.t, [&](int i) {
+            auto intersection = intersects_ball(ray, scene.balls[i]);
+            if (intersection) {
+                closest.offer(intersection.value(), i, &scene.balls[i]);
+            }
+        });
+    }
+    return finish_closest_hit(ray, scene, closest);
+}
+
+/*
+ * Returns the closest ball hit by the ray, or nothing if no ball is closer
+ * than max_hit_distance. On equal distances the ball with the lowest id wins.
+ */
+inline std::optional<Hit> closest_hit(const Ray& ray, const Scene &scene) {
+    ClosestHit closest;
+    return closest_hit_from(ray, scene, closest);
+}
+
+/*
+ * Like closest_hit, but only the count explicit balls listed in candidates
+ * are tested. The caller guarantees that the ray can not hit any other
+ * explicit ball, e.g. through screen space binning of primary rays.
+ */
+inline std::optional<Hit> closest_hit_among(const Ray& ray, const Scene &scene,
+        const int *candidates, int count) {
+    ClosestHit closest;
+    for (int c = 0; c < count; c++) {
+        int i = candidates[c];
+        auto intersection = intersects_ball(ray, scene.balls[i]);
+        if (intersection) {
+            closest.offer(intersection.value(), i, &scene.balls[i]);
+        }
+    }
+    return finish_closest_hit(ray, scene, closest);
+}
+
+/*
+ * Area lights are sampled by shadow rays. A surface point first gathers the
+ * balls that may block any of its shadow rays: those inside the cone from
+ * the point around the light's bounding sphere, found through the ball
+ * hierarchy. Most points have none and are fully lit without tracing a ray,
+ * and a point behind a single ball that hides the whole light is in the
+ * umbra, again without a ray. Only points with partial blockers trace shadow
+ * rays, and only against the blockers: first_shadow_samples rays, one in
+ * each quarter of the light. If they all agree the point is taken to be
+ * fully lit or fully shadowed, and otherwise the rest of the
+ * max_shadow_samples rays complete a stratification of the light.
+ * Instanced balls are gathered like explicit ones, so instances cast the
+ * shadows of their flattened copies. Paged balls are not gathered one by
+ * one; rays that may reach them are traced through their hierarchy.
+ */
+const int first_shadow_samples = 4;
+const int max_shadow_samples = 16;
+const int max_shadow_blockers = 32;
+
+struct ShadowCone {
+    Vector3 apex;
+    Vector3 axis;
+    double light_distance;
+    double light_radius;
+    double cos_half_angle;
+    double sin_half_angle;
+};
+
+enum class ConeOverlap { outside, around_apex, partly, covers };
+
+/*
+ * How the sphere at center with radius relates to the cone: whether it
+ * contains the apex, misses the cone or lies beyond the light, or covers all
+ * of the light as seen from the apex and in front of it.
+ */
+inline ConeOverlap sphere_cone_overlap(const ShadowCone &cone, const Vector3 &center, double radius) {
+    Vector3 to_center = center - cone.apex;
+    double distance = vector_length(to_center);
+    // With some slack so balls do not shadow the points on their own surface
+    if (distance <= radius * (1 + 1e-9) + 1e-9) {
+        return ConeOverlap::around_apex;
+    }
+    if (distance - radius >= cone.light_distance + cone.light_radius) {
+        return ConeOverlap::outside;
+    }
+    double sin_sphere = radius / distance;
+    double cos_sphere = std::sqrt(1 - sin_sphere * sin_sphere);
+    double cos_axis = vector_dot(to_center, cone.axis) / distance;
+    // The sphere overlaps the cone if its angle from the axis is below the
+    // sum of the half angles of both
+    if (cos_axis < cone.cos_half_angle * cos_sphere - cone.sin_half_angle * sin_sphere) {
+        return ConeOverlap::outside;
+    }
+    if (sin_sphere > cone.sin_half_angle &&
+            distance + radius <= cone.light_distance - cone.light_radius &&
+            cos_axis >= cone.cos_half_angle * cos_sphere + cone.sin_half_angle * sin_sphere) {
+        return ConeOverlap::covers;
+    }
+    return ConeOverlap::partly;
+}
+
+/*
+ * Point of light for (u, v) in [0, 1)^2. A sphere light is sampled on its
+ * disc facing the shaded point, with axis the direction towards its center,
+ * through the concentric mapping of the square onto the disc.
+ */
+inline Vector3 light_sample_point(const Light &light, const Vector3 &axis, double u, double v) {
+    if (light.shape == LightShape::rectangle) {
+        return light.pos + light.edge_u * u + light.edge_v * v;
+    }
+    Vector3 helper = std::abs(axis.x) < 0.9 ? Vector3{1, 0, 0} : Vector3{0, 1, 0};
+    Vector3 e1 = vector_normalized(vector_cross(axis, helper));
+    Vector3 e2 = vector_cross(axis, e1);
+    double a = 2 * u - 1;
+    double b = 2 * v - 1;
+    double r, phi;
+    const double quarter_pi = 0.78539816339744830962;
+    if (a == 0 && b == 0) {
+        r = 0;
+        phi = 0;
+    } else if (std::abs(a) > std::abs(b)) {
+        r = a;
+        phi = quarter_pi * (b / a);
+    } else {
+        r = b;
+        phi = 2 * quarter_pi - quarter_pi * (a / b);
+    }
+    r *= light.radius;
+    return light.pos + e1 * (r * std::cos(phi)) + e2 * (r * std::sin(phi));
+}
+
+/*
+ * splitmix64, seeded from the shaded point so that renders are repeatable
+ * and every sample of a pixel jitters its shadow rays differently.
+ */
+struct ShadowRandom {
+    uint64_t state;
+
+    double next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        z ^= z >> 31;
+        return (z >> 11) * 0x1.0p-53;
+    }
+};
+
+/*
+ * Fraction of light that point sees, from 0 in the umbra to 1 fully lit.
+ * Always 1 for point lights.
+ */
+inline double light_visibility(const Vector3 &point, const Light &light, const Scene &scene) {
+    if (light.shape == LightShape::point) {
+        return 1;
+    }
+    BoundingSphere bounds = light_bounds(light);
+    Vector3 to_light = bounds.center - point;
+    ShadowCone cone;
+    cone.apex = point;
+    cone.light_distance = vector_length(to_light);
+    cone.light_radius = bounds.radius;
+
+    Ball blockers[max_shadow_blockers];
+    int count = 0;
+    // Points within the bounds of the light, and points with too many
+    // blockers, test their shadow rays against the whole scene
+    bool whole_scene = cone.light_distance <= bounds.radius;
+    bool paged = scene.pages != nullptr;
+    if (!whole_scene) {
+        cone.axis = to_light / cone.light_distance;
+        cone.sin_half_angle = bounds.radius / cone.light_distance;
+        cone.cos_half_angle = std::sqrt(1 - cone.sin_half_angle * cone.sin_half_angle);
+        bool covered = false;
+        auto gather_ball = [&](const Ball &ball) {
+            switch (sphere_cone_overlap(cone, ball.pos, ball.radius)) {
+            case ConeOverlap::covers:
+                covered = true;
+                return false;
+            case ConeOverlap::partly:
+                if (count == max_shadow_blockers) {
+                    whole_scene = true;
+                } else {
+                    blockers[count++] = ball;
+                }
+                return true;
+            default:
+                return true;
+            }
+        };
+        auto gather = [&](int i) {
+            return gather_ball(scene.balls[i]);
+        };
+        auto box_overlaps = [&](const Aabb &box) {
+            Vector3 center = (box.lo + box.hi) * 0.5;
+            return sphere_cone_overlap(cone, center, vector_length(box.hi - box.lo) / 2) !=
+                ConeOverlap::outside;
+        };
+        if (scene.ball_bvh.nodes.empty()) {
+            for (int i = 0; i < static_cast<int>(scene.balls.size()) && gather(i); i++) {
+            }
+        } else {
+            bvh_query(scene.ball_bvh, box_overlaps, gather);
+        }
+        if (!covered) {
+            bvh_query(scene.instance_bvh, box_overlaps, [&](int p) {
+                const InstancePart &part = scene.instance_parts[p];
+                const Instance &instance = scene.instances[part.instance];
+                const Cluster &cluster = scene.clusters[instance.cluster];
+                bool more = true;
+                for_each_part_ball(cluster, part, [&](int b) {
+                    more = more && gather_ball(transform_ball(instance.transform, cluster.balls[b]));
+                });
+                return more;
+            });
+        }
+        if (covered) {
+            return 0;
+        }
+        // Only the bounds of all paged balls, so that a shadow query pages
+        // nothing in
+        if (paged) {
+            paged = box_overlaps(scene.pages->nodes[0].bounds);
+        }
+        if (count == 0 && !paged && !whole_scene) {
+            return 1;
+        }
+    } else {
+        cone.axis = vector_length(to_light) > 0 ? to_light / cone.light_distance : Vector3{0, 0, 1};
+    }
+
+    // Seeded from the point on a grid of 2^-20, so the same point computed
+    // with different rounding, as in the fast math tier, mostly gets the
+    // same samples
+    uint64_t seed = 14695981039346656037ull;
+    hash_vector(seed, {std::floor(point.x * 1048576), std::floor(point.y * 1048576),
+        std::floor(point.z * 1048576)});
+    ShadowRandom random = {seed};
+    auto visible = [&](int cell) {
+        const int strata = 4;
+        Vector3 target = light_sample_point(light, cone.axis,
+            (cell % strata + random.next()) / strata, (cell / strata + random.next()) / strata);
+        Ray ray = {point, target - point};
+        double distance = vector_length(ray.dir);
+        if (whole_scene) {
+            auto hit = closest_hit(ray, scene);
+            return !hit || hit->t >= distance;
+        }
+        for (int c = 0; c < count; c++) {
+            auto intersection = intersects_ball(ray, blockers[c]);
+            if (intersection && intersection.value() < distance) {
+                return false;
+            }
+        }
+        if (paged) {
+            // Classified as the gathering does, so paged balls cast the
+            // shadows they would cast in memory
+            bool blocked = false;
+            double t_max = distance;
+            ball_pages_traverse(*scene.pages, make_box_ray(ray.from, ray.dir), t_max, [&](long i) {
+                const Ball &ball = scene.pages->ball(i);
+                ConeOverlap overlap = blocked ? ConeOverlap::outside :
+                    sphere_cone_overlap(cone, ball.pos, ball.radius);
+                if (overlap == ConeOverlap::outside || overlap == ConeOverlap::around_apex) {
+                    return;
+                }
+                auto intersection = intersects_ball(ray, ball);
+                if (overlap == ConeOverlap::covers || (intersection && intersection.value() < distance)) {
+                    blocked = true;
+                    t_max = -1;
+                }
+            });
+            if (blocked) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    // One sample in a random cell of each quarter of the 4x4 strata
+    bool taken[max_shadow_samples] = {};
+    int lit = 0;
+    for (int quarter = 0; quarter < first_shadow_samples; quarter++) {
+        int cx = quarter % 2 * 2 + (random.next() < 0.5 ? 0 : 1);
+        int cy = quarter / 2 * 2 + (random.next() < 0.5 ? 0 : 1);
+        taken[cx + cy * 4] = true;
+        lit += visible(cx + cy * 4);
+    }
+    if (lit == 0 || lit == first_shadow_samples) {
+        return static_cast<double>(lit) / first_shadow_samples;
+    }
+    for (int cell = 0; cell < max_shadow_samples; cell++) {
+        if (!taken[cell]) {
+            lit += visible(cell);
+        }
+    }
+    return static_cast<double>(lit) / max_shadow_samples;
+}
+
+/*
+ * The geometry of a hit as seen from the ray: where it is, the surface
+ * normal there and the direction back to where the ray came from.
+ */
+struct SurfacePoint {
+    Vector3 point;
+    Vector3 normal;
+    Vector3 camera_vector;
+};
+
+inline SurfacePoint surface_point(const Ray& ray, const Ball& ball, double t) {
+    Vector3 intersection_point = (vector_normalized(ray.dir) * t) + ray.from;
+    Vector3 normal_vector = vector_normalized(intersection_point - ball.pos);
+    Vector3 camera_vector = vector_normalized(ray.from - intersection_point);
+    return {intersection_point, normal_vector, camera_vector};
+}
+
+/*
+ * Color of ball at the surface point lit by the light of scene, of which
+ * the point sees the fraction visibility, without reflections.
+ */
+inline Color shade_local(const SurfacePoint &surface, const Ball& ball, const Scene &scene, double visibility) {
+    const Light &light = scene.lights[0]; // TODO: Handle more than one light
+    Vector3 light_dir = light_bounds(light).center - surface.point;
+    if (math_tier == MathTier::fast) {
+        return ball.color * light.intensity *
+            fast_light_intensity(surface.normal, light_dir, surface.camera_vector,
+                    ball.specular_parameter, visibility);
+    }
+    return ball.color * light.intensity *
+        light_intensity(
+            vector_normalized(surface.normal),
+            light_dir,
+            surface.camera_vector,
+            ball.specular_parameter,
+            visibility);
+}
+
+/*
+ * Color of ball at the surface point lit by the light of scene, without
+ * reflections.
+ */
+inline Color shade_local(const SurfacePoint &surface, const Ball& ball, const Scene &scene) {
+    return shade_local(surface, ball, scene, light_visibility(surface.point, scene.lights[0], scene));
+}
+
+inline Ray reflected_ray(const SurfacePoint &surface) {
+    return {
+        surface.point,
+        surface.normal * (vector_dot(surface.normal, surface.camera_vector) * 2) - surface.camera_vector,
+    };
+}
+
+/*
+ * False if ball reflects nothing: reflective_parameter is the weight of the
+ * locally lit color, so at 1 the reflected color gets no weight and its ray
+ * need not be traced.
+ */
+inline bool reflects(const Ball &ball) {
+    return ball.reflective_parameter != 1;
+}
+
+struct Shading {
+    Color local_color;
+    Ray reflected;
+};
+
+/*
+ * Computes the locally lit color at the point where ray hits ball at
+ * parameter t, together with the mirror reflection of the ray at that point.
+ */
+inline Shading shade_hit(const Ray& ray, const Ball& ball, double t, const Scene &scene) {
+    SurfacePoint surface = surface_point(ray, ball, t);
+    return {shade_local(surface, ball, scene), reflected_ray(surface)};
+}
+
+/*
+ * Returns the color resulting from casting the ray, ray in the scene, where
+ * hit is the closest hit of the ray.
+ */
+inline Color cast_ray_from_hit(const Ray& ray, const std::optional<Hit> &hit,
+        const Scene &scene, int recursion_depth);
+
+/*
+ * Returns the color resulting from casting the ray, ray in the scene.
+ * Recursion depth should be set to zero when calling from outside function.
+ */
+inline Color cast_ray(const Ray& ray, const Scene &scene, int recursion_depth) {
+    return cast_ray_from_hit(ray, closest_hit(ray, scene), scene, recursion_depth);
+}
+
+inline Color cast_ray_from_hit(const Ray& ray, const std::optional<Hit> &hit,
+        const Scene &scene, int recursion_depth) {
+
+    if (!hit) {
+        return background_color;
+    }
+
+    const Ball &ball = hit->ball;
+    Shading shading = shade_hit(ray, ball, hit->t, scene);
+    if (recursion_depth < max_recursion_depth && reflects(ball)) {
+        Color reflected_color = cast_ray(shading.reflected, scene, recursion_depth+1);
+        return color_linear_interpolate(shading.local_color, reflected_color, ball.reflective_parameter);
+    }
+    return shading.local_color;
+}
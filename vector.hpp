@@ -7,34 +7,38 @@ struct Vector3 {
     double z;
 };
 
-Vector3 operator+(const Vector3 &a, const Vector3 &b) {
+inline Vector3 operator+(const Vector3 &a, const Vector3 &b) {
     return {a.x + b.x, a.y + b.y, a.z + b.z};
 }
 
-Vector3 operator-(const Vector3 &a, const Vector3 &b) {
+inline Vector3 operator-(const Vector3 &a, const Vector3 &b) {
     return {a.x - b.x, a.y - b.y, a.z - b.z};
 }
 
-Vector3 operator/(const Vector3 &a, const double b) {
+inline Vector3 operator/(const Vector3 &a, const double b) {
     return {a.x/b, a.y/b, a.z/b};
 }
 
-Vector3 operator*(const Vector3 &a, const double b) {
+inline Vector3 operator*(const Vector3 &a, const double b) {
     return {a.x*b, a.y*b, a.z*b};
 }
 
-double vector_length(const Vector3 &v) {
+inline double vector_length(const Vector3 &v) {
     return std::sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
 }
 
-double vector_dot(const Vector3 &a, const Vector3 b) {
+inline double vector_dot(const Vector3 &a, const Vector3 b) {
     return a.x*b.x + a.y*b.y + a.z*b.z;
 }
 
-Vector3 vector_normalized(const Vector3 &v) {
+inline Vector3 vector_cross(const Vector3 &a, const Vector3 &b) {
+    return {a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x};
+}
+
+inline Vector3 vector_normalized(const Vector3 &v) {
     return v/vector_length(v); 
 }
 
-void print_vector(const Vector3& v) {
+inline void print_vector(const Vector3& v) {
     printf("(%f, %f, %f)\n", v.x, v.y, v.z);
 }
@@ -0,0 +1,185 @@
+#pragma once
+#include <vector>
+#include <memory_resource>
+#include <algorithm>
+#include <cstdint>
+
+#include "interleave.hpp"
+#include "trace.hpp"
+
+/*
+ * A ray waiting in a wavefront queue. pixel is the index of the output color
+ * the ray contributes to and key is the sort key used to reorder the queue.
+ */
+struct QueuedRay {
+    Ray ray;
+    int pixel;
+    uint64_t key;
+};
+
+/*
+ * One bounce of a traced path: the locally lit color of the hit and the
+ * weight it gets against the color of the reflected ray. The last vertex of a
+ * path is terminal and its color is used as is.
+ */
+struct PathVertex {
+    Color color;
+    double reflective_parameter;
+    bool terminal;
+};
+
+/*
+ * Spreads the lower 10 bits of v so that there are two zero bits between
+ * each of them.
+ */
+inline uint64_t morton_spread(uint64_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+/*
+ * Sort key of a ray: the octant of its direction in the top bits followed by
+ * the Morton code of its origin quantized to 10 bits per axis within the box
+ * starting at lo with size extent. Rays with equal keys start close to each
+ * other and travel in roughly the same direction.
+ */
+inline uint64_t ray_sort_key(const Ray& ray, const Vector3& lo, const Vector3& extent) {
+    uint64_t octant = (ray.dir.x < 0 ? 4 : 0) | (ray.dir.y < 0 ? 2 : 0) | (ray.dir.z < 0 ? 1 : 0);
+    auto quantize = [](double v, double lo, double extent) {
+        double f = extent > 0 ? (v - lo) / extent : 0.0;
+        return static_cast<uint64_t>(std::clamp(f, 0.0, 1.0) * 1023);
+    };
+    uint64_t morton =
+        (morton_spread(quantize(ray.from.x, lo.x, extent.x)) << 2) |
+        (morton_spread(quantize(ray.from.y, lo.y, extent.y)) << 1) |
+        morton_spread(quantize(ray.from.z, lo.z, extent.z));
+    return (octant << 30) | morton;
+}
+
+/*
+ * Sorting pays for itself only when consecutive rays of the queue have
+ * drifted apart. Reflections off one ball stay together in pixel order, so
+ * the queue is only sorted when more than this fraction of consecutive rays
+ * travel in different octants.
+ */
+const double sort_min_incoherence = 0.25;
+
+inline bool rays_incoherent(const std::pmr::vector<QueuedRay> &queue) {
+    auto octant = [](const Ray &ray) {
+        return (ray.dir.x < 0 ? 4 : 0) | (ray.dir.y < 0 ? 2 : 0) | (ray.dir.z < 0 ? 1 : 0);
+    };
+    size_t changes = 0;
+    for (size_t i = 1; i < queue.size(); i++) {
+        changes += octant(queue[i].ray) != octant(queue[i - 1].ray);
+    }
+    return changes > sort_min_incoherence * queue.size();
+}
+
+/*
+ * Reorders the queue by direction octant and origin Morton code so that
+ * consecutive rays are traced through the same part of the scene.
+ */
+inline void sort_rays(std::pmr::vector<QueuedRay> &queue) {
+    if (queue.empty()) {
+        return;
+    }
+    Vector3 lo = queue[0].ray.from;
+    Vector3 hi = queue[0].ray.from;
+    for (auto &q : queue) {
+        lo = {std::min(lo.x, q.ray.from.x), std::min(lo.y, q.ray.from.y), std::min(lo.z, q.ray.from.z)};
+        hi = {std::max(hi.x, q.ray.from.x), std::max(hi.y, q.ray.from.y), std::max(hi.z, q.ray.from.z)};
+    }
+    Vector3 extent = hi - lo;
+    for (auto &q : queue) {
+        q.key = ray_sort_key(q.ray, lo, extent);
+    }
+    std::sort(queue.begin(), queue.end(),
+            [](const QueuedRay &a, const QueuedRay &b) { return a.key < b.key; });
+}
+
+/*
+ * Breadth first alternative to calling cast_ray for every pixel. All rays of
+ * one bounce are traced before any ray of the next bounce, which allows the
+ * queue of reflected rays to be sorted for coherence when sort is set and
+ * the rays have lost it (see rays_incoherent), and the rays of a bounce to
+ * be traced interleaved when interleave is set (see interleave.hpp).
+ *
+ * queue holds the primary rays, one per pixel index, and is consumed. colors
+ * must have one entry per pixel index; the result is the same as cast_ray
+ * would give for each primary ray. Returns the number of rays traced.
+ * Temporary buffers come from the memory resource of colors.
+ *
+ * If candidates is not null, primary rays only test the candidate_count
+ * explicit balls it lists (see closest_hit_among).
+ */
+inline long trace_wavefront(std::pmr::vector<QueuedRay> &queue,
+        const Scene &scene,
+        bool sort, bool interleave, std::pmr::vector<Color> &colors,
+        const int *candidates = nullptr, int candidate_count = 0) {
+
+    const int path_length = max_recursion_depth + 1;
+    std::pmr::vector<PathVertex> vertices(colors.size() * path_length, colors.get_allocator());
+    std::pmr::vector<QueuedRay> next(colors.get_allocator());
+    next.reserve(queue.size());
+    std::pmr::vector<Ray> rays_of_bounce(colors.get_allocator());
+    std::pmr::vector<std::optional<Hit>> hits(colors.get_allocator());
+    long rays = 0;
+
+    for (int depth = 0; depth < path_length && !queue.empty(); depth++) {
+        // Primary rays are already coherent in pixel order
+        if (sort && depth > 0 && rays_incoherent(queue)) {
+            sort_rays(queue);
+        }
+        next.clear();
+        bool interleaved = interleave && !(depth == 0 && candidates);
+        if (interleaved) {
+            rays_of_bounce.clear();
+            for (auto &q : queue) {
+                rays_of_bounce.push_back(q.ray);
+            }
+            hits.resize(queue.size());
+            closest_hits(rays_of_bounce.data(), static_cast<int>(queue.size()), scene, hits.data());
+        }
+        for (size_t r = 0; r < queue.size(); r++) {
+            const QueuedRay &q = queue[r];
+            PathVertex &vertex = vertices[q.pixel * path_length + depth];
+            auto hit = interleaved ? hits[r] :
+                depth == 0 && candidates ?
+                closest_hit_among(q.ray, scene, candidates, candidate_count) :
+                closest_hit(q.ray, scene);
+            if (!hit) {
+                vertex = {background_color, 0, true};
+                continue;
+            }
+            const Ball &ball = hit->ball;
+            Shading shading = shade_hit(q.ray, ball, hit->t, scene);
+            if (depth < max_recursion_depth && reflects(ball)) {
+                vertex = {shading.local_color, ball.reflective_parameter, false};
+                next.push_back({shading.reflected, q.pixel, 0});
+            } else {
+                vertex = {shading.local_color, 0, true};
+            }
+        }
+        rays += queue.size();
+        std::swap(queue, next);
+    }
+
+    // Blend each path back to front the same way cast_ray unwinds
+    for (size_t pixel = 0; pixel < colors.size(); pixel++) {
+        const PathVertex *path = &vertices[pixel * path_length];
+        int last = 0;
+        while (last < max_recursion_depth && !path[last].terminal) {
+            last++;
+        }
+        Color c = path[last].color;
+        for (int depth = last - 1; depth >= 0; depth--) {
+            c = color_linear_interpolate(path[depth].color, c, path[depth].reflective_parameter);
+        }
+        colors[pixel] = c;
+    }
+    return rays;
+}